@@ -0,0 +1,33 @@
+// Copy to include/secrets.h (not committed) and fill in. Without it the
+// firmware does not build; CI, which has no secrets, builds against this
+// file with -D SECRETS_EXAMPLE_OK (PLATFORMIO_BUILD_FLAGS), never to flash.
+#pragma once
+
+// --- FIREBASE ---
+#define FIREBASE_HOST "https://<project>-default-rtdb.firebaseio.com/"
+#define FIREBASE_AUTH "<database secret>"
+#define FIREBASE_HOSTNAME "<project>-default-rtdb.firebaseio.com"
+
+// --- COMMAND KEYS ---
+// 32 random bytes per door for signing commands, e.g. from
+// python3 -c "import os; print(', '.join('0x%02x' % b for b in os.urandom(32)))"
+// The bridge gets every key in DOOR_KEYS, door 1 first. Each Uno only gets
+// its own: a direct Uno DOOR_KEY_1, a door on a bus DOOR_KEY_<n> for the
+// address it is built for (env:uno_gateway_<n>), so every env needs its key.
+#define DOOR_KEY_1 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+#define DOOR_KEY_2 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+#define DOOR_KEY_3 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+#define DOOR_KEY_4 {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, \
+                    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00}
+#define DOOR_KEYS {DOOR_KEY_1, DOOR_KEY_2, DOOR_KEY_3, DOOR_KEY_4}
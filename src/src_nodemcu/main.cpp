@@ -3,35 +3,898 @@
 #include <ESP8266WebServer.h>
 #include <WiFiManager.h>
 #include <FirebaseESP8266.h>
+#include <ESP8266HTTPClient.h>
+#include <Updater.h>
+#include <Ticker.h>
+#include <LittleFS.h>
+#include <sys/time.h>
+#include <bearssl/bearssl.h>
+#if __has_include("secrets.h")
+#include "secrets.h" // FIREBASE_HOST, FIREBASE_AUTH, door keys; see secrets.example.h
+#elif defined(SECRETS_EXAMPLE_OK) // CI only: a build that is never flashed
+#warning "include/secrets.h not found: building with the placeholders of secrets.example.h"
+#include "secrets.example.h"
+#else
+#error "include/secrets.h not found: copy include/secrets.example.h and fill it in"
+#endif
 
-#define FIREBASE_HOST "https://smart-lock-app-4123a-default-rtdb.firebaseio.com/"
-#define FIREBASE_AUTH "HJY2VyeaNsORzCL5HFqUoiUwSGDErXsnxH0WCs5m"
+#define FIRMWARE_BUILD __DATE__ " " __TIME__
+#define FIRMWARE_VERSION "1.0.0"
+
+// --- FIREBASE PATHS ---
+// Built at compile time so polling never allocates a String per request.
+#define LOCK_PATH "/smart_lock"
+const char PATH_COMMANDS[] = LOCK_PATH "/commands";
+const char PATH_LOGS[] = LOCK_PATH "/logs";
+const char PATH_STATUS[] = LOCK_PATH "/status";
+const char PATH_STATUS_DESIRED_VERSION[] = LOCK_PATH "/status/desiredVersion";
+const char PATH_DESIRED[] = LOCK_PATH "/desired";
+const char PATH_STATUS_LINK[] = LOCK_PATH "/status/link";
+const char PATH_STATUS_HEAP[] = LOCK_PATH "/status/heap";
+const char PATH_STATUS_SERVO[] = LOCK_PATH "/status/servo";
+const char PATH_STATUS_MAX_LOOP_US[] = LOCK_PATH "/status/controllerMaxLoopUs";
+const char PATH_STATUS_WHEEL[] = LOCK_PATH "/status/timerWheel";
+const char PATH_STATUS_JITTER[] = LOCK_PATH "/status/patternJitter";
+const char PATH_STATUS_AUTH[] = LOCK_PATH "/status/auth";
+const char PATH_STATUS_LAST_TRACE[] = LOCK_PATH "/status/lastTrace";
+const char PATH_TRACES[] = LOCK_PATH "/traces";
+const char PATH_CONFIG[] = LOCK_PATH "/config";
+const char PATH_CONFIG_VERSION[] = LOCK_PATH "/config/version";
+const char PATH_STATUS_CONFIG[] = LOCK_PATH "/status/config";
+const char PATH_RULES[] = LOCK_PATH "/rules";
+const char PATH_RULES_VERSION[] = LOCK_PATH "/rules/version";
+const char PATH_STATUS_RULES[] = LOCK_PATH "/status/rules";
+const char PATH_STATUS_BOOT[] = LOCK_PATH "/status/boot";
+const char PATH_STATUS_UNO_BOOT[] = LOCK_PATH "/status/boot/uno";
+const char PATH_STATUS_RFID[] = LOCK_PATH "/status/rfid";
+const char PATH_STATUS_DOOR[] = LOCK_PATH "/status/door";
+const char PATH_TELEMETRY[] = LOCK_PATH "/telemetry";
+const char PATH_STATUS_POWER[] = LOCK_PATH "/status/power";
+const char PATH_OTA[] = LOCK_PATH "/ota";
+const char PATH_STATUS_OTA[] = LOCK_PATH "/status/ota";
+const char PATH_STATUS_UNO_FIRMWARE[] = LOCK_PATH "/status/firmware/uno";
+const char PATH_HISTORY[] = LOCK_PATH "/history";
+const char PATH_STATUS_HISTORY[] = LOCK_PATH "/status/history";
+const char PATH_STATUS_HISTORY_BENCH[] = LOCK_PATH "/status/history/bench";
 
 const int TAMPER_WAKE_PIN = D1;
 const int REG_MODE_WAKE_PIN = D2;
 const int LOCK_STATUS_PIN = D5;
+// The Uno holds each 3-bit code for 2 s with a 256 ms low gap between codes.
+// The pins are sampled every idle tick and a code is acted on once, when it
+// appears; a second read a moment later skips the in-between codes the Uno's
+// three separate pin writes pass through.
+const unsigned int WAKE_CONFIRM_US = 50;
+int lastWakeSignal = 0;
+const int POWER_MUX_PIN = D0;  // analog switch select: LOW = battery, HIGH = panel
+const int UNO_RESET_PIN = D6; // to the Uno's RESET, like a USB adapter's DTR line
 unsigned long lastSerialCheckTime = 0;
 const unsigned long SERIAL_CHECK_INTERVAL = 5000; // 5 seconds
 bool serialReceivedInLastInterval = false;
 
+// --- TIME & TRACING ---
+// SNTP gives the bridge wall-clock time. A remote command gets a small trace
+// number that travels with it over the UART; the Uno reports when it got the
+// command and when the bolt settled in its own millis(), which we map onto
+// our clock using the arrival time of that report. Finished traces go to a
+// ring of TRACE_SLOTS records under /traces, so the node stays bounded.
+const time_t MIN_VALID_EPOCH = 1600000000; // anything earlier means the clock is unset
+const int COMMAND_ID_LENGTH = 32;
+const unsigned long SNTP_WAIT_MS = 5000;
+const unsigned long TRACE_TIMEOUT_MS = 30000;
+const int TRACE_SLOTS = 32;
+const unsigned long POLL_INTERVAL_MS = 1000;
+
+struct CommandTrace {
+  bool active;
+  bool boltDone;
+  uint16_t number;
+  char id[COMMAND_ID_LENGTH + 1];
+  uint64_t issuedMs;  // app, 0 if unknown
+  uint64_t fetchedMs; // bridge read it from Firebase
+  uint64_t uartMs;    // bridge wrote it to the Uno
+  uint64_t unoRecvMs; // Uno received it (mapped onto bridge time)
+  uint64_t boltMs;    // Uno finished the move (mapped)
+  unsigned long startedMillis;
+};
+CommandTrace trace = {false, false, 0, "", 0, 0, 0, 0, 0, 0};
+uint16_t nextTraceNumber = 1;
+uint64_t linkLineEpochMs = 0; // when the current controller line finished arriving
+unsigned long linkLineMicros = 0; // the same, for timing reactions to it
+
+// --- REMOTE CONFIGURATION ---
+// /config holds a versioned settings document. We poll only its version and
+// fetch the document when that changes, then forward the values that differ
+// from what the Uno was last sent as "CFG key=value" lines followed by
+// "CFG_COMMIT <version>". The Uno answers "@CFG,<version>,<keys>" once it has
+// applied and persisted them; it also sends that line at boot. A gateway
+// instead keeps the whole document and queues it to each door that does
+// not hold its version yet (pumpDoorConfig()), tracking the acks per door.
+const unsigned long CONFIG_CHECK_INTERVAL = 60000;
+const int CONFIG_VALUE_LENGTH = 10; // a uint32_t; "CFG pinTimeoutMs=<10>" is a signed line's longest
+
+struct ConfigKey {
+  const char* firebaseKey;
+  const char* unoKey;
+};
+const ConfigKey CONFIG_KEYS[] = {
+  {"masterPin", "pin"},
+  {"adminPin", "admin"},
+  {"wifiIntervalMs", "wifiMs"},
+  {"lockIntervalMs", "lockMs"},
+  {"autoLockMs", "autoLockMs"},
+  {"pinTimeoutMs", "pinTimeoutMs"},
+  {"closeLockMs", "closeLockMs"}, // 0 = off; the closed-for-120 s rule is the default
+};
+const int CONFIG_KEY_COUNT = sizeof(CONFIG_KEYS) / sizeof(CONFIG_KEYS[0]);
+
+char forwardedConfig[CONFIG_KEY_COUNT][CONFIG_VALUE_LENGTH + 1]; // acked by the Uno, "" = not yet
+char sentConfig[CONFIG_KEY_COUNT][CONFIG_VALUE_LENGTH + 1];      // what the pending push holds
+long configVersion = -1;        // gateway: the version sentConfig holds in full
+long unoConfigVersion = -1;     // what the Uno last reported holding
+long pendingConfigVersion = -1; // sent, waiting for the Uno's ack
+unsigned long configSentMillis = 0;
+uint64_t configUpdatedAtMs = 0; // /config/updatedAt, if the app writes it
+int configBytesSent = 0;
+unsigned long lastConfigCheckTime = 0;
+bool configCheckDue = true;
+bool configFetchDue = false; // the version changed; loop() fetches the document
+long configFetchVersion = 0;
+unsigned long registrationWindowMs = 60000; // bridge-side setting: /config/regWindowMs
+
+// --- CONTROLLER CLOCK ---
+// Guest PINs and daily schedules run on the Uno, which has no clock of its
+// own: once SNTP has the time we send "CLOCK <second of day>", local time
+// by /config/utcOffsetMin, after every Uno boot and then hourly.
+const unsigned long CLOCK_SEND_INTERVAL = 3600000;
+long utcOffsetMinutes = 0; // bridge-side setting: /config/utcOffsetMin
+bool controllerClockDue = true;
+unsigned long lastClockSentMillis = 0;
+
+// --- SIGNED COMMANDS ---
+// The Uno only obeys lock and settings commands signed with its door's key
+// (see the Uno's SIGNED COMMANDS): "AUTH <counter> <tag> <command>".
+// Counters must rise, so we use the epoch second, or one more than the last
+// counter when that is not higher. Every @AUTH from a door carries the
+// counter it holds and we catch up to it, which covers a bridge restart
+// with no clock yet; at boot "AUTH_SYNC" asks for it before the first
+// command. Commands are capped so a gateway frame fits a door's 64-byte
+// receive buffer.
+const uint8_t COMMAND_KEYS[][32] = DOOR_KEYS;
+const int COMMAND_KEY_COUNT = sizeof(COMMAND_KEYS) / sizeof(COMMAND_KEYS[0]);
+const int AUTH_TAG_BYTES = 8;
+const int AUTH_PREFIX_LENGTH = 31; // "AUTH <counter> <tag> "
+const int AUTH_COMMAND_LENGTH = 28;
+const int AUTH_LINE_LENGTH = AUTH_PREFIX_LENGTH + AUTH_COMMAND_LENGTH;
+
+struct AuthStats {
+  unsigned long accepted;
+  unsigned long rejected;
+  long lastUs;  // the Uno's check time
+  long maxUs;
+};
+
+uint32_t commandCounter = 0;
+AuthStats authStats = {0, 0, 0, 0};
+
+// --- FIRMWARE UPDATES ---
+// An "update" command makes the bridge read /ota:
+//   bridge: {version, deltaUrl, baseMd5, md5, fullUrl, fullMd5}
+//   uno:    {version, url, size, sha256}
+// The bridge prefers a delta against the image it is running (checked by
+// MD5) and falls back to the full image, which may be gzipped; eboot
+// inflates it on the next boot. md5 is that of the image the delta builds,
+// fullMd5 that of the file at fullUrl; the Updater checks them before it
+// marks the new image bootable, and an update without them is refused.
+// The Uno is reflashed over our UART by talking STK500v1 to its Optiboot
+// bootloader after pulsing RESET, from a copy staged in LittleFS whose size
+// and SHA-256 have been checked first. tools/make_delta.py builds deltas in
+// the format applyDelta() reads; tools/ota_server.py serves a release
+// locally and prints its /ota document.
+const uint32_t DELTA_MAGIC = 0x31444C53; // "SLD1", little endian
+const uint8_t DELTA_END = 0x00;
+const uint8_t DELTA_COPY_BASE = 0x01;  // varint offset, varint length: from the running image
+const uint8_t DELTA_COPY_BACK = 0x02;  // varint distance, varint length: from recent output
+const uint8_t DELTA_LITERAL = 0x03;    // varint length, raw bytes
+const size_t DELTA_WINDOW_SIZE = 2048;
+const unsigned long OTA_READ_TIMEOUT_MS = 10000;
+
+const uint8_t STK_OK = 0x10;
+const uint8_t STK_INSYNC = 0x14;
+const uint8_t STK_CRC_EOP = 0x20;
+const uint8_t STK_GET_SYNC = 0x30;
+const uint8_t STK_ENTER_PROGMODE = 0x50;
+const uint8_t STK_LEAVE_PROGMODE = 0x51;
+const uint8_t STK_LOAD_ADDRESS = 0x55;
+const uint8_t STK_PROG_PAGE = 0x64;
+const uint8_t STK_READ_PAGE = 0x74;
+const int UNO_PAGE_SIZE = 128;
+const uint32_t UNO_APP_MAX_BYTES = 32256; // 32 KB minus the 512-byte Optiboot section
+const int STK_SYNC_ATTEMPTS = 10;
+const unsigned long STK_REPLY_TIMEOUT_MS = 500;
+const char UNO_STAGING_PATH[] = "/uno.bin";
+const int MD5_HEX_LENGTH = 32;
+const int SHA256_HEX_LENGTH = 64;
+
+bool updateRequested = false;
+uint8_t deltaWindow[DELTA_WINDOW_SIZE];
+uint32_t deltaWritten = 0;
+uint8_t otaBuffer[256] __attribute__((aligned(4)));
+
+struct UpdateReport {
+  const char* target;
+  const char* mode;
+  uint32_t transferBytes; // what came over the network
+  uint32_t imageBytes;    // size of the image that ended up in flash
+  unsigned long ms;
+  bool ok;
+  const char* error;      // why it was refused before flashing, or nullptr
+};
+
+// --- RECOVERY ---
+// The core's hardware and software watchdogs catch code that stops
+// yielding; the supervisor catches the rest (a Firebase call or portal that
+// keeps yielding but never returns) by resetting if loop() stops coming
+// round. State worth keeping goes into RTC memory, which survives any reset
+// short of a power cut, so a warm boot rejoins the AP on the known channel
+// and BSSID instead of scanning and does not wait for SNTP.
+const uint32_t CHECKPOINT_MAGIC = 0x5C0B0001;
+const unsigned long LOOP_STALL_LIMIT_MS = 60000;
+const unsigned long BOOT_STALL_LIMIT_MS = 660000; // covers the 600 s setup portal
+const unsigned long FAST_CONNECT_TIMEOUT_MS = 4000;
+const int PUSH_KEY_LENGTH = 20; // a Firebase push key, as queued under /commands
+
+struct BridgeCheckpoint {
+  uint32_t magic;
+  uint32_t crc;
+  uint32_t bootCount;
+  uint32_t supervisorResets;
+  int8_t isLocked;
+  uint8_t channel;
+  uint8_t bssid[6];
+  char lastDrainedKey[PUSH_KEY_LENGTH + 1]; // the compiler pads the struct to a word
+};
+static_assert(sizeof(BridgeCheckpoint) % 4 == 0, "RTC memory is word addressed");
+
+BridgeCheckpoint checkpoint;
+bool checkpointRestored = false;
+Ticker supervisor;
+volatile unsigned long lastLoopProgress = 0;
+volatile unsigned long stallLimitMs = BOOT_STALL_LIMIT_MS;
+volatile bool checkpointBusy = false; // saveCheckpoint() is filling it in
+
+// --- ACCESS HISTORY ---
+// PINs, cards, remote locks and unlocks, tamper, forced doors and rule
+// reactions are kept in LittleFS as 8-byte records, one file per UTC day
+// under /access, appended in time order. The shard index (day, records) is
+// rebuilt from the directory at boot and kept in RAM, so a range query only
+// opens the days it covers and binary-searches the first one for its start.
+// Nothing goes to Firebase until the app asks: a "history" command
+// {from, to, limit, cursor, door} writes one page to /history/<id> as
+// "epoch,type,door,arg;..." plus the cursor of the next page, 0 when there
+// is none. The oldest day goes when a new one starts and there are
+// ACCESS_MAX_SHARDS or the filesystem is three quarters full. Without a
+// valid clock a record has no day and is dropped. Appends are synced to
+// flash every ACCESS_FLUSH_RECORDS records (one 256-byte LittleFS page) or
+// ACCESS_FLUSH_MS, not per record, which would rewrite the tail page and
+// commit metadata 32 times as often; a crash loses at most that window. A
+// "historyBench" command times ACCESS_BENCH_RECORDS scratch appends and a
+// run of page queries over them, in slices of ACCESS_BENCH_SLICE_MS from
+// the idle loop so the link is still served, and reports the flash and
+// syncs they took under status/history/bench.
+const uint32_t SECONDS_PER_DAY = 86400;
+const int ACCESS_MAX_SHARDS = 120;
+const int ACCESS_PAGE_MAX = 50;
+const int ACCESS_PATH_LENGTH = 24;
+const uint32_t ACCESS_BENCH_RECORDS = 10000;
+const uint32_t ACCESS_BENCH_DAYS = 10;
+const int ACCESS_BENCH_QUERIES = 20;
+const unsigned long ACCESS_BENCH_SLICE_MS = 10;
+const uint16_t ACCESS_FLUSH_RECORDS = 32;
+const unsigned long ACCESS_FLUSH_MS = 10000;
+
+struct AccessRecord {
+  uint32_t epoch;
+  uint8_t type;
+  uint8_t door;
+  uint16_t arg;
+};
+static_assert(sizeof(AccessRecord) == 8, "shards are read by record offset");
+
+enum AccessType : uint8_t {
+  ACCESS_PIN_OK = 0,
+  ACCESS_PIN_BAD,
+  ACCESS_CARD_OK,
+  ACCESS_CARD_DENIED,
+  ACCESS_REMOTE_LOCK,
+  ACCESS_REMOTE_UNLOCK,
+  ACCESS_TAMPER,
+  ACCESS_FORCED,
+  ACCESS_RULE,
+  ACCESS_TYPE_COUNT
+};
+const char* const ACCESS_TYPE_NAMES[ACCESS_TYPE_COUNT] = {
+  "pinOk", "pinBad", "cardOk", "cardDenied", "remoteLock", "remoteUnlock", "tamper", "forced", "rule"
+};
+
+struct AccessShard {
+  uint16_t day;   // epoch / SECONDS_PER_DAY
+  uint16_t count;
+};
+
+struct AccessLog {
+  const char* dir;
+  AccessShard shards[ACCESS_MAX_SHARDS]; // oldest first
+  int shardCount;
+  File file;               // the newest shard, open for appending
+  uint16_t fileDay;
+  uint16_t unflushed;      // records written since the last sync
+  unsigned long unflushedSinceMs;
+  unsigned long flushes;
+};
+
+struct HistoryQuery {
+  bool pending;
+  char id[COMMAND_ID_LENGTH + 1];
+  uint32_t from;
+  uint32_t to;
+  uint32_t cursor; // day << 16 | record index, 0 = start at `from`
+  int limit;
+  uint8_t door;    // 0 = all
+};
+
+// A historyBench in progress: appends first, then queries
+struct HistoryBench {
+  AccessLog* log; // the scratch log, nullptr when no bench is running
+  uint32_t first;
+  uint32_t step;  // records appended, then ACCESS_BENCH_RECORDS + queries run
+  uint32_t appended;
+  unsigned long appendTotalUs;
+  unsigned long appendMaxUs;
+  unsigned long queryTotalMs;
+  unsigned long queryMaxMs;
+  size_t usedBefore;
+  size_t usedAfter;
+};
+
+AccessLog accessLog = {"/access", {}, 0, File(), 0, 0, 0, 0};
+bool accessReady = false;
+unsigned long accessAppends = 0;
+unsigned long accessAppendTotalUs = 0;
+unsigned long accessAppendMaxUs = 0;
+unsigned long accessDropped = 0;
+HistoryQuery historyQuery = {false, "", 0, 0, 0, 0, 0};
+bool historyBenchRequested = false;
+HistoryBench historyBench = {nullptr, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// --- POWER MONITOR ---
+// The Uno has no analog pins left, so the battery and panel dividers share
+// the bridge's A0 through an analog switch. Samples alternate between the
+// two, are averaged into one point per minute on each, and go up in batches
+// under /telemetry as comma-separated millivolts. A low state of charge
+// switches the whole lock into a low-power mode (see applyPowerPolicy()).
+const unsigned long POWER_SAMPLE_MS = 500;   // each channel read once a second
+const int POWER_POINT_SAMPLES = 60;          // samples per channel per point
+const int POWER_BATCH_POINTS = 15;           // upload every 15 minutes
+const uint32_t BATTERY_FULL_SCALE_MV = 4500; // A0 reading of 1023; match the fitted dividers
+const uint32_t PANEL_FULL_SCALE_MV = 7000;
+const int LOW_SOC_ENTER = 20; // percent
+const int LOW_SOC_EXIT = 35;  // hysteresis so a passing cloud does not flap the mode
+const unsigned long LOW_POWER_POLL_INTERVAL_MS = 5000;
+
+// Li-ion resting voltage against state of charge
+const uint16_t SOC_CURVE_MV[] = {3300, 3600, 3700, 3800, 3900, 4000, 4100, 4200};
+const uint8_t SOC_CURVE_PCT[] = {0, 10, 30, 50, 65, 80, 90, 100};
+
+uint32_t powerSampleSum[2] = {0, 0}; // [0] battery, [1] panel
+int powerSampleCount[2] = {0, 0};
+bool powerMuxPanel = false;
+unsigned long lastPowerSampleTime = 0;
+uint16_t batteryPoints[POWER_BATCH_POINTS];
+uint16_t panelPoints[POWER_BATCH_POINTS];
+int powerPointCount = 0;
+uint32_t powerBatchEpoch = 0;
+int stateOfCharge = -1; // -1 until the first point
+unsigned long pollIntervalMs = POLL_INTERVAL_MS;
+
+// --- HEARTBEAT ---
+// status/lastSeen is refreshed with the server's timestamp on an interval
+// that adapts to activity: short right after something happened, long when
+// the door is quiet or the battery is low. Each beat also writes
+// staleAfterMs, so the app (or a rule/function) can treat the bridge as
+// offline once lastSeen + staleAfterMs has passed, without the bridge having
+// to be online to say so.
+const unsigned long HEARTBEAT_ACTIVE_S = 15;
+const unsigned long HEARTBEAT_NORMAL_S = 60;
+const unsigned long HEARTBEAT_IDLE_S = 300;
+const unsigned long HEARTBEAT_LOW_BATTERY_S = 900;
+const unsigned long ACTIVE_WINDOW_MS = 120000;  // 2 minutes after activity
+const unsigned long IDLE_AFTER_MS = 900000;     // 15 minutes without activity
+const int HEARTBEAT_STALE_FACTOR_X10 = 25;      // stale after 2.5 missed intervals
+const int HTTP_OVERHEAD_BYTES = 220;            // request line, headers, TLS framing
+
+unsigned long lastHeartbeatTime = 0;
+unsigned long heartbeatIntervalS = 0; // 0 = none sent yet
+unsigned long lastActivityTime = 0;
+unsigned long heartbeats = 0;
+unsigned long heartbeatBytes = 0;
+unsigned long heartbeatRadioMs = 0;
+bool lowBattery = false; // driven by the power monitor
+
+// --- CONNECTION REUSE ---
+// TCP keepalive keeps the TLS socket warm between polls so most requests skip
+// the multi-second BearSSL handshake on the 80 MHz core.
+const int KEEPALIVE_IDLE_S = 5;
+const int KEEPALIVE_INTERVAL_S = 5;
+const int KEEPALIVE_COUNT = 3; // one lost probe on a busy AP must not drop the socket
+const unsigned long LINK_REPORT_INTERVAL = 300000; // 5 minutes
+unsigned long lastLinkReportTime = 0;
+
+struct LinkStats {
+  unsigned long requests;
+  unsigned long handshakes;   // requests that had to open a new TLS session
+  unsigned long coldTotalMs;  // handshake + transfer
+  unsigned long warmTotalMs;  // transfer only, on a reused connection
+  unsigned long lastMs;
+  bool lastCold;
+};
+LinkStats linkStats = {0, 0, 0, 0, 0, false};
+bool requestWasConnected = false;
+unsigned long requestStartMs = 0;
+
+// --- HEAP BUDGET ---
+// BearSSL buffers are the largest allocations on the bridge. When the server
+// accepts TLS max fragment length negotiation both can shrink to 512 bytes;
+// otherwise the receive side must hold a full 4 KB record.
+const uint16_t BSSL_SMALL_BUFFER = 512;
+const uint16_t BSSL_RX_FALLBACK = 4096;
+const uint16_t FIREBASE_RESPONSE_SIZE = 1024;
+const unsigned long HEAP_REPORT_INTERVAL = 600000; // 10 minutes
+unsigned long lastHeapReportTime = 0;
+uint32_t minFreeHeap = 0xFFFFFFFF;
+bool maxFragmentNegotiated = false;
+
+// --- ASYNC REQUESTS ---
+// Writes nobody waits on (status, stats, traces) and the version polls go
+// over a second keep-alive TLS connection without blocking the loop. They
+// wait in a small ring; up to asyncDepth of them are written back to back
+// (HTTP/1.1 pipelining), and the responses, which come back in order, are
+// parsed a few bytes at a time from the idle ticks, which then run the
+// request's callback. Writes ask for print=silent, so each answer is a bare
+// 204. Only the TLS handshake still blocks, and a resumed session keeps it
+// short. If the server drops the connection with more than one request in
+// flight we stop pipelining. A full ring, or a body too big for a slot,
+// goes the blocking way instead. tools/pipeline_sim.py compares the two.
+typedef void (*AsyncDone)(int status, const char* body);
+
+const int ASYNC_QUEUE_SIZE = 6;
+const int ASYNC_PATH_LENGTH = 64;
+const int ASYNC_BODY_LENGTH = 320;
+const int ASYNC_RESPONSE_LENGTH = 64; // plenty for a version number
+const uint8_t ASYNC_PIPELINE_DEPTH = 4;
+const uint8_t ASYNC_MAX_ATTEMPTS = 3;
+const unsigned long ASYNC_TIMEOUT_MS = 10000;
+const unsigned long ASYNC_RECONNECT_MS = 5000;
+
+enum AsyncParseState : uint8_t {
+  PARSE_STATUS,
+  PARSE_HEADERS,
+  PARSE_BODY,
+  PARSE_CHUNK_SIZE,
+  PARSE_CHUNK_END,
+  PARSE_TRAILER
+};
+
+struct AsyncRequest {
+  const char* method;
+  char path[ASYNC_PATH_LENGTH];
+  char body[ASYNC_BODY_LENGTH];
+  AsyncDone done;
+  uint8_t attempts;
+  unsigned long queuedMs;
+};
+
+struct AsyncStats {
+  unsigned long completed;
+  unsigned long failed;       // error status, or out of attempts
+  unsigned long blocking;     // sent the blocking way instead
+  unsigned long retries;
+  unsigned long handshakes;
+  unsigned long totalMs;      // queued -> answered, over completed
+  unsigned long maxMs;
+  uint8_t maxInFlight;
+  unsigned long maxPumpGapMs; // longest the loop went without servicing the ring
+};
+
+WiFiClientSecure asyncClient;
+BearSSL::Session asyncSession;
+AsyncRequest asyncRing[ASYNC_QUEUE_SIZE];
+uint8_t asyncHead = 0;  // oldest request not yet answered
+uint8_t asyncCount = 0;
+uint8_t asyncSent = 0;  // of those, how many are in flight
+uint8_t asyncDepth = ASYNC_PIPELINE_DEPTH;
+AsyncParseState asyncParse = PARSE_STATUS;
+int asyncStatus = 0;
+long asyncRemaining = 0; // body or chunk bytes still to come
+bool asyncChunked = false;
+bool asyncCloseAfter = false;
+char asyncLine[96];
+int asyncLineLength = 0;
+char asyncResponse[ASYNC_RESPONSE_LENGTH];
+int asyncResponseLength = 0;
+unsigned long asyncLastByteMs = 0;
+bool asyncConnectFailed = false;
+unsigned long asyncConnectFailedMs = 0;
+unsigned long lastAsyncPumpMs = 0;
+bool asyncPumping = false;
+unsigned long asyncCompletedAtReport = 0;
+AsyncStats asyncStats = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+// --- DIAGNOSTIC LOG ---
+// Diagnostics are small binary records in a RAM ring rather than Strings
+// printed to Serial (which is the Uno link) and written to Firebase one
+// request each. Repeats of a code within LOG_RATE_LIMIT_MS fold into the
+// previous record's repeat count. The ring is delta/varint encoded and
+// uploaded in batches; tools/decode_logs.py turns a batch back into text.
+// Keep LogCode in sync with the table in that script.
+enum LogLevel : uint8_t { LOG_INFO = 0, LOG_WARN = 1, LOG_ERROR = 2 };
+
+enum LogCode : uint8_t {
+  LOG_BOOT = 0,
+  LOG_SETUP_NOT_READY,
+  LOG_SET_ONLINE_FAILED,
+  LOG_SET_LAST_SEEN_FAILED,
+  LOG_COMMAND_REJECTED,
+  LOG_COMMAND_ACK_FAILED,
+  LOG_SIGNAL_LOCKED,
+  LOG_SIGNAL_UNLOCKED,
+  LOG_SIGNAL_TAMPER,
+  LOG_SIGNAL_REGISTRATION,
+  LOG_SIGNAL_UNKNOWN,
+  LOG_SERVO_MOVE_FAILED,
+  LOG_SHADOW_SYNC_FAILED,
+  LOG_SET_BOOL_FAILED,   // no longer raised; kept so the codes after it keep their numbers
+  LOG_UPLOAD_FAILED,
+  LOG_RESET,
+  LOG_CARD_DENIED,
+  LOG_DOOR_FORCED,
+  LOG_RULE_FIRED,
+  LOG_AUTH_REJECTED,
+  LOG_LINE_DROPPED,
+  LOG_CODE_COUNT
+};
+
+struct LogRecord {
+  uint32_t ms;      // millis() at the first occurrence
+  uint8_t level;
+  uint8_t code;
+  uint16_t repeats; // further occurrences folded into this record
+  int32_t arg;      // code specific, usually fbdo.httpCode()
+};
+
+const uint8_t LOG_FORMAT_VERSION = 1;
+const int LOG_RING_SIZE = 128;
+const int LOG_BATCH_MAX = 48;
+const unsigned long LOG_RATE_LIMIT_MS = 10000;
+const unsigned long LOG_UPLOAD_INTERVAL = 300000; // 5 minutes
+const int LOG_RECORD_MAX_BYTES = 1 + 5 + 3 + 5;
+
+LogRecord logRing[LOG_RING_SIZE];
+uint32_t logWriteSeq = 0;  // sequence number of the next record
+uint32_t logUploadSeq = 0; // first record not yet uploaded
+uint32_t logDropped = 0;   // overwritten before they could be uploaded
+uint32_t logLastSeq[LOG_CODE_COUNT]; // seq + 1 of the latest record per code, 0 = none
+uint32_t logLastMs[LOG_CODE_COUNT];
+unsigned long lastLogUploadTime = 0;
+uint8_t logBinary[16 + LOG_BATCH_MAX * LOG_RECORD_MAX_BYTES];
+char logBase64[(sizeof(logBinary) + 2) / 3 * 4 + 1];
+
+// --- COMMAND QUEUE ---
+// The app pushes {id, action, issuedAt, ttl} records under /commands. Push
+// keys sort chronologically, so draining them in key order preserves the
+// order the app issued them in. A batch whose ack write fails is acked again
+// before anything new is fetched; records at or before lastDrainedKey that
+// still come back (their ack was lost to a reset) are deleted, since they
+// already ran. tools/command_queue_sim.py measures bursts through it.
+const int COMMAND_BATCH_SIZE = 4;
+
+struct QueuedCommand {
+  char key[PUSH_KEY_LENGTH + 1];
+  char id[COMMAND_ID_LENGTH + 1];
+  const char* result;
+};
+QueuedCommand commandBatch[COMMAND_BATCH_SIZE];
+char lastDrainedKey[PUSH_KEY_LENGTH + 1] = "";
+char staleCommandKeys[COMMAND_BATCH_SIZE][PUSH_KEY_LENGTH + 1];
+int staleCommandCount = 0;
+int ackPendingCount = 0; // the batch ran but its ack has not landed yet
+char ackBuffer[COMMAND_BATCH_SIZE * (PUSH_KEY_LENGTH + COMMAND_ID_LENGTH + 48) + 64];
+bool commandBacklog = false;
+unsigned long commandsExecuted = 0;
+unsigned long commandsExpired = 0;
+
+// --- DEVICE SHADOW ---
+// `reported` is what the door last told us, `synced` is what Firebase holds.
+// Only fields that differ go over the wire.
+// The app's intent lives under /desired as {isLocked, version}.
+const int8_t SHADOW_UNKNOWN = -1;
+const unsigned long DESIRED_SYNC_INTERVAL = 30000; // 30 seconds
+
+struct ShadowState {
+  int8_t isLocked;     // 1, 0 or SHADOW_UNKNOWN until the Uno reports
+  const char* alert;   // nullptr = never synced
+  const char* mode;
+  long desiredVersion; // last /desired version we acted on
+};
+ShadowState reported = {SHADOW_UNKNOWN, "none", "normal", -1};
+ShadowState synced = {SHADOW_UNKNOWN, nullptr, nullptr, -1};
+unsigned long reportedVersion = 0;
+unsigned long suppressedWrites = 0;
+unsigned long lastDesiredSyncTime = 0;
+bool wasWiFiConnected = false;
+// A tamper alert and registration mode are held in `reported` until these
+// run out; expireWakeSignals() clears them from loop()
+const unsigned long TAMPER_ALERT_HOLD_MS = 3000;
+bool tamperAlertRaised = false;
+unsigned long tamperAlertMillis = 0;
+bool registrationOpen = false;
+unsigned long registrationMillis = 0;
+
+// --- CONTROLLER LINK ---
+// The Uno sends structured events as "@NAME,field,field,..." lines on the
+// same UART we use for commands; other lines are its debug output.
+const int LINK_LINE_LENGTH = 64;
+const int MAX_EVENT_FIELDS = 6;
+#ifdef GATEWAY_MODE
+const unsigned long LINK_IDLE_TICK_MS = 2; // each bus turn waits for the next tick (tools/bus_sim.py)
+#else
+const unsigned long LINK_IDLE_TICK_MS = 10;
+#endif
+char linkLine[LINK_LINE_LENGTH];
+int linkLineLength = 0;
+unsigned long servoMoves = 0;
+unsigned long servoFailedMoves = 0;
+unsigned long cardsGranted = 0;
+unsigned long cardsDenied = 0;
+
+#ifndef GATEWAY_MODE
+// Lines to the Uno go out one at a time. A signed line costs it two SHA-256
+// compressions and a counter write to EEPROM (~3.3 ms a byte), long enough
+// for a line sent straight behind it to overrun its 64-byte receive buffer,
+// so the next line waits for the @AUTH of a signed one, or LINK_AUTH_WAIT_MS.
+const int LINK_QUEUE_SIZE = 8;
+const unsigned long LINK_AUTH_WAIT_MS = 100;
+static_assert(CONFIG_KEY_COUNT + 1 <= LINK_QUEUE_SIZE, "a config push must fit the link queue");
+char linkQueue[LINK_QUEUE_SIZE][AUTH_LINE_LENGTH];
+uint8_t linkQueueHead = 0;
+uint8_t linkQueueCount = 0;
+bool linkAuthPending = false; // a signed line is out and its @AUTH is not back
+unsigned long linkLineSentMs = 0;
+#endif
+
+#ifdef GATEWAY_MODE
+// --- RS-485 GATEWAY ---
+// Built with -D GATEWAY_MODE (env:nodemcuv2_gateway), the UART drives a
+// half-duplex RS-485 bus shared by up to 16 Unos instead of one Uno on a
+// UART plus three signal lines. The bridge is the only master. It hands a
+// door the bus with "#NN:<payload>", where the payload is the next line
+// queued for that door or "?" if there is none; the door answers with its
+// buffered events as "#NN:@..." lines and gives the bus back with "#NN:.".
+// Address 00 is a broadcast that nobody answers. Doors with queued lines are
+// served first; a door that misses three turns is only probed every
+// BUS_PROBE_EVERY_CYCLES rounds. Door state changes are gathered into one
+// multi-location write per second under /doors/NN.
+const int BUS_DE_PIN = D7; // MAX485 DE and /RE, high while we transmit
+const uint8_t BUS_BROADCAST = 0;
+const uint8_t BUS_MAX_DOORS = 16;
+const unsigned long BUS_TURN_TIMEOUT_MS = 50; // one slow Uno loop pass plus a full outbox
+const unsigned int BUS_LAST_CHAR_US = 100;    // the final stop bit after the FIFO drains
+const uint8_t BUS_OFFLINE_AFTER_MISSES = 3;
+const unsigned long BUS_PROBE_EVERY_CYCLES = 20;
+const unsigned long DOOR_FLUSH_INTERVAL_MS = 1000;
+const int DOOR_QUEUE_SIZE = 8;
+const int DOOR_LINE_LENGTH = AUTH_LINE_LENGTH;
+const int BROADCAST_QUEUE_SIZE = 8;
+const int BROADCAST_LINE_LENGTH = 40;
+static_assert(CONFIG_KEY_COUNT + 1 <= DOOR_QUEUE_SIZE, "a config push must fit a door's queue");
+
+struct DoorState {
+  bool online;
+  bool dirty;           // changed since the last flush
+  uint8_t misses;       // turns in a row without an answer
+  int8_t isLocked;      // SHADOW_UNKNOWN until the door reports
+  const char* alert;    // alert not yet written, or nullptr
+  int8_t lastMoveOk;    // -1 = no move yet
+  int8_t lastCard;      // the Uno's CardEvent, -1 = none yet
+  int8_t bootReason;    // the Uno's ResetCause, -1 = not seen
+  int8_t doorEvent;     // the Uno's latest DoorEvent, -1 = not seen
+  unsigned long polls;
+  unsigned long events;
+  bool heardBroadcast;  // answered a turn since the last broadcast went out
+  long configVersion;   // what the door last reported holding, -1 = not heard
+  bool configPending;   // a push is queued or waiting for its @CFG
+  unsigned long configSentMs;
+  uint32_t authInFlight; // counter of the AUTH line the current turn carries
+  char queue[DOOR_QUEUE_SIZE][DOOR_LINE_LENGTH];
+  uint8_t queueHead;
+  uint8_t queueCount;
+};
+DoorState doors[BUS_MAX_DOORS + 1]; // indexed by bus address; 0 is the broadcast
+char broadcastQueue[BROADCAST_QUEUE_SIZE][BROADCAST_LINE_LENGTH];
+uint8_t broadcastHead = 0;
+uint8_t broadcastCount = 0;
+unsigned long broadcastCycle = 0; // busCycles when the last broadcast went out
+unsigned long linesDropped = 0;   // queue full: broadcast or door lines lost
+uint8_t busTurnDoor = 0;       // door holding the bus, 0 = none
+bool busTurnCarried = false;   // the turn delivered the head of the door's queue
+unsigned long busTurnStartMs = 0;
+uint8_t busRoundRobin = 1;
+unsigned long busCycles = 0;
+unsigned long busTimeouts = 0;
+unsigned long lastDoorFlushTime = 0;
+char doorsBuffer[BUS_MAX_DOORS * 280 + 96];
+#endif
+
+// --- EDGE RULES ---
+// Reactions that should not wait on the cloud run on the bridge. /rules is
+// {version, list: {<id>: {on, if, count, withinS, forS, do, lockoutS}}}:
+//   {"on": "tamper", "if": "unlocked", "do": "lock"}
+//   {"on": "pinBad", "count": 3, "withinS": 60, "do": "alert,lockout", "lockoutS": 300}
+//   {"on": "closed", "forS": 120, "if": "unlocked", "do": "lock"}
+// which are also the rules until /rules has been read. It is checked like
+// /config and compiled into a fixed table, so an event costs a scan of at
+// most MAX_RULES small records and no allocation. An event also resets the
+// count and cancels the timer of rules waiting on its opposite (closed and
+// opened, pinOk and pinBad, ...); conditions of a timed rule are checked
+// when it fires. There is deliberately no unlock action. status/rules
+// reports the table's cost and how fast reactions went out, next to what
+// the same reaction would take through Firebase.
+enum RuleTrigger : uint8_t {
+  TRIG_TAMPER = 0,
+  TRIG_PIN_BAD,
+  TRIG_PIN_OK,
+  TRIG_CARD_DENIED,
+  TRIG_CARD_OK,
+  TRIG_OPENED,
+  TRIG_CLOSED,
+  TRIG_FORCED,
+  TRIG_LOCKED,
+  TRIG_UNLOCKED,
+  TRIG_COUNT,
+  TRIG_NONE = 0xFF
+};
+const char* const TRIGGER_NAMES[TRIG_COUNT] = {
+  "tamper", "pinBad", "pinOk", "cardDenied", "cardOk", "opened", "closed", "forced", "locked", "unlocked"
+};
+const uint8_t TRIGGER_OPPOSITES[TRIG_COUNT] = {
+  TRIG_NONE, TRIG_PIN_OK, TRIG_PIN_BAD, TRIG_CARD_OK, TRIG_CARD_DENIED,
+  TRIG_CLOSED, TRIG_OPENED, TRIG_NONE, TRIG_UNLOCKED, TRIG_LOCKED
+};
+// Bit n of a rule's conditions/actions is entry n of these
+const char* const CONDITION_NAMES[] = {"locked", "unlocked", "open", "closed", "lowBattery"};
+const uint8_t COND_LOCKED = 0x01;
+const uint8_t COND_UNLOCKED = 0x02;
+const uint8_t COND_OPEN = 0x04;
+const uint8_t COND_CLOSED = 0x08;
+const uint8_t COND_LOW_BATTERY = 0x10;
+const char* const ACTION_NAMES[] = {"lock", "alert", "lockout", "alarm"};
+const uint8_t ACT_LOCK = 0x01;
+const uint8_t ACT_ALERT = 0x02;   // status/alert (or the door's alert) for RULE_ALERT_HOLD_MS
+const uint8_t ACT_LOCKOUT = 0x04; // "KEYPAD_LOCK <lockoutS>" to the Uno
+const uint8_t ACT_ALARM = 0x08;   // "ALARM": the Uno plays the tamper pattern
+
+struct Rule {
+  uint8_t trigger;
+  uint8_t conditions; // all must hold
+  uint8_t actions;
+  uint8_t count;      // events needed, within windowS if that is set
+  uint16_t windowS;
+  uint16_t forS;      // act this long after the event unless its opposite comes first
+  uint16_t lockoutS;
+};
+
+struct RuleRun {
+  uint8_t hits;
+  bool armed;
+  unsigned long windowStart;
+  unsigned long armedAt;
+};
+
+const int MAX_RULES = 8;
+const int RULE_KEY_LENGTH = 20;
+const uint16_t DEFAULT_LOCKOUT_S = 300;
+const unsigned long RULE_ALERT_HOLD_MS = 30000;
+const int RULE_BENCH_ROUNDS = 1000; // of every trigger, after each compile
+const unsigned long RULE_REPORT_INTERVAL = 600000; // 10 minutes
+#ifdef GATEWAY_MODE
+const uint8_t RULE_DOORS = BUS_MAX_DOORS + 1; // indexed by bus address
+#else
+const uint8_t RULE_DOORS = 2;                 // door 1 only
+#endif
+
+const Rule DEFAULT_RULES[] = {
+  {TRIG_TAMPER, COND_UNLOCKED, ACT_LOCK, 1, 0, 0, 0},
+  {TRIG_PIN_BAD, 0, ACT_ALERT | ACT_LOCKOUT, 3, 60, 0, DEFAULT_LOCKOUT_S},
+  {TRIG_CLOSED, COND_UNLOCKED, ACT_LOCK, 1, 0, 120, 0},
+};
+
+struct RuleStats {
+  unsigned long evaluations;
+  uint64_t evalCycles;
+  uint32_t evalMaxCycles;
+  unsigned long fired;
+  unsigned long reactions;      // events that fired at least one rule at once
+  uint64_t reactionTotalUs;     // event line in -> last command line out
+  unsigned long reactionMaxUs;
+  uint32_t benchNsPerEval;
+  uint32_t benchEvalsPerS;
+};
+
+Rule rules[MAX_RULES];
+int ruleCount = 0;
+int rulesRejected = 0;
+long rulesVersion = -1; // -1 = the built-in rules
+RuleRun ruleRuns[MAX_RULES][RULE_DOORS];
+int8_t ruleDoorOpen[RULE_DOORS]; // -1 until the door reports
+RuleStats ruleStats = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+bool rulesDryRun = false; // benchmark: evaluate, but act on nothing
+bool ruleAlertRaised = false;
+unsigned long ruleAlertMillis = 0;
+unsigned long lastRulesCheckTime = 0;
+bool rulesCheckDue = true;
+bool rulesFetchDue = false;
+long rulesFetchVersion = 0;
+unsigned long lastRuleReportTime = 0;
+bool ruleReportDue = false;
+
 
 FirebaseData fbdo;
 FirebaseConfig config;
 FirebaseAuth auth;
-String lockPath = "/smart_lock";
 
 void setup() {
+  startSupervisor();
+  restoreCheckpoint();
   initializeSerialAndPins();
+  initializeAccessLog();
+  loadDefaultRules();
   connectWiFi();
+  syncClock();
   initializeFirebase();
   setInitialFirebaseStatus();
+  reportBoot();
+  sendControllerLine("AUTH_SYNC");
+  stallLimitMs = LOOP_STALL_LIMIT_MS;
 }
 
 void loop() {
+  feedSupervisor();
+  readControllerLink();
+  pumpAsyncRequests();
   handleFirebaseCommand();
+#ifdef GATEWAY_MODE
+  flushDoorStates(); // a bus has no signal lines, and /desired is per door
+  pumpDoorConfig();
+#else
   processWakePins();
-  // connectWiFi();
-  delay(1000);
+  expireWakeSignals();
+  syncDesiredState();
+#endif
+  checkHeartbeat();
+  checkRemoteConfig();
+  checkRemoteRules();
+  checkRules();
+  syncControllerClock();
+  runRequestedUpdate();
+  runHistoryRequests();
+  checkAccessFlush();
+  uploadPowerBatch();
+  publishLinkStats();
+  publishHeapReport();
+  publishRuleStats();
+  uploadLogBatch();
+  checkTraceTimeout();
+  if (!commandBacklog) idleFor(pollIntervalMs); // keep draining while a burst is queued
 }
 
 // =======================
@@ -44,184 +907,2953 @@ void initializeSerialAndPins() {
   pinMode(TAMPER_WAKE_PIN, INPUT);
   pinMode(REG_MODE_WAKE_PIN, INPUT);
   pinMode(LOCK_STATUS_PIN, INPUT);
+  pinMode(POWER_MUX_PIN, OUTPUT);
+  digitalWrite(POWER_MUX_PIN, LOW);
+#ifdef GATEWAY_MODE
+  initializeBus();
+#endif
 }
 
 void connectWiFi() {
+  if (resumeWiFi()) {
+    sendControllerLine("WIFI_CONNECTED");
+    return;
+  }
+
   WiFiManager wifiManager;
   wifiManager.setConfigPortalTimeout(600);
 
   if (!wifiManager.autoConnect("SmartLock-Setup-AP")) {
-    Serial.println("WIFI_DISCONNECTED");
+    sendControllerLine("WIFI_DISCONNECTED");
     return;
   }
 
-  Serial.println("WIFI_CONNECTED");
+  sendControllerLine("WIFI_CONNECTED");
+  saveCheckpoint();
+}
+
+void syncClock() {
+  configTime(0, 0, "pool.ntp.org", "time.google.com");
+  // On a warm boot, let SNTP finish in the background; TTLs wait for it
+  if (checkpointRestored) return;
+  unsigned long start = millis();
+  while (time(nullptr) < MIN_VALID_EPOCH && millis() - start < SNTP_WAIT_MS) {
+    delay(100);
+  }
+}
+
+bool clockValid() {
+  return time(nullptr) > MIN_VALID_EPOCH;
+}
+
+void syncControllerClock() {
+  if (!clockValid()) return;
+  if (!controllerClockDue && millis() - lastClockSentMillis < CLOCK_SEND_INTERVAL) return;
+  controllerClockDue = false;
+  lastClockSentMillis = millis();
+  long local = (long)(time(nullptr) % 86400) + utcOffsetMinutes * 60;
+  char line[24];
+  snprintf(line, sizeof(line), "CLOCK %ld", (local + 86400) % 86400);
+  if (!sendControllerLine(line)) controllerClockDue = true;
+}
+
+bool forwardGuestPin(FirebaseJson& json, const String& base, uint8_t door) {
+  FirebaseJsonData field;
+  json.get(field, base + "pin");
+  if (!field.success || !isForwardableValue(field.stringValue)) return false;
+  String pin = field.stringValue;
+  json.get(field, base + "minutes");
+  if (!field.success || field.intValue < 0) return false;
+  char line[24];
+  snprintf(line, sizeof(line), "GUEST %s %d", pin.c_str(), field.intValue);
+  return sendSignedLine(door, line);
+}
+
+bool forwardSchedule(FirebaseJson& json, const String& base, uint8_t door) {
+  FirebaseJsonData field;
+  json.get(field, base + "slot");
+  if (!field.success || field.intValue < 0) return false;
+  int slot = field.intValue;
+  json.get(field, base + "do");
+  if (!field.success) return false;
+  char line[24];
+  if (field.stringValue == "clear") {
+    snprintf(line, sizeof(line), "SCHED %d -", slot);
+    return sendSignedLine(door, line);
+  }
+  if (field.stringValue != "lock" && field.stringValue != "unlock") return false;
+  char action = field.stringValue == "lock" ? 'L' : 'U';
+  json.get(field, base + "minute");
+  if (!field.success || field.intValue < 0 || field.intValue >= 1440) return false;
+  snprintf(line, sizeof(line), "SCHED %d %d %c", slot, field.intValue, action);
+  return sendSignedLine(door, line);
+}
+
+uint64_t epochMillis() {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+// Waits between polls while still servicing the Uno link, so controller
+// events are timestamped within one idle tick of arriving.
+void idleFor(unsigned long ms) {
+  unsigned long start = millis();
+  while (millis() - start < ms) {
+    feedSupervisor();
+    readControllerLink();
+    pumpAsyncRequests();
+    samplePower();
+    stepHistoryBench();
+#ifndef GATEWAY_MODE
+    processWakePins(); // a 2 s pulse fits inside a low-power poll interval
+#endif
+    delay(LINK_IDLE_TICK_MS);
+  }
 }
 
 void initializeFirebase() {
+  configureTlsBuffers();
+  initializeAsyncClient();
   config.database_url = FIREBASE_HOST;
   config.signer.tokens.legacy_token = FIREBASE_AUTH;
   Firebase.begin(&config, &auth);
   Firebase.reconnectWiFi(true);
+  fbdo.keepAlive(KEEPALIVE_IDLE_S, KEEPALIVE_INTERVAL_S, KEEPALIVE_COUNT);
+  // Modem sleep keeps the AP association (and our socket) alive across the
+  // idle part of each poll with the radio off between beacons. Light sleep
+  // would save more, but it suspends the CPU and bytes from the Uno arriving
+  // while it wakes are lost; modem sleep leaves the CPU and UART running.
+  WiFi.setSleepMode(WIFI_MODEM_SLEEP);
   delay(500);
 }
 
+void configureTlsBuffers() {
+  WiFiClientSecure probe;
+  maxFragmentNegotiated = probe.probeMaxFragmentLength(FIREBASE_HOSTNAME, 443, BSSL_SMALL_BUFFER);
+  uint16_t rx = maxFragmentNegotiated ? BSSL_SMALL_BUFFER : BSSL_RX_FALLBACK;
+  fbdo.setBSSLBufferSize(rx, BSSL_SMALL_BUFFER);
+  fbdo.setResponseSize(FIREBASE_RESPONSE_SIZE);
+}
+
 void setInitialFirebaseStatus() {
   if (WiFi.status() == WL_CONNECTED && Firebase.ready()) {
-    if (!Firebase.setBool(fbdo, lockPath + "/status/isOnline", true)) {
-      logFirebaseError("Setting isOnline TRUE in setup");
-    } else {
-      logFirebaseSuccess("isOnline TRUE set in setup");
-    }
+    logEvent(LOG_INFO, LOG_BOOT, ESP.getFreeHeap());
+    noteActivity();
+    sendHeartbeat();
 
-    if (!Firebase.setInt(fbdo, lockPath + "/status/lastSeen", time(nullptr))) {
-      logFirebaseError("Setting lastSeen in setup");
-    } else {
-      logFirebaseSuccess("lastSeen set in setup");
+    // Resume from the last desired version we applied so a reboot does not
+    // re-apply stale intent over a local PIN unlock
+    if (fbGetInt(PATH_STATUS_DESIRED_VERSION)) {
+      reported.desiredVersion = synced.desiredVersion = fbdo.intData();
     }
   } else {
-    logFirebaseError("Firebase or Wi-Fi not ready in setup");
+    logEvent(LOG_ERROR, LOG_SETUP_NOT_READY, WiFi.status());
   }
 }
 
 void handleFirebaseCommand() {
-  // Check if there's a command, and only proceed if it's not empty or null
-  if (Firebase.getString(fbdo, lockPath + "/command")) {
-    String command = fbdo.stringData();
-
-    // Only process if the command is valid (not empty and not 'null' from Firebase)
-    if (command.length() > 0 && command != "null") {
-      if (command == "lock") {
-        Serial.write('L');
-        logFirebaseSuccess("Received lock command");
-      } else if (command == "unlock") {
-        Serial.write('U');
-        logFirebaseSuccess("Received unlock command");
-      } else {
-        logFirebaseError("Unrecognized command from Firebase: " + command);
-      }
+  if (ackPendingCount > 0 && !acknowledgeCommands(ackPendingCount)) return;
+
+  QueryFilter query;
+  query.orderBy("$key");
+  query.limitToFirst(COMMAND_BATCH_SIZE);
+
+  // A missing /commands node also lands here, which just means nothing is queued
+  bool ok = fbGetJSON(PATH_COMMANDS, query);
+  query.clear();
+  commandBacklog = false;
+  if (!ok) return;
+
+  int count = collectCommandKeys(fbdo.jsonObject());
+  if (count == 0) {
+    if (staleCommandCount == 0) return;
+    acknowledgeCommands(0); // just the deletes
+    commandBacklog = true;  // they filled the window; look again at once
+    return;
+  }
+  noteActivity();
+
+  FirebaseJson& json = fbdo.jsonObject();
+  FirebaseJsonData field;
+  uint64_t now = clockValid() ? epochMillis() : 0;
+
+  int i = 0;
+  for (; i < count; i++) {
+    QueuedCommand& cmd = commandBatch[i];
+    String base = String(cmd.key) + "/";
+
+    json.get(field, base + "id");
+    if (field.success && isPathSafe(field.stringValue.c_str())) {
+      field.stringValue.toCharArray(cmd.id, sizeof(cmd.id));
+    } else {
+      strcpy(cmd.id, cmd.key);
+    }
+
+    // issuedAt may be epoch seconds or milliseconds (Date.now())
+    json.get(field, base + "issuedAt");
+    double issuedAt = field.success ? field.doubleValue : 0;
+    uint64_t issuedMs = issuedAt > 1e11 ? (uint64_t)issuedAt : (uint64_t)issuedAt * 1000;
+    json.get(field, base + "ttl");
+    long ttl = field.success ? field.intValue : 0;
 
-      // Acknowledge the command by setting it to an empty string or null
-      // Setting to empty string is often safer with getString()
-      if (!Firebase.setString(fbdo, lockPath + "/command", "")) {
-        logFirebaseError("Failed to clear command after processing");
+    // TTLs can only be enforced once the clock is valid; until then run everything
+    if (ttl > 0 && now != 0 && issuedMs + (uint64_t)ttl * 1000 < now) {
+      cmd.result = "expired";
+      commandsExpired++;
+      continue;
+    }
+
+    // Only a gateway serves more than door 1
+    json.get(field, base + "door");
+    int door = field.success ? field.intValue : 1;
+    if (!isDoorAddress(door)) {
+      cmd.result = "rejected";
+      logEvent(LOG_WARN, LOG_COMMAND_REJECTED, i);
+      continue;
+    }
+
+    // Waiting on a stalled door would hold up every command behind it
+    if (doorStalled(door)) {
+      cmd.result = "offline";
+      continue;
+    }
+
+    json.get(field, base + "action");
+    // A door whose queue is full is busy: break, leaving this command queued
+    if (field.success && field.stringValue == "lock") {
+      if (!sendTracedCommand(door, 'L', cmd.id, issuedMs, now)) break;
+      cmd.result = "done";
+      recordAccess(ACCESS_REMOTE_LOCK, door, 0);
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "unlock") {
+      if (!sendTracedCommand(door, 'U', cmd.id, issuedMs, now)) break;
+      cmd.result = "done";
+      recordAccess(ACCESS_REMOTE_UNLOCK, door, 0);
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "clearCards") {
+      if (!sendSignedLine(door, "CARDS_CLEAR")) break;
+      cmd.result = "done";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "guestPin") {
+      // {pin, minutes}: a PIN that works until it expires; 0 minutes revokes it
+      cmd.result = forwardGuestPin(json, base, door) ? "done" : "rejected";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "schedule") {
+      // {slot, minute, do: "lock" | "unlock" | "clear"}: daily, at that minute of local time
+      cmd.result = forwardSchedule(json, base, door) ? "done" : "rejected";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "history") {
+      // Runs after the batch is acknowledged; fbdo still holds the batch
+      if (!accessReady) {
+        cmd.result = "rejected"; // no access log to read
+        continue;
       }
+      if (!queueHistoryQuery(json, base, cmd.id)) break;
+      cmd.result = "done";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "jitterTest") {
+      // {seconds}: the Uno times its loop while a pattern plays, answers @JITTER
+      json.get(field, base + "seconds");
+      char line[24];
+      snprintf(line, sizeof(line), "JITTER_TEST %d", field.success ? field.intValue : 10);
+      if (!sendDoorLine(door, line)) break;
+      cmd.result = "done";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "historyBench") {
+      historyBenchRequested = true;
+      cmd.result = "done";
+      commandsExecuted++;
+    } else if (field.success && field.stringValue == "update") {
+      // Runs after the batch is acknowledged, so a restart cannot replay it
+      updateRequested = true;
+      cmd.result = "done";
+      commandsExecuted++;
+    } else {
+      cmd.result = "rejected";
+      logEvent(LOG_WARN, LOG_COMMAND_REJECTED, i);
     }
-  } else {
-    // This might fire if the path doesn't exist or is null, which is fine
-    // if Firebase.getString returns false for an empty/null path
-    // logFirebaseError("Reading command - fbdo.getString returned false"); // Keep for debugging if needed
   }
+
+  // Stopped at a busy command: it and the rest stay in /commands for the
+  // next poll, which gives the door time to drain its queue
+  int drained = i;
+  if (drained == 0) {
+    if (staleCommandCount > 0) acknowledgeCommands(0);
+    return;
+  }
+  strcpy(lastDrainedKey, commandBatch[drained - 1].key);
+  saveCheckpoint(); // a reset before the ack lands must not replay the batch
+  acknowledgeCommands(drained);
+  commandBacklog = drained == count && count + staleCommandCount == COMMAND_BATCH_SIZE;
+}
+
+// Pulls the push keys of the returned records, setting aside anything already
+// drained, and sorts them, since the REST API does not preserve query order
+// in the JSON body.
+int collectCommandKeys(FirebaseJson& json) {
+  int count = 0;
+  staleCommandCount = 0;
+  int type = 0;
+  String key, value;
+
+  size_t len = json.iteratorBegin();
+  for (size_t i = 0; i < len && count + staleCommandCount < COMMAND_BATCH_SIZE; i++) {
+    json.iteratorGet(i, type, key, value);
+    // Push keys always start with '-'; the nested record fields never do
+    if (type != FirebaseJson::JSON_OBJECT || key.length() != PUSH_KEY_LENGTH || key[0] != '-') continue;
+    if (strcmp(key.c_str(), lastDrainedKey) <= 0) {
+      key.toCharArray(staleCommandKeys[staleCommandCount++], PUSH_KEY_LENGTH + 1);
+      continue;
+    }
+    key.toCharArray(commandBatch[count].key, PUSH_KEY_LENGTH + 1);
+    count++;
+  }
+  json.iteratorEnd();
+
+  for (int i = 1; i < count; i++) {
+    for (int j = i; j > 0 && strcmp(commandBatch[j - 1].key, commandBatch[j].key) > 0; j--) {
+      QueuedCommand tmp = commandBatch[j];
+      commandBatch[j] = commandBatch[j - 1];
+      commandBatch[j - 1] = tmp;
+    }
+  }
+  return count;
+}
+
+// One multi-location update removes every drained record from the queue and
+// records its outcome under /commandAcks/<id>. Stale records are only
+// deleted: their outcome went with the reset that lost their ack. On failure
+// the batch stays pending and handleFirebaseCommand() sends it again first.
+bool acknowledgeCommands(int count) {
+  int n = snprintf(ackBuffer, sizeof(ackBuffer),
+                   "{\"status/commandsExecuted\":%lu,\"status/commandsExpired\":%lu",
+                   commandsExecuted, commandsExpired);
+  for (int i = 0; i < count; i++) {
+    n += snprintf(ackBuffer + n, sizeof(ackBuffer) - n,
+                  ",\"commands/%s\":null,\"commandAcks/%s\":\"%s\"",
+                  commandBatch[i].key, commandBatch[i].id, commandBatch[i].result);
+  }
+  for (int i = 0; i < staleCommandCount; i++) {
+    n += snprintf(ackBuffer + n, sizeof(ackBuffer) - n, ",\"commands/%s\":null", staleCommandKeys[i]);
+  }
+  snprintf(ackBuffer + n, sizeof(ackBuffer) - n, "}");
+
+  FirebaseJson json;
+  json.setJsonData(ackBuffer);
+  if (!fbUpdateNode(LOCK_PATH, json)) {
+    logEvent(LOG_ERROR, LOG_COMMAND_ACK_FAILED, fbdo.httpCode());
+    ackPendingCount = count;
+    return false;
+  }
+  ackPendingCount = 0;
+  return true;
+}
+
+// Firebase keys may not contain . # $ [ ] or /
+bool isPathSafe(const char* id) {
+  size_t len = strlen(id);
+  if (len == 0 || len > COMMAND_ID_LENGTH) return false;
+  for (size_t i = 0; i < len; i++) {
+    if (strchr(".#$[]/\"", id[i]) || id[i] < ' ') return false;
+  }
+  return true;
 }
 
 // ============================
 // == FIREBASE COMMUNICATION ==
 // ============================
-// void handleFirebaseCommand() {
-//   if (Firebase.getString(fbdo, lockPath + "/command")) {
-//     String command = fbdo.stringData();
-
-//     if (command == "lock") {
-//       Serial.write('L');
-//       logFirebaseSuccess("Received lock command");
-//     } else if (command == "unlock") {
-//       Serial.write('U');
-//       logFirebaseSuccess("Received unlock command");
-//     } else {
-//       logFirebaseError("Unrecognized command from Firebase: " + command);
-//     }
-//   } else {
-//     logFirebaseError("Reading command");
-//   }
-// }
-
-void processWakePins() {
+int readWakePins() {
   bool bit2 = digitalRead(REG_MODE_WAKE_PIN);   // MSB
   bool bit1 = digitalRead(TAMPER_WAKE_PIN);
   bool bit0 = digitalRead(LOCK_STATUS_PIN);     // LSB
+  return (bit2 << 2) | (bit1 << 1) | bit0;
+}
 
-  int signal = (bit2 << 2) | (bit1 << 1) | bit0;
-
-   switch (signal) {
-    case 0b000:
-      logFirebaseError("0,0,0 received – Idle state");
-      break;
+void processWakePins() {
+  int signal = readWakePins();
+  if (signal == lastWakeSignal) return;
+  unsigned long sampledMicros = micros();
+  delayMicroseconds(WAKE_CONFIRM_US);
+  if (readWakePins() != signal) return; // mid-change; the next tick sees where it settled
+  lastWakeSignal = signal;
+  if (signal == 0) return; // the gap between two codes
+  noteActivity();
 
+  switch (signal) {
     case 0b001:
-      Serial.println("Detected: LOCKED");
-      if (!Firebase.setBool(fbdo, lockPath + "/status/isLocked", true)) {
-        logFirebaseError("Setting isLocked = true from 3-bit input");
-      } else {
-        logFirebaseSuccess("isLocked = true from 3-bit input");
-      }
+      logEvent(LOG_INFO, LOG_SIGNAL_LOCKED, 0);
+      reported.isLocked = 1;
+      evaluateRules(1, TRIG_LOCKED, sampledMicros);
+      saveCheckpoint();
+      flushShadow();
+      completeTrace();
       break;
 
     case 0b010:
-      Serial.println("Detected: Tamper alert");
-      if (!Firebase.setString(fbdo, lockPath + "/status/alert", "knock")) {
-        logFirebaseError("Setting alert to tamper");
-      } else {
-        logFirebaseSuccess("Alert set to tamper");
-      }
-      delay(3000);
-      Firebase.setString(fbdo, lockPath + "/status/alert", "none");
+      logEvent(LOG_WARN, LOG_SIGNAL_TAMPER, 0);
+      evaluateRules(1, TRIG_TAMPER, sampledMicros);
+      recordAccess(ACCESS_TAMPER, 1, 0);
+      reported.alert = "knock";
+      flushShadow();
+      tamperAlertRaised = true;
+      tamperAlertMillis = millis();
       break;
 
     case 0b011:
-      Serial.println("Detected: UNLOCKED");
-      if (!Firebase.setBool(fbdo, lockPath + "/status/isLocked", false)) {
-        logFirebaseError("Setting isLocked = false from 3-bit input");
-      } else {
-        logFirebaseSuccess("isLocked = false from 3-bit input");
-      }
+      logEvent(LOG_INFO, LOG_SIGNAL_UNLOCKED, 0);
+      reported.isLocked = 0;
+      evaluateRules(1, TRIG_UNLOCKED, sampledMicros);
+      saveCheckpoint();
+      flushShadow();
+      completeTrace();
       break;
 
     case 0b100:
-      Serial.println("Detected: Registration mode");
-      if (!Firebase.setString(fbdo, lockPath + "/status/mode", "registration")) {
-        logFirebaseError("Setting mode to registration");
-      } else {
-        logFirebaseSuccess("Mode set to registration");
-      }
-      delay(60000);
-      Firebase.setString(fbdo, lockPath + "/status/mode", "normal");
+      logEvent(LOG_INFO, LOG_SIGNAL_REGISTRATION, 0);
+      reported.mode = "registration";
+      flushShadow();
+      registrationOpen = true;
+      registrationMillis = millis();
       break;
 
     case 0b111:
       {WiFiManager wifiManager;
       wifiManager.resetSettings();
       ESP.restart(); // Restart the ESP to force re-connection
-      Serial.println("WIFI_DISCONNECTED");
-      connectWiFi();
       break;}
 
     default:
-      Serial.println("Detected: Unknown 3-bit signal: " + String(signal, BIN));
-      logFirebaseError("Unrecognized 3-bit signal: " + String(signal, BIN));
+      logEvent(LOG_WARN, LOG_SIGNAL_UNKNOWN, signal);
       break;
   }
 }
 
+void expireWakeSignals() {
+  unsigned long now = millis();
+  if (tamperAlertRaised && now - tamperAlertMillis >= TAMPER_ALERT_HOLD_MS) {
+    tamperAlertRaised = false;
+    reported.alert = "none";
+    flushShadow();
+  }
+  if (registrationOpen && now - registrationMillis >= registrationWindowMs) {
+    registrationOpen = false;
+    reported.mode = "normal";
+    flushShadow();
+  }
+}
 
-// ======================
-// == ERROR HANDLING ====
-// ======================
-void safeSetBool(String path, bool value) {
-  if (!Firebase.setBool(fbdo, path, value)) {
-    logFirebaseError("safeSetBool → " + path);
+// ========================
+// == CONTROLLER EVENTS ===
+// ========================
+#ifndef GATEWAY_MODE
+void readControllerLink() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      linkLine[linkLineLength] = '\0';
+      linkLineEpochMs = epochMillis();
+      linkLineMicros = micros();
+      if (linkLineLength > 1 && linkLine[0] == '@') {
+        dispatchControllerEvent(linkLine + 1);
+      }
+      linkLineLength = 0;
+    } else if (linkLineLength < LINK_LINE_LENGTH - 1) {
+      linkLine[linkLineLength++] = c;
+    }
+  }
+  pumpLinkQueue();
+}
+
+bool isDoorAddress(int door) {
+  return door == 1;
+}
+
+bool doorStalled(int door) {
+  return false;
+}
+
+// Queued, and sent at once if the link is free; false, and logged, if the
+// queue is full
+bool sendControllerLine(const char* line) {
+  if (strlen(line) >= (size_t)AUTH_LINE_LENGTH) return false;
+  if (linkQueueCount == LINK_QUEUE_SIZE) {
+    logEvent(LOG_WARN, LOG_LINE_DROPPED, 1);
+    return false;
+  }
+  strcpy(linkQueue[(linkQueueHead + linkQueueCount) % LINK_QUEUE_SIZE], line);
+  linkQueueCount++;
+  pumpLinkQueue();
+  return true;
+}
+
+bool sendDoorLine(uint8_t door, const char* line) {
+  return sendControllerLine(line);
+}
+
+bool linkHasRoom(int lines) {
+  return LINK_QUEUE_SIZE - linkQueueCount >= lines;
+}
+
+void pumpLinkQueue() {
+  if (linkAuthPending && millis() - linkLineSentMs < LINK_AUTH_WAIT_MS) return;
+  linkAuthPending = false;
+  if (linkQueueCount == 0) return;
+  const char* line = linkQueue[linkQueueHead];
+  Serial.println(line);
+  linkAuthPending = strncmp(line, "AUTH ", 5) == 0;
+  linkLineSentMs = millis();
+  linkQueueHead = (linkQueueHead + 1) % LINK_QUEUE_SIZE;
+  linkQueueCount--;
+}
+#endif
+
+void dispatchControllerEvent(char* event) {
+  noteActivity();
+  long fields[MAX_EVENT_FIELDS] = {0};
+  int count = parseControllerEvent(event, fields);
+  feedRules(1, event, fields, count);
+  recordControllerAccess(1, event, fields, count);
+  dispatchParsedEvent(event, fields, count);
+}
+
+// Splits "NAME,f1,f2" in place: `event` is left holding just the name
+int parseControllerEvent(char* event, long* fields) {
+  int count = 0;
+  char* cursor = strchr(event, ',');
+  if (cursor) *cursor = '\0';
+  while (cursor && count < MAX_EVENT_FIELDS) {
+    fields[count++] = strtol(cursor + 1, &cursor, 10);
+    if (*cursor != ',') break;
+  }
+  return count;
+}
+
+void dispatchParsedEvent(const char* event, long* fields, int count) {
+  if (strcmp(event, "MOVE") == 0 && count >= 3) {
+    handleMoveEvent(fields[0], fields[1], fields[2]);
+  } else if (strcmp(event, "LOOP") == 0 && count >= 1) {
+    // @LOOP,<max loop time in us over the last report period>
+    fbSetIntAsync(PATH_STATUS_MAX_LOOP_US, fields[0]);
+  } else if (strcmp(event, "AUTH") == 0 && count >= 3) {
+    handleAuthEvent(1, fields[0], fields[1], fields[2]);
+  } else if (strcmp(event, "WHEEL") == 0 && count >= 2) {
+    // @WHEEL,<armed timers>,<slowest timer wheel catch-up in us>
+    FirebaseJson json;
+    json.set("armed", (int)fields[0]);
+    json.set("maxTickUs", (int)fields[1]);
+    fbUpdateNodeAsync(PATH_STATUS_WHEEL, json);
+  } else if (strcmp(event, "JITTER") == 0 && count >= 3) {
+    // @JITTER,<loop passes timed>,<mean us>,<max us> at the end of a jitterTest
+    FirebaseJson json;
+    json.set("passes", (int)fields[0]);
+    json.set("meanUs", (int)fields[1]);
+    json.set("maxUs", (int)fields[2]);
+    fbUpdateNodeAsync(PATH_STATUS_JITTER, json);
+  } else if (strcmp(event, "CFG") == 0 && count >= 2) {
+    handleConfigEvent(fields[0], fields[1]);
+  } else if (strcmp(event, "TRACE") == 0 && count >= 4) {
+    handleTraceEvent(fields[0], fields[1], fields[2], fields[3]);
+  } else if (strcmp(event, "CARD") == 0 && count >= 3) {
+    handleCardEvent(fields[0], fields[1], fields[2]);
+  } else if (strcmp(event, "DOOR") == 0 && count >= 3) {
+    handleDoorEvent(fields[0], fields[1], fields[2]);
+  } else if (strcmp(event, "BOOT") == 0 && count >= 3) {
+    handleUnoBootEvent(fields[0], fields[1], fields[2]);
+  }
+}
+
+// @MOVE,<locked>,<ok>,<durationMs>
+void handleMoveEvent(bool locked, bool ok, long durationMs) {
+  servoMoves++;
+  if (!ok) servoFailedMoves++;
+
+  FirebaseJson json;
+  json.set("moves", (int)servoMoves);
+  json.set("failedMoves", (int)servoFailedMoves);
+  json.set("lastMoveMs", (int)durationMs);
+  json.set("lastTarget", locked ? "locked" : "unlocked");
+  json.set("lastOk", ok);
+  fbUpdateNodeAsync(PATH_STATUS_SERVO, json);
+
+  if (!ok) {
+    logEvent(LOG_ERROR, LOG_SERVO_MOVE_FAILED, locked);
+  }
+}
+
+// @CARD,<event>,<slot>,<auth us>; events follow the Uno's CardEvent
+void handleCardEvent(long event, long slot, long authMicros) {
+  static const char* const EVENTS[] = {"granted", "denied", "enrolled", "tableFull", "known"};
+  const char* name = event >= 0 && event < 5 ? EVENTS[event] : "unknown";
+  if (event == 0) cardsGranted++;
+  if (event == 1) {
+    cardsDenied++;
+    logEvent(LOG_WARN, LOG_CARD_DENIED, 0);
+  }
+
+  FirebaseJson json;
+  json.set("lastEvent", name);
+  json.set("lastSlot", (int)slot);
+  json.set("lastAuthUs", (int)authMicros);
+  json.set("granted", (int)cardsGranted);
+  json.set("denied", (int)cardsDenied);
+  json.set("at/.sv", "timestamp");
+  fbUpdateNodeAsync(PATH_STATUS_RFID, json);
+}
+
+#ifdef GATEWAY_MODE
+// ========================
+// == RS-485 GATEWAY ======
+// ========================
+void initializeBus() {
+  pinMode(BUS_DE_PIN, OUTPUT);
+  digitalWrite(BUS_DE_PIN, LOW);
+  for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) {
+    DoorState& d = doors[door];
+    d.online = false;
+    d.misses = BUS_OFFLINE_AFTER_MISSES; // unknown doors start out being probed
+    d.isLocked = SHADOW_UNKNOWN;
+    d.lastMoveOk = d.lastCard = d.bootReason = d.doorEvent = -1;
+    d.configVersion = -1;
+  }
+}
+
+bool isDoorAddress(int door) {
+  return door >= 1 && door <= BUS_MAX_DOORS;
+}
+
+// Offline with a full queue: nothing more gets through until it answers again
+bool doorStalled(int door) {
+  return !doors[door].online && doors[door].queueCount == DOOR_QUEUE_SIZE;
+}
+
+void sendBusFrame(uint8_t address, const char* payload) {
+  digitalWrite(BUS_DE_PIN, HIGH);
+  Serial.printf("#%02u:%s\n", address, payload);
+  Serial.flush();
+  delayMicroseconds(BUS_LAST_CHAR_US);
+  digitalWrite(BUS_DE_PIN, LOW);
+}
+
+void noteLineDropped(uint8_t door) {
+  linesDropped++;
+  logEvent(LOG_WARN, LOG_LINE_DROPPED, door);
+}
+
+// Goes out as a broadcast frame between turns; false, and logged, if the
+// queue is full
+bool sendControllerLine(const char* line) {
+  if (strlen(line) >= (size_t)BROADCAST_LINE_LENGTH) return false;
+  if (broadcastCount == BROADCAST_QUEUE_SIZE) {
+    noteLineDropped(BUS_BROADCAST);
+    return false;
+  }
+  strcpy(broadcastQueue[(broadcastHead + broadcastCount) % BROADCAST_QUEUE_SIZE], line);
+  broadcastCount++;
+  return true;
+}
+
+// Queued for the door's next turn; false if its queue is full
+bool sendDoorLine(uint8_t door, const char* line) {
+  if (!isDoorAddress(door) || strlen(line) >= (size_t)DOOR_LINE_LENGTH) return false;
+  DoorState& d = doors[door];
+  if (d.queueCount == DOOR_QUEUE_SIZE) {
+    noteLineDropped(door);
+    return false;
+  }
+  strcpy(d.queue[(d.queueHead + d.queueCount) % DOOR_QUEUE_SIZE], line);
+  d.queueCount++;
+  return true;
+}
+
+// Called every loop pass and every 10 ms while idle: reads whatever the
+// door holding the bus has sent, and starts the next turn once it is done
+void readControllerLink() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      linkLine[linkLineLength] = '\0';
+      linkLineEpochMs = epochMillis();
+      linkLineMicros = micros();
+      if (linkLineLength > 0) handleBusLine(linkLine);
+      linkLineLength = 0;
+    } else if (linkLineLength < LINK_LINE_LENGTH - 1) {
+      linkLine[linkLineLength++] = c;
+    }
+  }
+
+  if (busTurnDoor != 0) {
+    if (millis() - busTurnStartMs < BUS_TURN_TIMEOUT_MS) return;
+    endBusTurn(false);
+  }
+  startBusTurn();
+}
+
+void handleBusLine(char* line) {
+  if (line[0] != '#' || strlen(line) < 5 || line[3] != ':') return;
+  int address = (line[1] - '0') * 10 + (line[2] - '0');
+  if (address != busTurnDoor) return; // a late answer from an earlier turn
+  char* payload = line + 4;
+  if (strcmp(payload, ".") == 0) {
+    endBusTurn(true);
+  } else if (payload[0] == '@' && payload[1] != '\0') {
+    dispatchDoorEvent(address, payload + 1);
+  }
+}
+
+void startBusTurn() {
+  // Broadcasts are nobody's turn and nobody acks them, so they are paced:
+  // at most one per bus cycle, and only once every online door has answered
+  // a turn since the last one and so has read it. A door sitting in a 2 s
+  // hold never has more than one waiting in its 64-byte receive buffer.
+  if (broadcastCount > 0 && broadcastCycle != busCycles && broadcastsCaughtUp()) {
+    sendBusFrame(BUS_BROADCAST, broadcastQueue[broadcastHead]);
+    broadcastHead = (broadcastHead + 1) % BROADCAST_QUEUE_SIZE;
+    broadcastCount--;
+    broadcastCycle = busCycles;
+    for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) doors[door].heardBroadcast = false;
+    return;
+  }
+
+  uint8_t door = nextBusDoor();
+  if (door == 0) return;
+  DoorState& d = doors[door];
+  busTurnCarried = d.queueCount > 0;
+  const char* line = busTurnCarried ? d.queue[d.queueHead] : "?";
+  d.authInFlight = strncmp(line, "AUTH ", 5) == 0 ? strtoul(line + 5, nullptr, 16) : 0;
+  sendBusFrame(door, line);
+  d.polls++;
+  busTurnDoor = door;
+  busTurnStartMs = millis();
+}
+
+bool broadcastsCaughtUp() {
+  for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) {
+    if (doors[door].online && !doors[door].heardBroadcast) return false;
+  }
+  return true;
+}
+
+// Online doors with queued lines first, so a command does not wait a whole
+// round; then round robin over online doors, plus offline ones on probe rounds
+uint8_t nextBusDoor() {
+  for (uint8_t i = 0; i < BUS_MAX_DOORS; i++) {
+    uint8_t door = 1 + (busRoundRobin - 1 + i) % BUS_MAX_DOORS;
+    if (doors[door].online && doors[door].queueCount > 0) return door;
+  }
+  for (uint8_t i = 0; i < BUS_MAX_DOORS; i++) {
+    uint8_t door = busRoundRobin;
+    busRoundRobin = busRoundRobin % BUS_MAX_DOORS + 1;
+    if (busRoundRobin == 1) busCycles++;
+    if (doors[door].online || busCycles % BUS_PROBE_EVERY_CYCLES == 0) return door;
+  }
+  return 0;
+}
+
+void endBusTurn(bool answered) {
+  DoorState& d = doors[busTurnDoor];
+  if (answered) {
+    if (busTurnCarried) {
+      // A lost answer means the line goes again; the door answers a signed
+      // line it already ran as a replay, which handleAuthEvent() accepts
+      d.queueHead = (d.queueHead + 1) % DOOR_QUEUE_SIZE;
+      d.queueCount--;
+    }
+    d.misses = 0;
+    d.heardBroadcast = true;
+    if (!d.online) {
+      d.online = true;
+      d.dirty = true;
+    }
+  } else {
+    busTimeouts++;
+    if (d.misses < BUS_OFFLINE_AFTER_MISSES) d.misses++;
+    if (d.online && d.misses >= BUS_OFFLINE_AFTER_MISSES) {
+      d.online = false;
+      d.dirty = true;
+    }
+  }
+  busTurnDoor = 0;
+}
+
+// Events that describe the door land in its DoorState; the rest (TRACE,
+// CFG, LOOP) are handled as on a direct link
+void dispatchDoorEvent(uint8_t door, char* event) {
+  DoorState& d = doors[door];
+  d.events++;
+  noteActivity();
+  long fields[MAX_EVENT_FIELDS] = {0};
+  int count = parseControllerEvent(event, fields);
+  recordControllerAccess(door, event, fields, count);
+
+  if (strcmp(event, "SIG") == 0 && count >= 1) {
+    // @SIG,<code>: the codes the signal lines carry on a direct link
+    if (fields[0] == 0b001 || fields[0] == 0b011) {
+      d.isLocked = fields[0] == 0b001;
+      feedRules(door, event, fields, count);
+      completeTrace();
+    } else if (fields[0] == 0b010) {
+      d.alert = "knock";
+      feedRules(door, event, fields, count);
+    } else if (fields[0] == 0b100) {
+      d.alert = "registration";
+    }
+  } else if (strcmp(event, "PIN") == 0) {
+    feedRules(door, event, fields, count);
+    return;
+  } else if (strcmp(event, "MOVE") == 0 && count >= 2) {
+    d.lastMoveOk = fields[1] != 0;
+    if (!fields[1]) logEvent(LOG_ERROR, LOG_SERVO_MOVE_FAILED, door);
+  } else if (strcmp(event, "CARD") == 0 && count >= 1) {
+    d.lastCard = fields[0];
+    feedRules(door, event, fields, count);
+    if (fields[0] == 1) logEvent(LOG_WARN, LOG_CARD_DENIED, door);
+  } else if (strcmp(event, "DOOR") == 0 && count >= 2) {
+    d.doorEvent = fields[0];
+    feedRules(door, event, fields, count);
+    if (fields[1]) {
+      d.alert = "forced";
+      logEvent(LOG_ERROR, LOG_DOOR_FORCED, door);
+    }
+  } else if (strcmp(event, "CFG") == 0 && count >= 2) {
+    handleDoorConfigEvent(door, fields[0], fields[1]);
+    return;
+  } else if (strcmp(event, "AUTH") == 0 && count >= 3) {
+    handleAuthEvent(door, fields[0], fields[1], fields[2]);
+    return;
+  } else if (strcmp(event, "BOOT") == 0 && count >= 1) {
+    d.bootReason = fields[0];
+    if (lowBattery) sendDoorLine(door, "PWR 1");
+    controllerClockDue = true; // broadcast; the other doors just resync
+  } else {
+    dispatchParsedEvent(event, fields, count);
+    return;
+  }
+  d.dirty = true;
+}
+
+int appendDoorField(int n, uint8_t door, const char* field, const char* value) {
+  if (n >= (int)sizeof(doorsBuffer)) return n;
+  return n + snprintf(doorsBuffer + n, sizeof(doorsBuffer) - n, ",\"doors/%02u/%s\":%s", door, field, value);
+}
+
+// Every changed door goes up in one multi-location update
+void flushDoorStates() {
+  unsigned long now = millis();
+  if (now - lastDoorFlushTime < DOOR_FLUSH_INTERVAL_MS) return;
+  lastDoorFlushTime = now;
+
+  int n = snprintf(doorsBuffer, sizeof(doorsBuffer), "{\"bus/cycles\":%lu,\"bus/timeouts\":%lu,\"bus/dropped\":%lu",
+                   busCycles, busTimeouts, linesDropped);
+  int dirty = 0;
+  char value[24];
+  for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) {
+    DoorState& d = doors[door];
+    if (!d.dirty) continue;
+    dirty++;
+    n = appendDoorField(n, door, "online", d.online ? "true" : "false");
+    if (d.isLocked != SHADOW_UNKNOWN) n = appendDoorField(n, door, "isLocked", d.isLocked ? "true" : "false");
+    if (d.alert) {
+      snprintf(value, sizeof(value), "\"%s\"", d.alert);
+      n = appendDoorField(n, door, "alert", value);
+      n = appendDoorField(n, door, "alertAt", "{\".sv\":\"timestamp\"}");
+    }
+    if (d.lastMoveOk >= 0) n = appendDoorField(n, door, "lastMoveOk", d.lastMoveOk ? "true" : "false");
+    snprintf(value, sizeof(value), "%d", d.lastCard);
+    if (d.lastCard >= 0) n = appendDoorField(n, door, "lastCard", value);
+    snprintf(value, sizeof(value), "%d", d.doorEvent);
+    if (d.doorEvent >= 0) n = appendDoorField(n, door, "door", value);
+    snprintf(value, sizeof(value), "%d", d.bootReason);
+    if (d.bootReason >= 0) n = appendDoorField(n, door, "bootReason", value);
+    snprintf(value, sizeof(value), "%lu", d.polls);
+    n = appendDoorField(n, door, "polls", value);
+    snprintf(value, sizeof(value), "%lu", d.events);
+    n = appendDoorField(n, door, "events", value);
+  }
+  if (dirty == 0 || n >= (int)sizeof(doorsBuffer) - 1) return;
+  snprintf(doorsBuffer + n, sizeof(doorsBuffer) - n, "}");
+
+  FirebaseJson json;
+  json.setJsonData(doorsBuffer);
+  if (!fbUpdateNode(LOCK_PATH, json)) return; // stays dirty for the next flush
+  for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) {
+    doors[door].dirty = false;
+    doors[door].alert = nullptr;
+  }
+}
+
+// Each door that does not hold configVersion gets the whole document,
+// queued in one go once its queue has room for it. It then goes out a line
+// per turn, each one acked by the turn, and the door's @CFG acks the lot.
+void pumpDoorConfig() {
+  if (configVersion < 0) return;
+  int lines = 1; // CFG_COMMIT
+  for (int i = 0; i < CONFIG_KEY_COUNT; i++) {
+    if (sentConfig[i][0] != '\0') lines++;
+  }
+  for (uint8_t door = 1; door <= BUS_MAX_DOORS; door++) {
+    DoorState& d = doors[door];
+    if (!d.online || d.configVersion == configVersion) continue;
+    if (d.configPending && millis() - d.configSentMs < CONFIG_CHECK_INTERVAL) continue;
+    if (DOOR_QUEUE_SIZE - d.queueCount < lines) continue;
+
+    char line[AUTH_COMMAND_LENGTH];
+    configBytesSent = 0;
+    for (int i = 0; i < CONFIG_KEY_COUNT; i++) {
+      if (sentConfig[i][0] == '\0') continue;
+      configBytesSent += AUTH_PREFIX_LENGTH + snprintf(line, sizeof(line), "CFG %s=%s", CONFIG_KEYS[i].unoKey, sentConfig[i]) + 1;
+      sendSignedLine(door, line);
+    }
+    configBytesSent += AUTH_PREFIX_LENGTH + snprintf(line, sizeof(line), "CFG_COMMIT %ld", configVersion) + 1;
+    sendSignedLine(door, line);
+    d.configPending = true;
+    d.configSentMs = millis();
+  }
+}
+
+// @CFG,<version>,<keys applied> from one door
+void handleDoorConfigEvent(uint8_t door, long version, long keys) {
+  DoorState& d = doors[door];
+  bool acked = d.configPending && version == configVersion;
+  d.configVersion = version;
+  d.configPending = false; // a boot report of another version is resent now
+  if (!acked) return;
+
+  FirebaseJson json;
+  json.set("door", door);
+  json.set("version", (int)version);
+  json.set("keys", (int)keys);
+  json.set("bytes", configBytesSent);
+  json.set("bridgeToUnoMs", (int)(millis() - d.configSentMs));
+  fbUpdateNodeAsync(PATH_STATUS_CONFIG, json);
+}
+#endif
+
+// @DOOR,<event>,<forced>,<latency us>; events follow the Uno's DoorEvent.
+// The Uno reports how long after the first edge it sent this, so the edge
+// time is our arrival time minus that.
+void handleDoorEvent(long event, bool forced, long latencyMicros) {
+  static const char* const EVENTS[] = {"open", "closed", "ajar"};
+  if (forced) logEvent(LOG_ERROR, LOG_DOOR_FORCED, 0);
+
+  FirebaseJson json;
+  json.set("state", event >= 0 && event < 3 ? EVENTS[event] : "unknown");
+  json.set("forced", forced);
+  json.set("reportUs", (int)latencyMicros);
+  if (clockValid()) {
+    json.set("at", (double)(linkLineEpochMs - latencyMicros / 1000));
   } else {
-    logFirebaseSuccess("safeSetBool → " + path);
+    json.set("at/.sv", "timestamp");
+  }
+  fbUpdateNodeAsync(PATH_STATUS_DOOR, json);
+}
+
+// ========================
+// == COMMAND TRACING =====
+// ========================
+// Only one command is traced at a time; others in a burst run untraced.
+bool sendTracedCommand(uint8_t door, char command, const char* id, uint64_t issuedMs, uint64_t fetchedMs) {
+  char line[16];
+  snprintf(line, sizeof(line), "TRACE %u", nextTraceNumber);
+  // Traced only if the TRACE line made it into the queue
+  if (!trace.active && clockValid() && sendDoorLine(door, line)) {
+    trace.active = true;
+    trace.boltDone = false;
+    trace.number = nextTraceNumber++;
+    if (nextTraceNumber == 0) nextTraceNumber = 1;
+    strncpy(trace.id, id, sizeof(trace.id) - 1);
+    trace.id[sizeof(trace.id) - 1] = '\0';
+    trace.issuedMs = issuedMs;
+    trace.fetchedMs = fetchedMs;
+    trace.unoRecvMs = trace.boltMs = 0;
+    trace.startedMillis = millis();
+    trace.uartMs = epochMillis();
+    if (!sendLockCommand(door, command)) {
+      trace.active = false; // nothing is coming back for it
+      return false;
+    }
+    return true;
   }
+  return sendLockCommand(door, command);
 }
 
-void logFirebaseError(String context) {
-  String errorMessage = "Context: " + context + " | Error: " + fbdo.errorReason();
-  Serial.println(errorMessage);
-  Firebase.setString(fbdo, lockPath + "/errorLog", errorMessage);
+bool sendLockCommand(uint8_t door, char command) {
+  const char line[] = {command, '\0'};
+  return sendSignedLine(door, line);
 }
 
-void logFirebaseSuccess(String context) {
-  String successMessage = "Success: " + context;
-  Serial.println(successMessage);
-  Firebase.setString(fbdo, lockPath + "/successLog", successMessage);
-} 
\ No newline at end of file
+// Wraps a command for the door as "AUTH <counter> <tag> <command>"
+bool sendSignedLine(uint8_t door, const char* command) {
+  if (door < 1 || door > COMMAND_KEY_COUNT) return false; // no key for it
+  size_t length = strlen(command);
+  if (length == 0 || length >= (size_t)AUTH_COMMAND_LENGTH) return false;
+  uint32_t now = clockValid() ? time(nullptr) : 0;
+  commandCounter = now > commandCounter ? now : commandCounter + 1;
+
+  uint8_t header[] = {door, (uint8_t)(commandCounter >> 24), (uint8_t)(commandCounter >> 16),
+                      (uint8_t)(commandCounter >> 8), (uint8_t)commandCounter};
+  br_hmac_key_context key;
+  br_hmac_key_init(&key, &br_sha256_vtable, COMMAND_KEYS[door - 1], sizeof(COMMAND_KEYS[0]));
+  br_hmac_context hmac;
+  br_hmac_init(&hmac, &key, AUTH_TAG_BYTES);
+  br_hmac_update(&hmac, header, sizeof(header));
+  br_hmac_update(&hmac, command, length);
+  uint8_t tag[AUTH_TAG_BYTES];
+  br_hmac_out(&hmac, tag);
+
+  char line[AUTH_LINE_LENGTH];
+  int n = snprintf(line, sizeof(line), "AUTH %08lx ", (unsigned long)commandCounter);
+  for (int i = 0; i < AUTH_TAG_BYTES; i++) n += snprintf(line + n, sizeof(line) - n, "%02x", tag[i]);
+  snprintf(line + n, sizeof(line) - n, " %s", command);
+  return sendDoorLine(door, line);
+}
+
+// @AUTH,<result>,<counter>,<us>; result 0 bad tag, 1 ok, 2 replayed, 3 sync
+void handleAuthEvent(uint8_t door, long result, long counter, long checkUs) {
+  if ((uint32_t)counter > commandCounter) commandCounter = counter;
+#ifdef GATEWAY_MODE
+  if (result == 3) return;
+  // The line went again because its answer was lost: the first copy ran
+  if (result == 2 && (uint32_t)counter == doors[door].authInFlight) result = 1;
+#else
+  linkAuthPending = false; // readControllerLink() sends the next line
+  if (result == 3) return;
+#endif
+  if (result == 1) {
+    authStats.accepted++;
+  } else {
+    authStats.rejected++;
+    logEvent(LOG_WARN, LOG_AUTH_REJECTED, result);
+  }
+  authStats.lastUs = checkUs;
+  if (checkUs > authStats.maxUs) authStats.maxUs = checkUs;
+
+  FirebaseJson json;
+  json.set("accepted", (int)authStats.accepted);
+  json.set("rejected", (int)authStats.rejected);
+  json.set("lastCheckUs", (int)authStats.lastUs);
+  json.set("maxCheckUs", (int)authStats.maxUs);
+  fbUpdateNodeAsync(PATH_STATUS_AUTH, json);
+}
+
+// @TRACE,<number>,<uno ms received>,<uno ms done>,<moved>
+// The event is sent the moment the Uno finishes, so its arrival time anchors
+// the Uno clock: unoMs + offset = bridge epoch ms.
+void handleTraceEvent(long number, long recvUnoMs, long doneUnoMs, bool moved) {
+  if (!trace.active || number != trace.number) return;
+  int64_t offset = (int64_t)linkLineEpochMs - (uint32_t)doneUnoMs;
+  trace.unoRecvMs = offset + (uint32_t)recvUnoMs;
+  trace.boltMs = linkLineEpochMs;
+  trace.boltDone = true;
+  // No move means no status change is coming from the pins
+  if (!moved) completeTrace();
+}
+
+long stageMs(uint64_t from, uint64_t to) {
+  return (from == 0 || to == 0 || to < from) ? -1 : (long)(to - from);
+}
+
+void completeTrace() {
+  if (!trace.active || !trace.boltDone) return;
+  uint64_t statusMs = epochMillis();
+  trace.active = false;
+
+  FirebaseJson json;
+  json.set("id", trace.id);
+  json.set("queueMs", (int)stageMs(trace.issuedMs, trace.fetchedMs));
+  json.set("bridgeMs", (int)stageMs(trace.fetchedMs, trace.uartMs));
+  json.set("uartMs", (int)stageMs(trace.uartMs, trace.unoRecvMs));
+  json.set("boltMs", (int)stageMs(trace.unoRecvMs, trace.boltMs));
+  json.set("statusMs", (int)stageMs(trace.boltMs, statusMs));
+  json.set("totalMs", (int)stageMs(trace.issuedMs ? trace.issuedMs : trace.fetchedMs, statusMs));
+  json.set("at", (int)(statusMs / 1000)); // epoch seconds, to order the ring
+
+  // Slot by trace number: the oldest record is overwritten, never left behind
+  char path[sizeof(PATH_TRACES) + 8];
+  snprintf(path, sizeof(path), "%s/%d", PATH_TRACES, trace.number % TRACE_SLOTS);
+  fbSetJSONAsync(path, json);
+  fbSetJSONAsync(PATH_STATUS_LAST_TRACE, json);
+}
+
+// Publishes whatever stages we have if the Uno never answered
+void checkTraceTimeout() {
+  if (trace.active && millis() - trace.startedMillis > TRACE_TIMEOUT_MS) {
+    trace.boltDone = true;
+    completeTrace();
+  }
+}
+
+// ========================
+// == EDGE RULES ==========
+// ========================
+void loadDefaultRules() {
+  memcpy(rules, DEFAULT_RULES, sizeof(DEFAULT_RULES));
+  ruleCount = sizeof(DEFAULT_RULES) / sizeof(DEFAULT_RULES[0]);
+  rulesRejected = 0;
+  rulesVersion = -1;
+  memset(ruleRuns, 0, sizeof(ruleRuns));
+  memset(ruleDoorOpen, -1, sizeof(ruleDoorOpen));
+  benchmarkRules();
+}
+
+// Maps a controller event onto rule triggers. Called before the event's own
+// handler, which may spend a while writing to Firebase.
+void feedRules(uint8_t door, const char* event, const long* fields, int count) {
+  if (count < 1) return;
+  if (strcmp(event, "PIN") == 0) {
+    evaluateRules(door, fields[0] ? TRIG_PIN_OK : TRIG_PIN_BAD, linkLineMicros);
+  } else if (strcmp(event, "CARD") == 0) {
+    if (fields[0] == 0) evaluateRules(door, TRIG_CARD_OK, linkLineMicros);
+    if (fields[0] == 1) evaluateRules(door, TRIG_CARD_DENIED, linkLineMicros);
+  } else if (strcmp(event, "DOOR") == 0 && count >= 2) {
+    if (fields[0] == 0 || fields[0] == 1) {
+      ruleDoorOpen[door] = fields[0] == 0;
+      evaluateRules(door, fields[0] == 0 ? TRIG_OPENED : TRIG_CLOSED, linkLineMicros);
+    }
+    if (fields[1]) evaluateRules(door, TRIG_FORCED, linkLineMicros);
+  } else if (strcmp(event, "SIG") == 0) {
+    // Only a bus carries these; a direct link has the signal lines
+    if (fields[0] == 0b001) evaluateRules(door, TRIG_LOCKED, linkLineMicros);
+    if (fields[0] == 0b011) evaluateRules(door, TRIG_UNLOCKED, linkLineMicros);
+    if (fields[0] == 0b010) evaluateRules(door, TRIG_TAMPER, linkLineMicros);
+  }
+}
+
+int8_t doorLockedState(uint8_t door) {
+#ifdef GATEWAY_MODE
+  return doors[door].isLocked;
+#else
+  return reported.isLocked;
+#endif
+}
+
+bool ruleConditionsHold(uint8_t conditions, uint8_t door) {
+  int8_t locked = doorLockedState(door);
+  if ((conditions & COND_LOCKED) && locked != 1) return false;
+  if ((conditions & COND_UNLOCKED) && locked != 0) return false;
+  if ((conditions & COND_OPEN) && ruleDoorOpen[door] != 1) return false;
+  if ((conditions & COND_CLOSED) && ruleDoorOpen[door] != 0) return false;
+  if ((conditions & COND_LOW_BATTERY) && !lowBattery) return false;
+  return true;
+}
+
+// The scan is timed on its own; acting on the matches (UART lines, maybe a
+// Firebase write for an alert) comes after. The reaction time runs from the
+// event's arrival to the last command line written, which on a bus means
+// queued for the door's next turn.
+void evaluateRules(uint8_t door, uint8_t trigger, unsigned long eventMicros) {
+  uint32_t startCycles = ESP.getCycleCount();
+  unsigned long now = millis();
+  uint8_t opposite = TRIGGER_OPPOSITES[trigger];
+  uint8_t matched = 0; // bit per rule
+
+  for (int i = 0; i < ruleCount; i++) {
+    const Rule& rule = rules[i];
+    RuleRun& run = ruleRuns[i][door];
+    if (rule.trigger == opposite) {
+      run.hits = 0;
+      run.armed = false;
+      continue;
+    }
+    if (rule.trigger != trigger) continue;
+
+    if (rule.count > 1) {
+      if (run.hits == 0 || (rule.windowS && now - run.windowStart > rule.windowS * 1000UL)) {
+        run.hits = 0;
+        run.windowStart = now;
+      }
+      if (++run.hits < rule.count) continue;
+      run.hits = 0;
+    }
+    if (rule.forS) {
+      run.armed = true;
+      run.armedAt = now;
+    } else if (ruleConditionsHold(rule.conditions, door)) {
+      matched |= 1 << i;
+    }
+  }
+
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  ruleStats.evaluations++;
+  ruleStats.evalCycles += cycles;
+  if (cycles > ruleStats.evalMaxCycles) ruleStats.evalMaxCycles = cycles;
+  if (!matched || rulesDryRun) return;
+
+  for (int i = 0; i < ruleCount; i++) {
+    if (matched & (1 << i)) fireRule(i, door);
+  }
+  unsigned long reactionUs = micros() - eventMicros;
+  ruleStats.reactions++;
+  ruleStats.reactionTotalUs += reactionUs;
+  if (reactionUs > ruleStats.reactionMaxUs) ruleStats.reactionMaxUs = reactionUs;
+  for (int i = 0; i < ruleCount; i++) {
+    if ((matched & (1 << i)) && (rules[i].actions & ACT_ALERT)) raiseRuleAlert(i, door);
+  }
+}
+
+void fireRule(int index, uint8_t door) {
+  const Rule& rule = rules[index];
+  ruleStats.fired++;
+  if (rule.actions & ACT_LOCK) sendLockCommand(door, 'L');
+  if (rule.actions & ACT_LOCKOUT) {
+    char line[24];
+    snprintf(line, sizeof(line), "KEYPAD_LOCK %u", rule.lockoutS);
+    sendSignedLine(door, line);
+  }
+  if (rule.actions & ACT_ALARM) sendDoorLine(door, "ALARM");
+  logEvent(LOG_INFO, LOG_RULE_FIRED, door << 8 | index);
+  recordAccess(ACCESS_RULE, door, index);
+}
+
+void raiseRuleAlert(int index, uint8_t door) {
+  const char* alert = TRIGGER_NAMES[rules[index].trigger];
+#ifdef GATEWAY_MODE
+  doors[door].alert = alert;
+  doors[door].dirty = true;
+#else
+  reported.alert = alert;
+  flushShadow();
+  ruleAlertRaised = true;
+  ruleAlertMillis = millis();
+#endif
+}
+
+// Fires timed rules that have waited out forS, and clears a raised alert
+void checkRules() {
+  unsigned long now = millis();
+  for (int i = 0; i < ruleCount; i++) {
+    for (uint8_t door = 1; door < RULE_DOORS; door++) {
+      RuleRun& run = ruleRuns[i][door];
+      if (!run.armed || now - run.armedAt < rules[i].forS * 1000UL) continue;
+      run.armed = false;
+      if (!ruleConditionsHold(rules[i].conditions, door)) continue;
+      fireRule(i, door);
+      if (rules[i].actions & ACT_ALERT) raiseRuleAlert(i, door);
+    }
+  }
+
+  if (ruleAlertRaised && now - ruleAlertMillis >= RULE_ALERT_HOLD_MS) {
+    ruleAlertRaised = false;
+    reported.alert = "none";
+    flushShadow();
+  }
+}
+
+// Times the table against every trigger on door 1 as things stand now,
+// without acting or disturbing the counts and timers
+void benchmarkRules() {
+  RuleRun saved[MAX_RULES];
+  for (int i = 0; i < MAX_RULES; i++) saved[i] = ruleRuns[i][1];
+  RuleStats kept = ruleStats;
+
+  rulesDryRun = true;
+  uint32_t startCycles = ESP.getCycleCount();
+  for (int round = 0; round < RULE_BENCH_ROUNDS; round++) {
+    for (uint8_t trigger = 0; trigger < TRIG_COUNT; trigger++) evaluateRules(1, trigger, 0);
+  }
+  uint32_t cycles = ESP.getCycleCount() - startCycles;
+  rulesDryRun = false;
+
+  for (int i = 0; i < MAX_RULES; i++) ruleRuns[i][1] = saved[i];
+  ruleStats = kept;
+  uint64_t evals = (uint64_t)RULE_BENCH_ROUNDS * TRIG_COUNT;
+  ruleStats.benchNsPerEval = (uint64_t)cycles * 1000 / ESP.getCpuFreqMHz() / evals;
+  ruleStats.benchEvalsPerS = cycles ? evals * ESP.getCpuFreqMHz() * 1000000 / cycles : 0;
+  ruleReportDue = true;
+}
+
+void checkRemoteRules() {
+  if (rulesFetchDue) {
+    rulesFetchDue = false;
+    fetchRemoteRules(rulesFetchVersion);
+  }
+  unsigned long now = millis();
+  if (!rulesCheckDue && now - lastRulesCheckTime < CONFIG_CHECK_INTERVAL) return;
+  lastRulesCheckTime = now;
+  rulesCheckDue = false;
+
+  fbGetAsync(PATH_RULES_VERSION, onRulesVersion);
+}
+
+// Runs as an async completion, so the blocking fetch is left to loop()
+void onRulesVersion(int status, const char* body) {
+  char* end;
+  long version = strtol(body, &end, 10);
+  if (end == body || version == rulesVersion) return;
+  rulesFetchVersion = version;
+  rulesFetchDue = true;
+}
+
+// Without a /rules node the built-in rules stay
+void fetchRemoteRules(long version) {
+  if (!fbGetJSON(PATH_RULES)) return;
+  compileRules(fbdo.jsonObject(), version);
+}
+
+// Returns the bits of the comma-separated names in `list`, -1 if one is unknown
+int parseRuleNames(const String& list, const char* const* names, int count) {
+  int mask = 0;
+  int start = 0;
+  while (start < (int)list.length()) {
+    int end = list.indexOf(',', start);
+    if (end < 0) end = list.length();
+    String name = list.substring(start, end);
+    name.trim();
+    int bit = -1;
+    for (int i = 0; i < count; i++) {
+      if (name == names[i]) bit = i;
+    }
+    if (bit < 0) return -1;
+    mask |= 1 << bit;
+    start = end + 1;
+  }
+  return mask;
+}
+
+long ruleNumber(FirebaseJson& json, const String& path, long fallback, long maxValue) {
+  FirebaseJsonData field;
+  json.get(field, path);
+  if (!field.success) return fallback;
+  return constrain((long)field.intValue, 0L, maxValue);
+}
+
+bool compileRule(FirebaseJson& json, const char* key, Rule& rule) {
+  String base = String("list/") + key + "/";
+  FirebaseJsonData field;
+
+  json.get(field, base + "on");
+  int trigger = field.success ? parseRuleNames(field.stringValue, TRIGGER_NAMES, TRIG_COUNT) : -1;
+  // A single trigger: exactly one bit
+  if (trigger <= 0 || (trigger & (trigger - 1))) return false;
+  json.get(field, base + "if");
+  int conditions = field.success ? parseRuleNames(field.stringValue, CONDITION_NAMES, 5) : 0;
+  json.get(field, base + "do");
+  int actions = field.success ? parseRuleNames(field.stringValue, ACTION_NAMES, 4) : -1;
+  if (conditions < 0 || actions <= 0) return false;
+  if ((conditions & COND_LOCKED) && (conditions & COND_UNLOCKED)) return false;
+  if ((conditions & COND_OPEN) && (conditions & COND_CLOSED)) return false;
+
+  rule.trigger = __builtin_ctz(trigger);
+  rule.conditions = conditions;
+  rule.actions = actions;
+  rule.count = max(1L, ruleNumber(json, base + "count", 1, 255));
+  rule.windowS = ruleNumber(json, base + "withinS", 0, 65535);
+  rule.forS = ruleNumber(json, base + "forS", 0, 65535);
+  rule.lockoutS = ruleNumber(json, base + "lockoutS", DEFAULT_LOCKOUT_S, 65535);
+  return true;
+}
+
+// Builds the new table aside and swaps it in whole. Rules that do not
+// compile are counted in status/rules and left out.
+void compileRules(FirebaseJson& json, long version) {
+  char keys[MAX_RULES][RULE_KEY_LENGTH + 1];
+  int keyCount = 0;
+  int rejected = 0;
+  int type = 0;
+  String key, value;
+
+  // Rule fields are never objects, so every object but "list" is a rule
+  size_t len = json.iteratorBegin();
+  for (size_t i = 0; i < len; i++) {
+    json.iteratorGet(i, type, key, value);
+    if (type != FirebaseJson::JSON_OBJECT || key == "list") continue;
+    if (keyCount == MAX_RULES || key.length() > RULE_KEY_LENGTH) {
+      rejected++;
+      continue;
+    }
+    key.toCharArray(keys[keyCount++], RULE_KEY_LENGTH + 1);
+  }
+  json.iteratorEnd();
+
+  Rule compiled[MAX_RULES];
+  int count = 0;
+  for (int i = 0; i < keyCount; i++) {
+    if (compileRule(json, keys[i], compiled[count])) count++;
+    else rejected++;
+  }
+
+  memcpy(rules, compiled, count * sizeof(Rule));
+  ruleCount = count;
+  rulesRejected = rejected;
+  rulesVersion = version;
+  memset(ruleRuns, 0, sizeof(ruleRuns));
+  benchmarkRules();
+}
+
+void publishRuleStats() {
+  if (lowBattery) return; // diagnostics only
+  unsigned long now = millis();
+  if (!ruleReportDue && now - lastRuleReportTime < RULE_REPORT_INTERVAL) return;
+  lastRuleReportTime = now;
+  ruleReportDue = false;
+
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  unsigned long evals = ruleStats.evaluations;
+  unsigned long warm = linkStats.requests - linkStats.handshakes;
+  unsigned long warmAvg = warm ? linkStats.warmTotalMs / warm : 0;
+
+  FirebaseJson json;
+  json.set("version", (int)rulesVersion);
+  json.set("rules", ruleCount);
+  json.set("rejected", rulesRejected);
+  json.set("benchNsPerEval", (int)ruleStats.benchNsPerEval);
+  json.set("benchEvalsPerS", (int)ruleStats.benchEvalsPerS);
+  json.set("evaluations", (int)evals);
+  json.set("evalAvgNs", (int)(evals ? ruleStats.evalCycles * 1000 / mhz / evals : 0));
+  json.set("evalMaxNs", (int)((uint64_t)ruleStats.evalMaxCycles * 1000 / mhz));
+  json.set("fired", (int)ruleStats.fired);
+  json.set("reactionAvgUs", (int)(ruleStats.reactions ? ruleStats.reactionTotalUs / ruleStats.reactions : 0));
+  json.set("reactionMaxUs", (int)ruleStats.reactionMaxUs);
+  // The same reaction through the cloud: our write of the event, whatever
+  // watches it queueing a command, and half a poll before we fetch it
+  json.set("cloudPathMs", (int)(2 * warmAvg + pollIntervalMs / 2));
+  fbUpdateNodeAsync(PATH_STATUS_RULES, json);
+}
+
+// ========================
+// == REMOTE CONFIG =======
+// ========================
+bool isForwardableValue(const String& value) {
+  if (value.length() == 0 || value.length() > CONFIG_VALUE_LENGTH) return false;
+  for (unsigned int i = 0; i < value.length(); i++) {
+    if (value[i] <= ' ' || value[i] > '~') return false;
+  }
+  return true;
+}
+
+void checkRemoteConfig() {
+#ifdef GATEWAY_MODE
+  if (configFetchDue) { // pumpDoorConfig() waits for room in each door's queue
+#else
+  if (configFetchDue && linkHasRoom(CONFIG_KEY_COUNT + 1)) { // the push must go out whole
+#endif
+    configFetchDue = false;
+    fetchRemoteConfig(configFetchVersion);
+  }
+  unsigned long now = millis();
+  if (!configCheckDue && now - lastConfigCheckTime < CONFIG_CHECK_INTERVAL) return;
+  lastConfigCheckTime = now;
+  configCheckDue = false;
+  fbGetAsync(PATH_CONFIG_VERSION, onConfigVersion);
+}
+
+// The poll answers with just the version; the document is fetched the
+// blocking way from loop(), and only when that changed
+void onConfigVersion(int status, const char* body) {
+  char* end;
+  long version = strtol(body, &end, 10);
+#ifdef GATEWAY_MODE
+  if (end == body || version == configVersion) return;
+#else
+  if (end == body || version == unoConfigVersion) return;
+  // Give an unanswered push one check interval before sending it again
+  if (version == pendingConfigVersion && millis() - configSentMillis < CONFIG_CHECK_INTERVAL) return;
+#endif
+  configFetchVersion = version;
+  configFetchDue = true;
+}
+
+void fetchRemoteConfig(long version) {
+  if (!fbGetJSON(PATH_CONFIG)) return;
+  FirebaseJson& json = fbdo.jsonObject();
+  FirebaseJsonData field;
+
+  json.get(field, "regWindowMs");
+  if (field.success && field.intValue > 0) registrationWindowMs = field.intValue;
+  json.get(field, "utcOffsetMin");
+  if (field.success && field.intValue != utcOffsetMinutes && abs(field.intValue) <= 14 * 60) {
+    utcOffsetMinutes = field.intValue;
+    controllerClockDue = true;
+  }
+  json.get(field, "updatedAt");
+  configUpdatedAtMs = field.success ? (uint64_t)field.doubleValue : 0;
+
+#ifdef GATEWAY_MODE
+  // The doors may each hold something different, so keep the whole
+  // document; pumpDoorConfig() hands it out
+  for (int i = 0; i < CONFIG_KEY_COUNT; i++) {
+    json.get(field, CONFIG_KEYS[i].firebaseKey);
+    if (field.success && isForwardableValue(field.stringValue)) {
+      field.stringValue.toCharArray(sentConfig[i], CONFIG_VALUE_LENGTH + 1);
+    }
+  }
+  configVersion = version;
+#else
+  // Diff against what the Uno acked, not what we last sent: a push that was
+  // lost on the line is sent again in full
+  char line[AUTH_COMMAND_LENGTH];
+  configBytesSent = 0;
+  memcpy(sentConfig, forwardedConfig, sizeof(sentConfig));
+  for (int i = 0; i < CONFIG_KEY_COUNT; i++) {
+    json.get(field, CONFIG_KEYS[i].firebaseKey);
+    if (!field.success || !isForwardableValue(field.stringValue)) continue;
+    if (strcmp(field.stringValue.c_str(), forwardedConfig[i]) == 0) continue;
+
+    configBytesSent += AUTH_PREFIX_LENGTH + snprintf(line, sizeof(line), "CFG %s=%s", CONFIG_KEYS[i].unoKey, field.stringValue.c_str()) + 1;
+    sendSignedLine(1, line);
+    field.stringValue.toCharArray(sentConfig[i], CONFIG_VALUE_LENGTH + 1);
+  }
+  configBytesSent += AUTH_PREFIX_LENGTH + snprintf(line, sizeof(line), "CFG_COMMIT %ld", version) + 1;
+  sendSignedLine(1, line);
+
+  pendingConfigVersion = version;
+  configSentMillis = millis();
+#endif
+}
+
+// @CFG,<version>,<keys applied>
+void handleConfigEvent(long version, long keys) {
+  if (version != pendingConfigVersion) {
+    // Boot report. If the Uno holds something other than what we last sent
+    // (EEPROM reset, older image), forget our copy and resend everything.
+    if (version != unoConfigVersion) {
+      memset(forwardedConfig, 0, sizeof(forwardedConfig));
+      configCheckDue = true;
+    }
+    unoConfigVersion = version;
+    return;
+  }
+
+  unoConfigVersion = version;
+  pendingConfigVersion = -1;
+  memcpy(forwardedConfig, sentConfig, sizeof(forwardedConfig));
+
+  FirebaseJson json;
+  json.set("version", (int)version);
+  json.set("keys", (int)keys);
+  json.set("bytes", configBytesSent);
+  json.set("bridgeToUnoMs", (int)(millis() - configSentMillis));
+  if (configUpdatedAtMs != 0 && clockValid()) {
+    json.set("propagationMs", (int)stageMs(configUpdatedAtMs, linkLineEpochMs));
+  }
+  fbUpdateNodeAsync(PATH_STATUS_CONFIG, json);
+}
+
+// ========================
+// == FIRMWARE UPDATES ====
+// ========================
+void runRequestedUpdate() {
+  if (!updateRequested) return;
+  updateRequested = false;
+  if (!fbGetJSON(PATH_OTA)) return;
+
+  FirebaseJson& json = fbdo.jsonObject();
+  FirebaseJsonData field;
+  String unoVersion, unoUrl, unoSha256, bridgeVersion, deltaUrl, baseMd5, md5, fullUrl, fullMd5;
+  uint32_t unoSize = 0;
+  if (json.get(field, "uno/version")) unoVersion = field.stringValue;
+  if (json.get(field, "uno/url")) unoUrl = field.stringValue;
+  if (json.get(field, "uno/size")) unoSize = field.intValue;
+  if (json.get(field, "uno/sha256")) unoSha256 = field.stringValue;
+  if (json.get(field, "bridge/version")) bridgeVersion = field.stringValue;
+  if (json.get(field, "bridge/deltaUrl")) deltaUrl = field.stringValue;
+  if (json.get(field, "bridge/baseMd5")) baseMd5 = field.stringValue;
+  if (json.get(field, "bridge/md5")) md5 = field.stringValue;
+  if (json.get(field, "bridge/fullUrl")) fullUrl = field.stringValue;
+  if (json.get(field, "bridge/fullMd5")) fullMd5 = field.stringValue;
+
+#ifndef GATEWAY_MODE
+  // Uno first: the bridge update ends in a restart. A gateway can't do it
+  // at all (STK500 needs the point-to-point link and the RESET line), so it
+  // does not report on it either.
+  bool unoCurrent = fbGetString(PATH_STATUS_UNO_FIRMWARE) && fbdo.stringData() == unoVersion;
+  if (unoUrl.length() > 0 && !unoCurrent) {
+    UpdateReport report = {"uno", "stk500", 0, 0, 0, false, nullptr};
+    if (unoSha256.length() != SHA256_HEX_LENGTH || unoSize == 0) {
+      report.error = "no hash";
+    } else {
+      flashUno(unoUrl, unoSize, unoSha256, report);
+    }
+    publishUpdateReport(report);
+    if (report.ok) fbSetString(PATH_STATUS_UNO_FIRMWARE, unoVersion.c_str());
+  }
+#endif
+
+  if (bridgeVersion.length() > 0 && bridgeVersion != FIRMWARE_VERSION) {
+    UpdateReport report = {"bridge", "delta", 0, 0, 0, false, nullptr};
+    if ((deltaUrl.length() > 0 && md5.length() != MD5_HEX_LENGTH) ||
+        (fullUrl.length() > 0 && fullMd5.length() != MD5_HEX_LENGTH)) {
+      report.error = "no hash";
+    } else {
+      if (deltaUrl.length() > 0 && baseMd5 == ESP.getSketchMD5()) {
+        updateBridgeFromDelta(deltaUrl, md5, report);
+      }
+      if (!report.ok && fullUrl.length() > 0) {
+        report.mode = "full";
+        updateBridgeFromImage(fullUrl, fullMd5, report);
+      }
+    }
+    publishUpdateReport(report);
+    if (report.ok) {
+      uploadLogBatch();
+      flushAccess(accessLog);
+      ESP.restart();
+    }
+  }
+}
+
+void publishUpdateReport(const UpdateReport& report) {
+  FirebaseJson json;
+  json.set("target", report.target);
+  json.set("mode", report.mode);
+  json.set("transferBytes", (int)report.transferBytes);
+  json.set("imageBytes", (int)report.imageBytes);
+  json.set("ms", (int)report.ms);
+  json.set("ok", report.ok);
+  if (report.error) json.set("error", report.error);
+  else if (!report.ok) json.set("updateError", (int)Update.getError());
+  fbUpdateNode(PATH_STATUS_OTA, json);
+}
+
+bool readExact(Stream& stream, uint8_t* out, size_t len, unsigned long timeoutMs) {
+  unsigned long start = millis();
+  size_t got = 0;
+  while (got < len) {
+    feedSupervisor();
+    if (stream.available()) {
+      got += stream.readBytes(out + got, len - got);
+      start = millis();
+    } else if (millis() - start > timeoutMs) {
+      return false;
+    } else {
+      yield();
+    }
+  }
+  return true;
+}
+
+bool readVarint(Stream& stream, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 35; shift += 7) {
+    uint8_t b;
+    if (!readExact(stream, &b, 1, OTA_READ_TIMEOUT_MS)) return false;
+    value |= (uint32_t)(b & 0x7F) << shift;
+    if (b < 0x80) return true;
+  }
+  return false;
+}
+
+bool emitDeltaOutput(uint8_t* data, size_t len) {
+  if (Update.write(data, len) != len) return false;
+  for (size_t i = 0; i < len; i++) {
+    deltaWindow[(deltaWritten + i) % DELTA_WINDOW_SIZE] = data[i];
+  }
+  deltaWritten += len;
+  return true;
+}
+
+// Copies part of the image we are running from flash; flashRead needs
+// 4-byte aligned addresses and lengths.
+bool copyFromRunningImage(uint32_t offset, uint32_t len) {
+  while (len > 0) {
+    uint32_t aligned = offset & ~3u;
+    uint32_t skip = offset - aligned;
+    uint32_t chunk = min<uint32_t>(len, sizeof(otaBuffer) - 4);
+    uint32_t readLen = (skip + chunk + 3) & ~3u;
+    if (!ESP.flashRead(aligned, (uint32_t*)otaBuffer, readLen)) return false;
+    if (!emitDeltaOutput(otaBuffer + skip, chunk)) return false;
+    offset += chunk;
+    len -= chunk;
+  }
+  return true;
+}
+
+bool copyFromWindow(uint32_t distance, uint32_t len) {
+  if (distance == 0 || distance > DELTA_WINDOW_SIZE || distance > deltaWritten) return false;
+  while (len > 0) {
+    // One byte at a time keeps overlapping copies (runs) correct
+    uint8_t b = deltaWindow[(deltaWritten - distance) % DELTA_WINDOW_SIZE];
+    if (!emitDeltaOutput(&b, 1)) return false;
+    len--;
+  }
+  return true;
+}
+
+// Header: magic, base image size, target image size (u32 little endian),
+// then opcodes until DELTA_END. `md5` is that of the image it builds.
+bool applyDelta(Stream& stream, const String& md5, UpdateReport& report) {
+  uint32_t header[3];
+  if (!readExact(stream, (uint8_t*)header, sizeof(header), OTA_READ_TIMEOUT_MS)) return false;
+  if (header[0] != DELTA_MAGIC || header[1] != ESP.getSketchSize()) return false;
+  // begin() clears any expected MD5, so it is set after it
+  if (!Update.begin(header[2]) || !Update.setMD5(md5.c_str())) return false;
+  deltaWritten = 0;
+
+  while (true) {
+    uint8_t op;
+    uint32_t a, b;
+    if (!readExact(stream, &op, 1, OTA_READ_TIMEOUT_MS)) return false;
+    if (op == DELTA_END) break;
+    if (op == DELTA_COPY_BASE) {
+      if (!readVarint(stream, a) || !readVarint(stream, b)) return false;
+      if (a + b > header[1] || !copyFromRunningImage(a, b)) return false;
+    } else if (op == DELTA_COPY_BACK) {
+      if (!readVarint(stream, a) || !readVarint(stream, b)) return false;
+      if (!copyFromWindow(a, b)) return false;
+    } else if (op == DELTA_LITERAL) {
+      if (!readVarint(stream, a)) return false;
+      while (a > 0) {
+        uint32_t chunk = min<uint32_t>(a, sizeof(otaBuffer));
+        if (!readExact(stream, otaBuffer, chunk, OTA_READ_TIMEOUT_MS)) return false;
+        if (!emitDeltaOutput(otaBuffer, chunk)) return false;
+        a -= chunk;
+      }
+    } else {
+      return false;
+    }
+  }
+  report.imageBytes = deltaWritten;
+  return deltaWritten == header[2] && Update.end();
+}
+
+void updateBridgeFromDelta(const String& url, const String& md5, UpdateReport& report) {
+  unsigned long start = millis();
+  WiFiClient client;
+  HTTPClient http;
+  if (!http.begin(client, url)) return;
+  if (http.GET() == HTTP_CODE_OK) {
+    report.transferBytes = http.getSize();
+    report.ok = applyDelta(http.getStream(), md5, report);
+    if (!report.ok) Update.end(); // discard the partial image
+  }
+  http.end();
+  report.ms = millis() - start;
+}
+
+// Update.writeStream() would be shorter, but a full image takes long enough
+// over a weak link to trip the supervisor; readExact() feeds it
+bool writeImage(Stream& stream, uint32_t size) {
+  for (uint32_t done = 0; done < size;) {
+    uint32_t chunk = min<uint32_t>(sizeof(otaBuffer), size - done);
+    if (!readExact(stream, otaBuffer, chunk, OTA_READ_TIMEOUT_MS)) return false;
+    if (Update.write(otaBuffer, chunk) != chunk) return false;
+    done += chunk;
+  }
+  return true;
+}
+
+// end() fails, and the old image stays the one that boots, if the file's
+// MD5 is not `md5`
+void updateBridgeFromImage(const String& url, const String& md5, UpdateReport& report) {
+  unsigned long start = millis();
+  WiFiClient client;
+  HTTPClient http;
+  if (!http.begin(client, url)) return;
+  if (http.GET() == HTTP_CODE_OK && http.getSize() > 0) {
+    report.transferBytes = report.imageBytes = http.getSize();
+    report.ok = Update.begin(report.transferBytes) &&
+                Update.setMD5(md5.c_str()) &&
+                writeImage(http.getStream(), report.transferBytes) &&
+                Update.end();
+    if (!report.ok) Update.end(); // discard the partial image
+  }
+  http.end();
+  report.ms = millis() - start;
+}
+
+void resetUno() {
+  pinMode(UNO_RESET_PIN, OUTPUT);
+  digitalWrite(UNO_RESET_PIN, LOW);
+  delay(10);
+  pinMode(UNO_RESET_PIN, INPUT); // release; the Uno's own pull-up ends the reset
+}
+
+// Sends one STK500 command and expects INSYNC, `replyLen` bytes, OK
+bool stkCommand(const uint8_t* cmd, size_t len, uint8_t* reply = nullptr, size_t replyLen = 0) {
+  Serial.write(cmd, len);
+  uint8_t b;
+  if (!readExact(Serial, &b, 1, STK_REPLY_TIMEOUT_MS) || b != STK_INSYNC) return false;
+  if (replyLen > 0 && !readExact(Serial, reply, replyLen, STK_REPLY_TIMEOUT_MS)) return false;
+  return readExact(Serial, &b, 1, STK_REPLY_TIMEOUT_MS) && b == STK_OK;
+}
+
+bool stkSync() {
+  const uint8_t sync[] = {STK_GET_SYNC, STK_CRC_EOP};
+  for (int i = 0; i < STK_SYNC_ATTEMPTS; i++) {
+    while (Serial.available()) Serial.read();
+    if (stkCommand(sync, sizeof(sync))) return true;
+  }
+  return false;
+}
+
+// The image is a raw binary (avr-objcopy -O binary), streamed page by page
+// and read back after each write.
+bool programUno(Stream& image, uint32_t size) {
+  resetUno();
+  delay(50); // Optiboot needs a moment before it listens
+  if (!stkSync()) return false;
+
+  const uint8_t enter[] = {STK_ENTER_PROGMODE, STK_CRC_EOP};
+  if (!stkCommand(enter, sizeof(enter))) return false;
+
+  uint8_t page[UNO_PAGE_SIZE];
+  uint8_t verify[UNO_PAGE_SIZE];
+  bool ok = true;
+  for (uint32_t addr = 0; ok && addr < size; addr += UNO_PAGE_SIZE) {
+    uint32_t chunk = min<uint32_t>(UNO_PAGE_SIZE, size - addr);
+    memset(page, 0xFF, sizeof(page));
+    if (!readExact(image, page, chunk, OTA_READ_TIMEOUT_MS)) { ok = false; break; }
+
+    uint16_t word = addr / 2;
+    const uint8_t load[] = {STK_LOAD_ADDRESS, (uint8_t)(word & 0xFF), (uint8_t)(word >> 8), STK_CRC_EOP};
+    const uint8_t prog[] = {STK_PROG_PAGE, 0, UNO_PAGE_SIZE, 'F'};
+    const uint8_t eop[] = {STK_CRC_EOP};
+    const uint8_t read[] = {STK_READ_PAGE, 0, UNO_PAGE_SIZE, 'F', STK_CRC_EOP};
+
+    ok = stkCommand(load, sizeof(load));
+    if (ok) {
+      Serial.write(prog, sizeof(prog));
+      Serial.write(page, sizeof(page));
+      ok = stkCommand(eop, sizeof(eop));
+    }
+    ok = ok && stkCommand(load, sizeof(load)) &&
+         stkCommand(read, sizeof(read), verify, sizeof(verify)) &&
+         memcmp(page, verify, sizeof(page)) == 0;
+  }
+
+  // Leaving progmode makes Optiboot start the new sketch
+  const uint8_t leave[] = {STK_LEAVE_PROGMODE, STK_CRC_EOP};
+  return stkCommand(leave, sizeof(leave)) && ok;
+}
+
+// Downloads the image into LittleFS, hashing it on the way, and returns
+// true only if it is `size` bytes with SHA-256 `sha256`
+bool stageUnoImage(const String& url, uint32_t size, const String& sha256, UpdateReport& report) {
+  WiFiClient client;
+  HTTPClient http;
+  if (!http.begin(client, url)) return false;
+  int length = http.GET() == HTTP_CODE_OK ? http.getSize() : -1;
+  File file = LittleFS.open(UNO_STAGING_PATH, "w");
+  bool ok = length > 0 && (uint32_t)length == size && file;
+  br_sha256_context hash;
+  br_sha256_init(&hash);
+  Stream& stream = http.getStream();
+  for (uint32_t done = 0; ok && done < size;) {
+    uint32_t chunk = min<uint32_t>(sizeof(otaBuffer), size - done);
+    ok = readExact(stream, otaBuffer, chunk, OTA_READ_TIMEOUT_MS) && file.write(otaBuffer, chunk) == chunk;
+    br_sha256_update(&hash, otaBuffer, chunk);
+    done += chunk;
+  }
+  if (file) file.close();
+  http.end();
+  report.transferBytes = length > 0 ? length : 0;
+  if (!ok) return false;
+
+  uint8_t digest[br_sha256_SIZE];
+  br_sha256_out(&hash, digest);
+  char hex[SHA256_HEX_LENGTH + 1];
+  for (int i = 0; i < br_sha256_SIZE; i++) snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+  if (!sha256.equalsIgnoreCase(hex)) {
+    report.error = "hash mismatch";
+    return false;
+  }
+  return true;
+}
+
+void flashUno(const String& url, uint32_t size, const String& sha256, UpdateReport& report) {
+  unsigned long start = millis();
+  if (!accessReady || size > UNO_APP_MAX_BYTES) {
+    report.error = accessReady ? "too large" : "no filesystem";
+    return;
+  }
+  // Nothing reaches the Uno until the whole image has checked out
+  if (stageUnoImage(url, size, sha256, report)) {
+    File image = LittleFS.open(UNO_STAGING_PATH, "r");
+    report.imageBytes = size;
+    report.ok = image && programUno(image, size);
+    if (image) image.close();
+    linkLineLength = 0; // drop anything half-read from before the reset
+  }
+  LittleFS.remove(UNO_STAGING_PATH);
+  report.ms = millis() - start;
+}
+
+// ========================
+// == RECOVERY ============
+// ========================
+void startSupervisor() {
+  lastLoopProgress = millis();
+  supervisor.attach_ms(1000, checkLoopProgress);
+}
+
+void feedSupervisor() {
+  lastLoopProgress = millis();
+}
+
+// Runs from the SDK timer, which keeps firing while loop() is stuck in a
+// call that yields. That is no place for WiFi calls, so it only bumps the
+// reset count in the copy loop() last saved and writes it to RTC memory;
+// if loop() was halfway through saving, RTC memory keeps the previous one.
+void checkLoopProgress() {
+  if (millis() - lastLoopProgress < stallLimitMs) return;
+  if (!checkpointBusy) {
+    checkpoint.supervisorResets++;
+    writeCheckpoint();
+  }
+  ESP.reset();
+}
+
+uint32_t checkpointCrc() {
+  const uint8_t* bytes = (const uint8_t*)&checkpoint + offsetof(BridgeCheckpoint, bootCount);
+  size_t len = sizeof(checkpoint) - offsetof(BridgeCheckpoint, bootCount);
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < len; i++) {
+    crc ^= bytes[i];
+    for (int b = 0; b < 8; b++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+  }
+  return ~crc;
+}
+
+void restoreCheckpoint() {
+  bool coldBoot = ESP.getResetInfoPtr()->reason == REASON_DEFAULT_RST;
+  bool valid = !coldBoot &&
+               ESP.rtcUserMemoryRead(0, (uint32_t*)&checkpoint, sizeof(checkpoint)) &&
+               checkpoint.magic == CHECKPOINT_MAGIC && checkpoint.crc == checkpointCrc();
+  if (!valid) {
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.magic = CHECKPOINT_MAGIC;
+    checkpoint.isLocked = SHADOW_UNKNOWN;
+  } else {
+    checkpointRestored = true;
+    // Only `reported`: `synced` stays unknown so the first flush confirms it
+    reported.isLocked = checkpoint.isLocked;
+    strncpy(lastDrainedKey, checkpoint.lastDrainedKey, PUSH_KEY_LENGTH);
+  }
+  checkpoint.bootCount++;
+  saveCheckpoint();
+}
+
+void saveCheckpoint() {
+  checkpointBusy = true;
+  checkpoint.isLocked = reported.isLocked;
+  strncpy(checkpoint.lastDrainedKey, lastDrainedKey, sizeof(checkpoint.lastDrainedKey));
+  if (WiFi.status() == WL_CONNECTED) {
+    checkpoint.channel = WiFi.channel();
+    memcpy(checkpoint.bssid, WiFi.BSSID(), sizeof(checkpoint.bssid));
+  }
+  writeCheckpoint();
+  checkpointBusy = false;
+}
+
+void writeCheckpoint() {
+  checkpoint.crc = checkpointCrc();
+  ESP.rtcUserMemoryWrite(0, (uint32_t*)&checkpoint, sizeof(checkpoint));
+}
+
+// Credentials are the ones WiFiManager left in the SDK config
+bool resumeWiFi() {
+  if (!checkpointRestored || checkpoint.channel == 0 || WiFi.SSID().length() == 0) return false;
+  WiFi.mode(WIFI_STA);
+  WiFi.begin(WiFi.SSID().c_str(), WiFi.psk().c_str(), checkpoint.channel, checkpoint.bssid);
+  unsigned long start = millis();
+  while (WiFi.status() != WL_CONNECTED) {
+    if (millis() - start > FAST_CONNECT_TIMEOUT_MS) return false;
+    delay(50);
+  }
+  return true;
+}
+
+// Boot-to-ready is measured from reset to here: WiFi, SNTP and the first
+// Firebase round trip
+void reportBoot() {
+  uint32_t reason = ESP.getResetInfoPtr()->reason;
+  if (reason != REASON_DEFAULT_RST) logEvent(LOG_WARN, LOG_RESET, reason);
+
+  FirebaseJson json;
+  json.set("reason", ESP.getResetReason());
+  json.set("readyMs", (int)millis());
+  json.set("restored", checkpointRestored);
+  json.set("bootCount", (int)checkpoint.bootCount);
+  json.set("supervisorResets", (int)checkpoint.supervisorResets);
+  json.set("firmware", FIRMWARE_VERSION);
+  fbUpdateNode(PATH_STATUS_BOOT, json);
+}
+
+// @BOOT,<cause>,<ready ms>,<restored>
+void handleUnoBootEvent(long cause, long readyMs, bool restored) {
+  if (lowBattery) sendControllerLine("PWR 1"); // it boots into normal power mode
+  controllerClockDue = true;
+  static const char* const CAUSES[] = {"power_on", "external", "watchdog", "brown_out"};
+  FirebaseJson json;
+  json.set("reason", cause >= 0 && cause < 4 ? CAUSES[cause] : "unknown");
+  json.set("readyMs", (int)readyMs);
+  json.set("restored", restored);
+  json.set("at/.sv", "timestamp");
+  fbUpdateNodeAsync(PATH_STATUS_UNO_BOOT, json);
+}
+
+// ========================
+// == ACCESS HISTORY ======
+// ========================
+void initializeAccessLog() {
+  accessReady = LittleFS.begin(); // formats a blank or corrupt filesystem
+  if (!accessReady) return;
+  LittleFS.mkdir(accessLog.dir);
+  loadAccessShards(accessLog);
+}
+
+void accessShardPath(const AccessLog& log, uint16_t day, char* path) {
+  snprintf(path, ACCESS_PATH_LENGTH, "%s/%u", log.dir, day);
+}
+
+void loadAccessShards(AccessLog& log) {
+  log.shardCount = 0;
+  Dir dir = LittleFS.openDir(log.dir);
+  while (dir.next()) {
+    AccessShard shard = {(uint16_t)dir.fileName().toInt(), (uint16_t)min((size_t)0xFFFF, dir.fileSize() / sizeof(AccessRecord))};
+    if (shard.day == 0) continue;
+    if (log.shardCount == ACCESS_MAX_SHARDS) {
+      // Leave the oldest out; pruneAccessShards() deletes it on the next new day
+      if (shard.day < log.shards[0].day) continue;
+      memmove(log.shards, log.shards + 1, --log.shardCount * sizeof(AccessShard));
+    }
+    int i = log.shardCount++;
+    for (; i > 0 && log.shards[i - 1].day > shard.day; i--) log.shards[i] = log.shards[i - 1];
+    log.shards[i] = shard;
+  }
+}
+
+void pruneAccessShards(AccessLog& log) {
+  FSInfo info;
+  while (log.shardCount > 1) {
+    bool full = LittleFS.info(info) && info.usedBytes * 4 > info.totalBytes * 3;
+    if (log.shardCount < ACCESS_MAX_SHARDS && !full) break;
+    char path[ACCESS_PATH_LENGTH];
+    accessShardPath(log, log.shards[0].day, path);
+    LittleFS.remove(path);
+    memmove(log.shards, log.shards + 1, --log.shardCount * sizeof(AccessShard));
+  }
+}
+
+// Appends to the newest shard, starting a new one on a new day. A record
+// dated before the newest shard (the clock stepped back) still goes there,
+// so every shard stays in order for the binary search.
+bool appendAccess(AccessLog& log, const AccessRecord& record) {
+  uint16_t day = record.epoch / SECONDS_PER_DAY;
+  AccessShard* newest = log.shardCount ? &log.shards[log.shardCount - 1] : nullptr;
+  if (!newest || day > newest->day) {
+    pruneAccessShards(log);
+    log.shards[log.shardCount++] = {day, 0};
+    newest = &log.shards[log.shardCount - 1];
+  }
+  if (newest->count == 0xFFFF) return false;
+
+  if (!log.file || log.fileDay != newest->day) {
+    if (log.file) log.file.close(); // close() syncs
+    log.unflushed = 0;
+    char path[ACCESS_PATH_LENGTH];
+    accessShardPath(log, newest->day, path);
+    log.file = LittleFS.open(path, "a");
+    log.fileDay = newest->day;
+    if (!log.file) return false;
+  }
+  if (log.file.write((const uint8_t*)&record, sizeof(record)) != sizeof(record)) return false;
+  if (log.unflushed++ == 0) log.unflushedSinceMs = millis();
+  if (log.unflushed >= ACCESS_FLUSH_RECORDS) flushAccess(log);
+  newest->count++;
+  return true;
+}
+
+void flushAccess(AccessLog& log) {
+  if (!log.file || log.unflushed == 0) return;
+  log.file.flush();
+  log.unflushed = 0;
+  log.flushes++;
+}
+
+// Records that trickle in are synced ACCESS_FLUSH_MS after the first of them
+void checkAccessFlush() {
+  if (accessLog.unflushed > 0 && millis() - accessLog.unflushedSinceMs >= ACCESS_FLUSH_MS) {
+    flushAccess(accessLog);
+  }
+}
+
+void recordAccess(uint8_t type, uint8_t door, uint16_t arg) {
+  if (!accessReady) return;
+  if (!clockValid()) {
+    accessDropped++;
+    return;
+  }
+  AccessRecord record = {(uint32_t)(epochMillis() / 1000), type, door, arg};
+  unsigned long start = micros();
+  if (!appendAccess(accessLog, record)) {
+    accessDropped++;
+    return;
+  }
+  unsigned long us = micros() - start;
+  accessAppends++;
+  accessAppendTotalUs += us;
+  if (us > accessAppendMaxUs) accessAppendMaxUs = us;
+}
+
+void recordControllerAccess(uint8_t door, const char* event, const long* fields, int count) {
+  if (count < 1) return;
+  if (strcmp(event, "PIN") == 0) {
+    recordAccess(fields[0] ? ACCESS_PIN_OK : ACCESS_PIN_BAD, door, 0);
+  } else if (strcmp(event, "CARD") == 0 && count >= 2 && (fields[0] == 0 || fields[0] == 1)) {
+    recordAccess(fields[0] == 0 ? ACCESS_CARD_OK : ACCESS_CARD_DENIED, door, fields[1]);
+  } else if (strcmp(event, "DOOR") == 0 && count >= 2 && fields[1]) {
+    recordAccess(ACCESS_FORCED, door, 0);
+  } else if (strcmp(event, "SIG") == 0 && fields[0] == 0b010) {
+    recordAccess(ACCESS_TAMPER, door, 0);
+  }
+}
+
+bool readAccessRecord(File& file, uint32_t index, AccessRecord& record) {
+  return file.seek(index * sizeof(AccessRecord), SeekSet) &&
+         file.read((uint8_t*)&record, sizeof(record)) == sizeof(record);
+}
+
+// Index of the first record at or after `epoch`
+uint32_t findAccessRecord(File& file, uint32_t count, uint32_t epoch) {
+  uint32_t low = 0, high = count;
+  AccessRecord record;
+  while (low < high) {
+    uint32_t mid = (low + high) / 2;
+    if (readAccessRecord(file, mid, record) && record.epoch < epoch) low = mid + 1;
+    else high = mid;
+  }
+  return low;
+}
+
+// Appends up to `limit` matching records to `items` and returns how many;
+// `next` is the cursor to pass for the page after, or 0 at the end
+int queryAccess(AccessLog& log, const HistoryQuery& query, String& items, uint32_t& next) {
+  uint16_t startDay = query.cursor ? query.cursor >> 16 : query.from / SECONDS_PER_DAY;
+  uint16_t endDay = query.to / SECONDS_PER_DAY;
+  flushAccess(log);
+  next = 0;
+  int n = 0;
+  char item[32];
+
+  for (int s = 0; s < log.shardCount; s++) {
+    const AccessShard& shard = log.shards[s];
+    if (shard.day < startDay) continue;
+    if (shard.day > endDay) break;
+    char path[ACCESS_PATH_LENGTH];
+    accessShardPath(log, shard.day, path);
+    File file = LittleFS.open(path, "r");
+    if (!file) continue;
+
+    uint32_t index = query.cursor && shard.day == startDay ? query.cursor & 0xFFFF
+                                                          : findAccessRecord(file, shard.count, query.from);
+    AccessRecord record;
+    bool seeked = false;
+    for (; index < shard.count; index++) {
+      // One seek, then sequential reads
+      if (!seeked) {
+        if (!file.seek(index * sizeof(AccessRecord), SeekSet)) break;
+        seeked = true;
+      }
+      if (file.read((uint8_t*)&record, sizeof(record)) != sizeof(record)) break;
+      if (record.epoch > query.to) {
+        file.close();
+        return n;
+      }
+      if (record.epoch < query.from || (query.door && record.door != query.door)) continue;
+      if (n == query.limit) {
+        next = (uint32_t)shard.day << 16 | index;
+        file.close();
+        return n;
+      }
+      snprintf(item, sizeof(item), "%s%lu,%s,%u,%u", n ? ";" : "", (unsigned long)record.epoch,
+               record.type < ACCESS_TYPE_COUNT ? ACCESS_TYPE_NAMES[record.type] : "unknown",
+               record.door, record.arg);
+      items += item;
+      n++;
+    }
+    file.close();
+  }
+  return n;
+}
+
+bool queueHistoryQuery(FirebaseJson& json, const String& base, const char* id) {
+  if (historyQuery.pending || !accessReady) return false;
+  FirebaseJsonData field;
+  uint32_t now = clockValid() ? epochMillis() / 1000 : 0;
+
+  json.get(field, base + "from");
+  historyQuery.from = field.success ? (uint32_t)field.doubleValue : 0;
+  json.get(field, base + "to");
+  historyQuery.to = field.success ? (uint32_t)field.doubleValue : (now ? now : 0xFFFFFFFF);
+  json.get(field, base + "cursor");
+  historyQuery.cursor = field.success ? (uint32_t)field.doubleValue : 0;
+  json.get(field, base + "limit");
+  historyQuery.limit = field.success ? constrain(field.intValue, 1, ACCESS_PAGE_MAX) : ACCESS_PAGE_MAX;
+  json.get(field, base + "door");
+  historyQuery.door = field.success && isDoorAddress(field.intValue) ? field.intValue : 0;
+  strcpy(historyQuery.id, id);
+  historyQuery.pending = true;
+  return true;
+}
+
+void runHistoryRequests() {
+  if (historyQuery.pending) {
+    historyQuery.pending = false;
+    String items;
+    items.reserve(historyQuery.limit * 24);
+    uint32_t next;
+    unsigned long start = millis();
+    int count = queryAccess(accessLog, historyQuery, items, next);
+    unsigned long queryMs = millis() - start;
+
+    FirebaseJson json;
+    json.set("items", items);
+    json.set("count", count);
+    json.set("next", (double)next);
+    json.set("queryMs", (int)queryMs);
+    char path[sizeof(PATH_HISTORY) + COMMAND_ID_LENGTH + 1];
+    snprintf(path, sizeof(path), "%s/%s", PATH_HISTORY, historyQuery.id);
+    fbSetJSON(path, json);
+    publishHistoryStats();
+  }
+  if (historyBenchRequested) {
+    historyBenchRequested = false;
+    startHistoryBench();
+  }
+}
+
+void publishHistoryStats() {
+  FSInfo info;
+  uint32_t records = 0;
+  for (int i = 0; i < accessLog.shardCount; i++) records += accessLog.shards[i].count;
+
+  FirebaseJson json;
+  json.set("records", (int)records);
+  json.set("shards", accessLog.shardCount);
+  json.set("appendAvgUs", (int)(accessAppends ? accessAppendTotalUs / accessAppends : 0));
+  json.set("appendMaxUs", (int)accessAppendMaxUs);
+  json.set("dropped", (int)accessDropped);
+  json.set("flushes", (int)accessLog.flushes);
+  if (LittleFS.info(info)) {
+    json.set("fsUsed", (int)info.usedBytes);
+    json.set("fsTotal", (int)info.totalBytes);
+  }
+  fbUpdateNodeAsync(PATH_STATUS_HISTORY, json);
+}
+
+// Appends ACCESS_BENCH_RECORDS records spread over ACCESS_BENCH_DAYS in a
+// scratch directory, pages through random one-day windows, then deletes it.
+// stepHistoryBench() does it a slice at a time from the idle loop.
+void startHistoryBench() {
+  if (!accessReady || !clockValid() || historyBench.log) return;
+  historyBench = {new AccessLog{"/accessbench", {}, 0, File(), 0, 0, 0, 0}, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+  LittleFS.mkdir(historyBench.log->dir);
+  FSInfo info;
+  if (LittleFS.info(info)) historyBench.usedBefore = info.usedBytes;
+  historyBench.first = epochMillis() / 1000 - ACCESS_BENCH_DAYS * SECONDS_PER_DAY;
+}
+
+void stepHistoryBench() {
+  HistoryBench& bench = historyBench;
+  if (!bench.log) return;
+  const uint32_t span = ACCESS_BENCH_DAYS * SECONDS_PER_DAY;
+  unsigned long sliceStart = millis();
+  while (millis() - sliceStart < ACCESS_BENCH_SLICE_MS) {
+    if (bench.step < ACCESS_BENCH_RECORDS) {
+      uint32_t i = bench.step++;
+      AccessRecord record = {bench.first + i * (span / ACCESS_BENCH_RECORDS), (uint8_t)(i % ACCESS_TYPE_COUNT), 1, (uint16_t)i};
+      unsigned long start = micros();
+      if (appendAccess(*bench.log, record)) bench.appended++;
+      unsigned long us = micros() - start;
+      bench.appendTotalUs += us;
+      if (us > bench.appendMaxUs) bench.appendMaxUs = us;
+      if (bench.step == ACCESS_BENCH_RECORDS) {
+        if (bench.log->file) bench.log->file.close();
+        FSInfo info;
+        if (LittleFS.info(info)) bench.usedAfter = info.usedBytes;
+      }
+    } else if (bench.step < ACCESS_BENCH_RECORDS + ACCESS_BENCH_QUERIES) {
+      bench.step++;
+      HistoryQuery query = {false, "", 0, 0, 0, ACCESS_PAGE_MAX, 0};
+      query.from = bench.first + random(span - SECONDS_PER_DAY);
+      query.to = query.from + SECONDS_PER_DAY;
+      String items;
+      items.reserve(ACCESS_PAGE_MAX * 24);
+      uint32_t next;
+      unsigned long start = millis();
+      queryAccess(*bench.log, query, items, next);
+      unsigned long ms = millis() - start;
+      bench.queryTotalMs += ms;
+      if (ms > bench.queryMaxMs) bench.queryMaxMs = ms;
+    } else {
+      finishHistoryBench();
+      return;
+    }
+  }
+}
+
+void finishHistoryBench() {
+  HistoryBench& bench = historyBench;
+  for (int i = 0; i < bench.log->shardCount; i++) {
+    char path[ACCESS_PATH_LENGTH];
+    accessShardPath(*bench.log, bench.log->shards[i].day, path);
+    LittleFS.remove(path);
+  }
+  LittleFS.rmdir(bench.log->dir);
+  unsigned long flushes = bench.log->flushes;
+  delete bench.log;
+  bench.log = nullptr;
+
+  FirebaseJson json;
+  json.set("records", (int)bench.appended);
+  json.set("appendAvgUs", (int)(bench.appendTotalUs / ACCESS_BENCH_RECORDS));
+  json.set("appendMaxUs", (int)bench.appendMaxUs);
+  json.set("flushes", (int)flushes);
+  json.set("fsBytes", (int)(bench.usedAfter - bench.usedBefore)); // per ACCESS_BENCH_RECORDS
+  json.set("recordBytes", (int)(bench.appended * sizeof(AccessRecord)));
+  json.set("pageSize", ACCESS_PAGE_MAX);
+  json.set("queryAvgMs", (int)(bench.queryTotalMs / ACCESS_BENCH_QUERIES));
+  json.set("queryMaxMs", (int)bench.queryMaxMs);
+  json.set("at/.sv", "timestamp");
+  fbSetJSONAsync(PATH_STATUS_HISTORY_BENCH, json);
+}
+
+// ========================
+// == POWER MONITOR =======
+// ========================
+// Reads the channel selected on the previous call, so the switch has had a
+// full sample period to settle
+void samplePower() {
+  unsigned long now = millis();
+  if (now - lastPowerSampleTime < POWER_SAMPLE_MS) return;
+  lastPowerSampleTime = now;
+
+  int channel = powerMuxPanel ? 1 : 0;
+  powerSampleSum[channel] += analogRead(A0);
+  powerSampleCount[channel]++;
+  powerMuxPanel = !powerMuxPanel;
+  digitalWrite(POWER_MUX_PIN, powerMuxPanel ? HIGH : LOW);
+
+  if (powerSampleCount[0] < POWER_POINT_SAMPLES || powerSampleCount[1] < POWER_POINT_SAMPLES) return;
+  uint16_t batteryMv = powerSampleSum[0] * BATTERY_FULL_SCALE_MV / 1023 / powerSampleCount[0];
+  uint16_t panelMv = powerSampleSum[1] * PANEL_FULL_SCALE_MV / 1023 / powerSampleCount[1];
+  powerSampleSum[0] = powerSampleSum[1] = 0;
+  powerSampleCount[0] = powerSampleCount[1] = 0;
+
+  if (powerPointCount == 0) powerBatchEpoch = clockValid() ? time(nullptr) : 0;
+  if (powerPointCount < POWER_BATCH_POINTS) {
+    batteryPoints[powerPointCount] = batteryMv;
+    panelPoints[powerPointCount] = panelMv;
+    powerPointCount++;
+  }
+  stateOfCharge = socFromMillivolts(batteryMv);
+  applyPowerPolicy();
+}
+
+int socFromMillivolts(uint16_t mv) {
+  const int n = sizeof(SOC_CURVE_MV) / sizeof(SOC_CURVE_MV[0]);
+  if (mv <= SOC_CURVE_MV[0]) return 0;
+  for (int i = 1; i < n; i++) {
+    if (mv <= SOC_CURVE_MV[i]) {
+      return SOC_CURVE_PCT[i - 1] + (int)(mv - SOC_CURVE_MV[i - 1]) *
+             (SOC_CURVE_PCT[i] - SOC_CURVE_PCT[i - 1]) / (SOC_CURVE_MV[i] - SOC_CURVE_MV[i - 1]);
+    }
+  }
+  return 100;
+}
+
+// Low power: poll every 5 s instead of 1 s, 15 min heartbeats, no link or
+// heap reports, and the Uno turns off its backlight
+void applyPowerPolicy() {
+  bool low = lowBattery ? stateOfCharge < LOW_SOC_EXIT : stateOfCharge < LOW_SOC_ENTER;
+  if (low == lowBattery) return;
+  lowBattery = low;
+  pollIntervalMs = low ? LOW_POWER_POLL_INTERVAL_MS : POLL_INTERVAL_MS;
+  sendControllerLine(low ? "PWR 1" : "PWR 0");
+
+  FirebaseJson json;
+  json.set("lowPower", low);
+  json.set("soc", stateOfCharge);
+  json.set("changedAt/.sv", "timestamp");
+  fbUpdateNodeAsync(PATH_STATUS_POWER, json);
+  sendHeartbeat(); // advertise the new staleness window right away
+}
+
+// {t: epoch of the first point, stepS, battery: "mV,...", panel: "mV,...", soc}
+void uploadPowerBatch() {
+  if (powerPointCount < POWER_BATCH_POINTS) return;
+
+  String battery, panel;
+  for (int i = 0; i < powerPointCount; i++) {
+    if (i > 0) {
+      battery += ',';
+      panel += ',';
+    }
+    battery += batteryPoints[i];
+    panel += panelPoints[i];
+  }
+
+  FirebaseJson json;
+  json.set("t", (int)powerBatchEpoch);
+  json.set("stepS", (int)(POWER_SAMPLE_MS * 2 * POWER_POINT_SAMPLES / 1000));
+  json.set("battery", battery);
+  json.set("panel", panel);
+  json.set("soc", stateOfCharge);
+  // Keep the points if the push fails; sampling stops adding until it works
+  if (fbPushJSON(PATH_TELEMETRY, json)) powerPointCount = 0;
+}
+
+// ========================
+// == HEARTBEAT ===========
+// ========================
+void noteActivity() {
+  lastActivityTime = millis();
+}
+
+unsigned long currentHeartbeatInterval() {
+  if (lowBattery) return HEARTBEAT_LOW_BATTERY_S;
+  unsigned long quiet = millis() - lastActivityTime;
+  if (quiet < ACTIVE_WINDOW_MS) return HEARTBEAT_ACTIVE_S;
+  if (quiet < IDLE_AFTER_MS) return HEARTBEAT_NORMAL_S;
+  return HEARTBEAT_IDLE_S;
+}
+
+void checkHeartbeat() {
+  // Use the shorter of the advertised and current interval so the staleness
+  // window we last published is never overrun when activity picks up
+  unsigned long interval = heartbeatIntervalS == 0
+      ? HEARTBEAT_ACTIVE_S
+      : min(currentHeartbeatInterval(), heartbeatIntervalS);
+  if (millis() - lastHeartbeatTime < interval * 1000) return;
+  sendHeartbeat();
+}
+
+void sendHeartbeat() {
+  unsigned long interval = currentHeartbeatInterval();
+  lastHeartbeatTime = millis();
+
+  FirebaseJson json;
+  json.set("isOnline", true);
+  json.set("lastSeen/.sv", "timestamp");
+  json.set("heartbeatIntervalS", (int)interval);
+  json.set("staleAfterMs", (int)(interval * 100 * HEARTBEAT_STALE_FACTOR_X10));
+
+  String body;
+  json.toString(body);
+  if (!fbUpdateNode(PATH_STATUS, json)) {
+    logEvent(LOG_ERROR, LOG_SET_ONLINE_FAILED, fbdo.httpCode());
+    return;
+  }
+  heartbeatIntervalS = interval;
+  heartbeats++;
+  heartbeatBytes += body.length() + HTTP_OVERHEAD_BYTES;
+  heartbeatRadioMs += linkStats.lastMs;
+}
+
+// ========================
+// == DEVICE SHADOW =======
+// ========================
+bool fieldChanged(const char* current, const char* last) {
+  return last == nullptr || strcmp(current, last) != 0;
+}
+
+// Writes only the reported fields that differ from what Firebase holds, in
+// one PATCH, and bumps the reported version when anything changed.
+void flushShadow() {
+  FirebaseJson json;
+  bool changed = false;
+
+  if (reported.isLocked != SHADOW_UNKNOWN && reported.isLocked != synced.isLocked) {
+    json.set("isLocked", reported.isLocked == 1);
+    changed = true;
+  }
+  if (fieldChanged(reported.alert, synced.alert)) {
+    json.set("alert", reported.alert);
+    changed = true;
+  }
+  if (fieldChanged(reported.mode, synced.mode)) {
+    json.set("mode", reported.mode);
+    changed = true;
+  }
+  if (reported.desiredVersion != synced.desiredVersion) {
+    json.set("desiredVersion", (int)reported.desiredVersion);
+    changed = true;
+  }
+
+  if (!changed) {
+    suppressedWrites++;
+    return;
+  }
+
+  json.set("version", (int)(reportedVersion + 1));
+  json.set("suppressedWrites", (int)suppressedWrites);
+  if (fbUpdateNode(PATH_STATUS, json)) {
+    reportedVersion++;
+    synced = reported;
+  } else {
+    logEvent(LOG_ERROR, LOG_SHADOW_SYNC_FAILED, fbdo.httpCode());
+  }
+}
+
+// Converges the lock on /desired after boot, after WiFi comes back, and
+// periodically in between. Only a newer desired version is acted on, so
+// intent that was already applied is never replayed.
+void syncDesiredState() {
+  bool connected = WiFi.status() == WL_CONNECTED;
+  bool reconnected = connected && !wasWiFiConnected;
+  wasWiFiConnected = connected;
+  if (!connected) return;
+
+  unsigned long now = millis();
+  if (!reconnected && now - lastDesiredSyncTime < DESIRED_SYNC_INTERVAL) return;
+  lastDesiredSyncTime = now;
+
+  if (!fbGetJSON(PATH_DESIRED)) return;
+
+  FirebaseJson& json = fbdo.jsonObject();
+  FirebaseJsonData field;
+  json.get(field, "version");
+  if (!field.success || field.intValue <= reported.desiredVersion) return;
+  long version = field.intValue;
+  json.get(field, "isLocked");
+  if (!field.success) return;
+  bool wantLocked = field.boolValue;
+
+  // With the lock state still unknown, send anyway; the Uno ignores a
+  // command that matches its current state
+  if (reported.isLocked == SHADOW_UNKNOWN || (reported.isLocked == 1) != wantLocked) {
+    if (!sendLockCommand(1, wantLocked ? 'L' : 'U')) return;
+    recordAccess(wantLocked ? ACCESS_REMOTE_LOCK : ACCESS_REMOTE_UNLOCK, 1, 0);
+  }
+  reported.desiredVersion = version;
+  flushShadow();
+}
+
+
+// ========================
+// == TIMED REQUESTS ======
+// ========================
+// Every Firebase call goes through these wrappers so we can tell requests that
+// reused the warm connection apart from those that paid for a TLS handshake.
+void beginTimedRequest() {
+  requestWasConnected = fbdo.httpConnected();
+  requestStartMs = millis();
+}
+
+bool endTimedRequest(bool ok) {
+  unsigned long elapsed = millis() - requestStartMs;
+  linkStats.requests++;
+  linkStats.lastMs = elapsed;
+  linkStats.lastCold = !requestWasConnected;
+  if (requestWasConnected) {
+    linkStats.warmTotalMs += elapsed;
+  } else {
+    linkStats.handshakes++;
+    linkStats.coldTotalMs += elapsed;
+  }
+  return ok;
+}
+
+bool fbGetString(const char* path) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.getString(fbdo, path));
+}
+
+bool fbGetInt(const char* path) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.getInt(fbdo, path));
+}
+
+bool fbGetJSON(const char* path) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.getJSON(fbdo, path));
+}
+
+bool fbGetJSON(const char* path, QueryFilter& query) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.getJSON(fbdo, path, query));
+}
+
+bool fbPushJSON(const char* path, FirebaseJson& json) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.pushJSON(fbdo, path, json));
+}
+
+bool fbSetJSON(const char* path, FirebaseJson& json) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.setJSON(fbdo, path, json));
+}
+
+bool fbSetInt(const char* path, int value) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.setInt(fbdo, path, value));
+}
+
+bool fbSetString(const char* path, const char* value) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.setString(fbdo, path, value));
+}
+
+bool fbUpdateNode(const char* path, FirebaseJson& json) {
+  beginTimedRequest();
+  return endTimedRequest(Firebase.updateNodeSilent(fbdo, path, json));
+}
+
+void publishLinkStats() {
+  if (lowBattery) return; // diagnostics only
+  unsigned long now = millis();
+  if (now - lastLinkReportTime < LINK_REPORT_INTERVAL) return;
+  lastLinkReportTime = now;
+
+  unsigned long warm = linkStats.requests - linkStats.handshakes;
+  unsigned long coldAvg = linkStats.handshakes ? linkStats.coldTotalMs / linkStats.handshakes : 0;
+  unsigned long warmAvg = warm ? linkStats.warmTotalMs / warm : 0;
+
+  FirebaseJson json;
+  json.set("requests", (int)linkStats.requests);
+  json.set("handshakes", (int)linkStats.handshakes);
+  json.set("coldAvgMs", (int)coldAvg);
+  json.set("warmAvgMs", (int)warmAvg);
+  json.set("handshakeMs", (int)(coldAvg > warmAvg ? coldAvg - warmAvg : 0));
+  json.set("lastMs", (int)linkStats.lastMs);
+  json.set("lastCold", linkStats.lastCold);
+  // Heartbeat cost so far; divide by beats and scale by 86400 / interval to
+  // compare the daily bytes and radio-on time of each profile
+  json.set("heartbeats", (int)heartbeats);
+  json.set("heartbeatBytes", (int)heartbeatBytes);
+  json.set("heartbeatRadioMs", (int)heartbeatRadioMs);
+  // The async connection, and the loop's longest stall since the last report
+  unsigned long asyncCompleted = asyncStats.completed;
+  json.set("async/completed", (int)asyncCompleted);
+  json.set("async/perMinute", (int)((asyncCompleted - asyncCompletedAtReport) * 60000 / LINK_REPORT_INTERVAL));
+  json.set("async/failed", (int)asyncStats.failed);
+  json.set("async/blocking", (int)asyncStats.blocking);
+  json.set("async/retries", (int)asyncStats.retries);
+  json.set("async/handshakes", (int)asyncStats.handshakes);
+  json.set("async/avgMs", (int)(asyncCompleted ? asyncStats.totalMs / asyncCompleted : 0));
+  json.set("async/maxMs", (int)asyncStats.maxMs);
+  json.set("async/maxInFlight", asyncStats.maxInFlight);
+  json.set("async/depth", asyncDepth);
+  json.set("async/maxLoopGapMs", (int)asyncStats.maxPumpGapMs);
+  asyncCompletedAtReport = asyncCompleted;
+  asyncStats.maxPumpGapMs = 0;
+  fbUpdateNode(PATH_STATUS_LINK, json);
+}
+
+void publishHeapReport() {
+  uint32_t freeHeap = ESP.getFreeHeap();
+  if (freeHeap < minFreeHeap) minFreeHeap = freeHeap;
+  if (lowBattery) return; // diagnostics only
+
+  unsigned long now = millis();
+  if (now - lastHeapReportTime < HEAP_REPORT_INTERVAL) return;
+  lastHeapReportTime = now;
+
+  FirebaseJson json;
+  json.set("free", (int)freeHeap);
+  json.set("minFree", (int)minFreeHeap);
+  json.set("maxBlock", (int)ESP.getMaxFreeBlockSize());
+  json.set("fragmentation", (int)ESP.getHeapFragmentation());
+  json.set("maxFragment", maxFragmentNegotiated);
+  json.set("build", FIRMWARE_BUILD);
+  fbUpdateNodeAsync(PATH_STATUS_HEAP, json);
+}
+
+// ========================
+// == ASYNC REQUESTS ======
+// ========================
+void initializeAsyncClient() {
+  uint16_t rx = maxFragmentNegotiated ? BSSL_SMALL_BUFFER : BSSL_RX_FALLBACK;
+  asyncClient.setBufferSizes(rx, BSSL_SMALL_BUFFER);
+  asyncClient.setInsecure(); // as fbdo, which is given no certificate either
+  asyncClient.setSession(&asyncSession);
+}
+
+bool asyncRequest(const char* method, const char* path, const char* body, AsyncDone done) {
+  if (asyncCount == ASYNC_QUEUE_SIZE) return false;
+  if (strlen(path) >= ASYNC_PATH_LENGTH || strchr(path, ' ') || strlen(body) >= ASYNC_BODY_LENGTH) return false;
+  AsyncRequest& req = asyncRing[(asyncHead + asyncCount) % ASYNC_QUEUE_SIZE];
+  req.method = method;
+  strcpy(req.path, path);
+  strcpy(req.body, body);
+  req.done = done;
+  req.attempts = 0;
+  req.queuedMs = millis();
+  asyncCount++;
+  return true;
+}
+
+bool fbGetAsync(const char* path, AsyncDone done) {
+  return asyncRequest("GET", path, "", done);
+}
+
+void fbUpdateNodeAsync(const char* path, FirebaseJson& json) {
+  String body;
+  json.toString(body);
+  if (asyncRequest("PATCH", path, body.c_str(), nullptr)) return;
+  asyncStats.blocking++;
+  fbUpdateNode(path, json);
+}
+
+void fbSetJSONAsync(const char* path, FirebaseJson& json) {
+  String body;
+  json.toString(body);
+  if (asyncRequest("PUT", path, body.c_str(), nullptr)) return;
+  asyncStats.blocking++;
+  fbSetJSON(path, json);
+}
+
+void fbSetIntAsync(const char* path, int value) {
+  char body[12];
+  snprintf(body, sizeof(body), "%d", value);
+  if (asyncRequest("PUT", path, body, nullptr)) return;
+  asyncStats.blocking++;
+  fbSetInt(path, value);
+}
+
+// Called from every idle tick and once per loop
+void pumpAsyncRequests() {
+  unsigned long now = millis();
+  if (lastAsyncPumpMs != 0 && now - lastAsyncPumpMs > asyncStats.maxPumpGapMs) {
+    asyncStats.maxPumpGapMs = now - lastAsyncPumpMs;
+  }
+  lastAsyncPumpMs = now;
+  if (asyncPumping || asyncCount == 0) return;
+  asyncPumping = true; // a callback may end up in idleFor()
+
+  if (!asyncClient.connected()) {
+    if (asyncSent > 0) dropAsyncConnection();
+    if (WiFi.status() == WL_CONNECTED &&
+        (!asyncConnectFailed || now - asyncConnectFailedMs >= ASYNC_RECONNECT_MS)) {
+      asyncStats.handshakes++;
+      asyncConnectFailed = !asyncClient.connect(FIREBASE_HOSTNAME, 443); // the one blocking step
+      asyncConnectFailedMs = now;
+    }
+  }
+  if (asyncClient.connected()) {
+    sendAsyncRequests();
+    readAsyncResponses();
+    if (asyncSent > 0 && millis() - asyncLastByteMs > ASYNC_TIMEOUT_MS) {
+      asyncClient.stop();
+      dropAsyncConnection();
+    }
+  }
+  asyncPumping = false;
+}
+
+void sendAsyncRequests() {
+  char head[ASYNC_PATH_LENGTH + sizeof(FIREBASE_AUTH) + sizeof(FIREBASE_HOSTNAME) + 96];
+  while (asyncSent < asyncCount && asyncSent < asyncDepth) {
+    AsyncRequest& req = asyncRing[(asyncHead + asyncSent) % ASYNC_QUEUE_SIZE];
+    bool write = strcmp(req.method, "GET") != 0;
+    size_t bodyLength = strlen(req.body);
+    int n = snprintf(head, sizeof(head), "%s %s.json?auth=%s%s HTTP/1.1\r\nHost: %s\r\nContent-Length: %u\r\n\r\n",
+                     req.method, req.path, FIREBASE_AUTH, write ? "&print=silent" : "",
+                     FIREBASE_HOSTNAME, (unsigned)bodyLength);
+    if (asyncClient.write((const uint8_t*)head, n) != (size_t)n ||
+        asyncClient.write((const uint8_t*)req.body, bodyLength) != bodyLength) {
+      asyncClient.stop();
+      dropAsyncConnection();
+      return;
+    }
+    req.attempts++;
+    if (asyncSent == 0) asyncLastByteMs = millis(); // the timeout runs from here
+    asyncSent++;
+    if (asyncSent > asyncStats.maxInFlight) asyncStats.maxInFlight = asyncSent;
+  }
+}
+
+// Takes only what has already arrived; a response can span many calls
+void readAsyncResponses() {
+  while (asyncSent > 0 && asyncClient.available() > 0) {
+    int c = asyncClient.read();
+    if (c < 0) break;
+    asyncLastByteMs = millis();
+
+    if (asyncParse == PARSE_BODY) {
+      if (asyncResponseLength < ASYNC_RESPONSE_LENGTH - 1) asyncResponse[asyncResponseLength++] = c;
+      if (--asyncRemaining > 0) continue;
+      if (asyncChunked) asyncParse = PARSE_CHUNK_END;
+      else finishAsyncResponse();
+      continue;
+    }
+    if (c != '\n') {
+      if (c != '\r' && asyncLineLength < (int)sizeof(asyncLine) - 1) asyncLine[asyncLineLength++] = c;
+      continue;
+    }
+    asyncLine[asyncLineLength] = '\0';
+    asyncLineLength = 0;
+    handleAsyncLine();
+  }
+}
+
+void handleAsyncLine() {
+  switch (asyncParse) {
+    case PARSE_STATUS: {
+      // "HTTP/1.1 204 No Content"
+      const char* space = strchr(asyncLine, ' ');
+      asyncStatus = space ? atoi(space + 1) : 0;
+      asyncRemaining = 0;
+      asyncChunked = asyncCloseAfter = false;
+      asyncResponseLength = 0;
+      asyncParse = PARSE_HEADERS;
+      break;
+    }
+    case PARSE_HEADERS:
+      if (strncasecmp(asyncLine, "Content-Length:", 15) == 0) {
+        asyncRemaining = atol(asyncLine + 15);
+      } else if (strncasecmp(asyncLine, "Transfer-Encoding: chunked", 26) == 0) {
+        asyncChunked = true;
+      } else if (strncasecmp(asyncLine, "Connection: close", 17) == 0) {
+        asyncCloseAfter = true;
+      } else if (asyncLine[0] == '\0') {
+        if (asyncChunked) asyncParse = PARSE_CHUNK_SIZE;
+        else if (asyncRemaining > 0) asyncParse = PARSE_BODY;
+        else finishAsyncResponse();
+      }
+      break;
+    case PARSE_CHUNK_SIZE:
+      asyncRemaining = strtol(asyncLine, nullptr, 16);
+      asyncParse = asyncRemaining > 0 ? PARSE_BODY : PARSE_TRAILER;
+      break;
+    case PARSE_CHUNK_END:
+      asyncParse = PARSE_CHUNK_SIZE;
+      break;
+    case PARSE_TRAILER:
+      if (asyncLine[0] == '\0') finishAsyncResponse();
+      break;
+    case PARSE_BODY:
+      break;
+  }
+}
+
+void finishAsyncResponse() {
+  asyncResponse[asyncResponseLength] = '\0';
+  asyncParse = PARSE_STATUS;
+  asyncSent--;
+  completeAsyncRequest(asyncStatus);
+  if (asyncCloseAfter) {
+    asyncClient.stop();
+    dropAsyncConnection();
+  }
+}
+
+void completeAsyncRequest(int status) {
+  AsyncRequest& req = asyncRing[asyncHead];
+  AsyncDone done = req.done;
+  unsigned long ms = millis() - req.queuedMs;
+  asyncHead = (asyncHead + 1) % ASYNC_QUEUE_SIZE;
+  asyncCount--;
+
+  bool ok = status >= 200 && status < 300;
+  if (ok) {
+    asyncStats.completed++;
+    asyncStats.totalMs += ms;
+    if (ms > asyncStats.maxMs) asyncStats.maxMs = ms;
+  } else {
+    asyncStats.failed++;
+    logEvent(LOG_WARN, LOG_UPLOAD_FAILED, status);
+  }
+  // Last, with the ring consistent: the callback may queue more
+  if (done) done(status, ok ? asyncResponse : "");
+}
+
+// What was in flight goes again on the next connection, oldest first,
+// unless it has had its attempts
+void dropAsyncConnection() {
+  if (asyncSent > 1) asyncDepth = 1; // the server may not take pipelined requests
+  asyncStats.retries += asyncSent;
+  asyncSent = 0;
+  asyncParse = PARSE_STATUS;
+  asyncLineLength = 0;
+  while (asyncCount > 0 && asyncRing[asyncHead].attempts >= ASYNC_MAX_ATTEMPTS) {
+    completeAsyncRequest(-1);
+  }
+}
+
+// ======================
+// == ERROR HANDLING ====
+// ======================
+// Appends a record to the ring; costs a few microseconds and never touches
+// the network. When the ring is full the oldest unsent record is dropped.
+void logEvent(LogLevel level, LogCode code, int32_t arg) {
+  uint32_t now = millis();
+  uint32_t last = logLastSeq[code];
+  if (last != 0 && now - logLastMs[code] < LOG_RATE_LIMIT_MS &&
+      last - 1 >= logUploadSeq && logWriteSeq - (last - 1) <= LOG_RING_SIZE) {
+    LogRecord& previous = logRing[(last - 1) % LOG_RING_SIZE];
+    if (previous.repeats < 0xFFFF) previous.repeats++;
+    return;
+  }
+
+  if (logWriteSeq - logUploadSeq >= (uint32_t)LOG_RING_SIZE) {
+    logUploadSeq++;
+    logDropped++;
+  }
+  LogRecord& record = logRing[logWriteSeq % LOG_RING_SIZE];
+  record.ms = now;
+  record.level = level;
+  record.code = code;
+  record.repeats = 0;
+  record.arg = arg;
+  logWriteSeq++;
+  logLastSeq[code] = logWriteSeq;
+  logLastMs[code] = now;
+}
+
+size_t putVarint(uint8_t* out, uint32_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
+
+size_t encodeBase64(const uint8_t* in, size_t len, char* out) {
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t n = 0;
+  for (size_t i = 0; i < len; i += 3) {
+    uint32_t chunk = (uint32_t)in[i] << 16;
+    if (i + 1 < len) chunk |= (uint32_t)in[i + 1] << 8;
+    if (i + 2 < len) chunk |= in[i + 2];
+    out[n++] = alphabet[(chunk >> 18) & 0x3F];
+    out[n++] = alphabet[(chunk >> 12) & 0x3F];
+    out[n++] = i + 1 < len ? alphabet[(chunk >> 6) & 0x3F] : '=';
+    out[n++] = i + 2 < len ? alphabet[chunk & 0x3F] : '=';
+  }
+  out[n] = '\0';
+  return n;
+}
+
+// Batch layout: version, varint boot epoch (0 if the clock is unset),
+// varint dropped count, varint record count, then per record
+// (level << 6 | code), varint ms delta, varint repeats, zigzag varint arg.
+void uploadLogBatch() {
+  uint32_t pending = logWriteSeq - logUploadSeq;
+  if (pending == 0) return;
+  unsigned long now = millis();
+  if (pending < (uint32_t)LOG_BATCH_MAX && now - lastLogUploadTime < LOG_UPLOAD_INTERVAL) return;
+  lastLogUploadTime = now;
+
+  uint32_t count = pending < (uint32_t)LOG_BATCH_MAX ? pending : LOG_BATCH_MAX;
+  time_t epoch = time(nullptr);
+  uint32_t bootEpoch = epoch > MIN_VALID_EPOCH ? epoch - now / 1000 : 0;
+
+  size_t n = 0;
+  logBinary[n++] = LOG_FORMAT_VERSION;
+  n += putVarint(logBinary + n, bootEpoch);
+  n += putVarint(logBinary + n, logDropped);
+  n += putVarint(logBinary + n, count);
+  uint32_t previousMs = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const LogRecord& record = logRing[(logUploadSeq + i) % LOG_RING_SIZE];
+    logBinary[n++] = (uint8_t)((record.level << 6) | (record.code & 0x3F));
+    n += putVarint(logBinary + n, record.ms - previousMs);
+    n += putVarint(logBinary + n, record.repeats);
+    n += putVarint(logBinary + n, ((uint32_t)record.arg << 1) ^ (uint32_t)(record.arg >> 31));
+    previousMs = record.ms;
+  }
+  encodeBase64(logBinary, n, logBase64);
+
+  FirebaseJson json;
+  json.set("b", logBase64);
+  if (fbPushJSON(PATH_LOGS, json)) {
+    logUploadSeq += count;
+    logDropped = 0;
+  } else {
+    logEvent(LOG_WARN, LOG_UPLOAD_FAILED, fbdo.httpCode());
+  }
+}
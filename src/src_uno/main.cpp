@@ -7,7 +7,16 @@ PROJECT: Solar-Powered Smart Lock - Arduino Master Controller (FINAL VERSION - C
 #include <Servo.h>
 #include <Wire.h>
 #include <LiquidCrystal_I2C.h>
-#include <EEPROM.h> // Optional, not yet implemented
+#include <EEPROM.h>
+#include <avr/wdt.h>
+#if __has_include("secrets.h")
+#include "secrets.h"
+#elif defined(SECRETS_EXAMPLE_OK) // CI only: a build that is never flashed
+#warning "include/secrets.h not found: building with the all-zero keys of secrets.example.h"
+#include "secrets.example.h"
+#else
+#error "include/secrets.h not found: copy include/secrets.example.h and fill in the door keys"
+#endif
 
 // --- PIN DEFINITIONS ---
 const int VIBRATION_PIN = 2;
@@ -25,6 +34,400 @@ const int RED_LED_PIN = A0;
 const int LOCKED_ANGLE = 90;
 const int UNLOCKED_ANGLE = 0;
 
+// --- SERVO MOTION ---
+// Moves are ramped with a trapezoidal velocity profile instead of jumping
+// straight to the target, which keeps the stall current spike off the solar
+// supply. Positions are in millidegrees, updated once per servo frame.
+const int SERVO_MIN_PULSE_US = 544;
+const int SERVO_MAX_PULSE_US = 2400;
+const unsigned long SERVO_FRAME_MS = 20;
+const long SERVO_MAX_SPEED = 180000;  // mdeg/s
+const long SERVO_ACCEL = 600000;      // mdeg/s^2
+const unsigned long SERVO_SETTLE_MS = 150;
+const int REED_DOOR_CLOSED = LOW;
+
+enum MotionState { MOTION_IDLE, MOTION_RAMPING, MOTION_SETTLING };
+
+struct ServoMotion {
+  MotionState state;
+  bool targetLocked;
+  bool confirm;          // check the reed switch on arrival
+  long position;         // mdeg
+  long velocity;         // mdeg/s, always >= 0
+  long target;           // mdeg
+  unsigned long startMs;
+  unsigned long stepMs;
+};
+// initializeLock() replaces the position with the checkpointed one
+ServoMotion motion = {MOTION_IDLE, true, false, LOCKED_ANGLE * 1000L, 0, 0, 0, 0};
+unsigned int failedMoves = 0;
+
+// --- FEEDBACK PATTERNS ---
+// Buzzer/LED sequences are played by the Timer2 compare ISR at 1 kHz, so
+// feedback runs in the background instead of delay()-ing the loop. Each step
+// sets both outputs and holds them for `ms`; a zero-length step ends it.
+const byte OUT_BUZZER = 0x01;
+const byte OUT_LED = 0x02;
+
+struct PatternStep {
+  byte outputs;
+  uint16_t ms;
+};
+
+const PatternStep PATTERN_CONFIRM[] PROGMEM = {
+  {OUT_BUZZER, 200}, {0, 0}
+};
+const PatternStep PATTERN_ERROR[] PROGMEM = {
+  {OUT_BUZZER | OUT_LED, 500}, {0, 0}
+};
+const PatternStep PATTERN_REGISTRATION[] PROGMEM = {
+  {OUT_BUZZER, 100}, {0, 50}, {OUT_BUZZER, 100}, {0, 0}
+};
+const PatternStep PATTERN_TAMPER[] PROGMEM = {
+  {OUT_BUZZER | OUT_LED, 100}, {0, 50}, {OUT_BUZZER | OUT_LED, 100}, {0, 50},
+  {OUT_BUZZER | OUT_LED, 100}, {OUT_LED, 150}, {0, 150}, {OUT_LED, 150}, {0, 0}
+};
+
+const PatternStep* volatile patternStep = nullptr; // the pointer is what the ISR changes
+volatile uint16_t patternRemainingMs = 0;
+volatile byte ledRestLevel = LOW; // what the LED shows when no pattern plays
+
+// --- REMOTE CONFIGURATION ---
+// The NodeMCU forwards changed settings as "CFG key=value" lines. Each one
+// takes effect immediately; "CFG_COMMIT <version>" persists the lot to
+// EEPROM so it survives a reset. Defaults match the old compile-time values.
+// The struct's size is fixed because the sections after it are addressed
+// from it; a new layout gets a new magic, and the NodeMCU resends the lot
+// once it sees the version the defaults report.
+const int EEPROM_CONFIG_ADDR = 0;
+const uint16_t CONFIG_MAGIC = 0x5C04;
+const unsigned long CLOSE_LOCK_MIN_MS = 1000; // let the latch settle before the bolt
+const byte PIN_MIN_LENGTH = 4;
+const byte PIN_MAX_LENGTH = 8;
+
+struct LockConfig {
+  uint16_t magic;
+  uint32_t version;
+  char masterPin[PIN_MAX_LENGTH + 1];
+  char adminPin[PIN_MAX_LENGTH + 1];
+  uint16_t wifiIntervalMs;
+  uint16_t lockIntervalMs;
+  uint32_t closeLockMs;  // lock this long after the door shuts, 0 = don't
+  uint32_t autoLockMs;   // 0 = never auto-lock
+  uint32_t pinTimeoutMs; // clear a half-typed PIN after this long
+  byte checksum;
+};
+static_assert(sizeof(LockConfig) == 41, "the EEPROM sections after the config must not move");
+LockConfig lockConfig = {CONFIG_MAGIC, 0, "1234", "9999", 2000, 10000, 0, 0, 10000, 0};
+byte configKeysApplied = 0;
+bool autoLockDue = false; // auto-lock came due with the door open
+
+// --- COMMAND TRACING ---
+// "TRACE <n>" from the NodeMCU tags the next L/U command; when it has been
+// carried out we report when it arrived and when it finished in millis().
+unsigned int pendingTrace = 0;
+unsigned long pendingTraceMillis = 0;
+unsigned int activeTrace = 0;
+unsigned long activeTraceMillis = 0;
+
+// --- RECOVERY ---
+// The watchdog resets us if loop() stops coming round (a wedged I2C bus, a
+// stuck delay). The last settled bolt position is kept in EEPROM, and a move
+// in flight is kept in SRAM that survives a reset, so after a reset the bolt
+// is only driven if it was mid-move or is out of an open door.
+const int EEPROM_CHECKPOINT_ADDR = EEPROM_CONFIG_ADDR + sizeof(LockConfig);
+const uint16_t CHECKPOINT_MAGIC = 0x5C02;
+const uint16_t RECOVERY_MAGIC = 0x5C03;
+const uint32_t I2C_TIMEOUT_US = 25000;
+
+enum ResetCause { RESET_POWER_ON, RESET_EXTERNAL, RESET_WATCHDOG, RESET_BROWN_OUT };
+
+struct LockCheckpoint {
+  uint16_t magic;
+  bool locked;
+  byte checksum;
+};
+
+// Lives in .noinit: untouched by the C runtime, so it survives a reset but
+// is garbage after power-up (hence the magic and checksum)
+struct RecoveryState {
+  uint16_t magic;
+  bool moving;
+  bool targetLocked;
+  bool watchdogFired;
+  unsigned int trace;
+  byte checksum;
+};
+RecoveryState recovery __attribute__((section(".noinit")));
+uint8_t resetFlags __attribute__((section(".noinit")));
+ResetCause resetCause = RESET_POWER_ON;
+bool stateRestored = false;
+
+// --- CARD READER ---
+// An MFRC522 on the I2C bus (address 0x28, module strapped for I2C): SPI
+// would need pins 10-13, which the keypad and buzzer already use. The reader
+// is driven as a small state machine from loop() so a poll never blocks.
+// Enrolled cards are kept as salted 32-bit FNV-1a hashes of their UID,
+// never the UID itself. Build with -D RFID_SIMULATED (env:uno_rfid_sim) to
+// swap the reader for "CARD <hex uid>" lines on the serial link.
+const int EEPROM_CARDS_ADDR = EEPROM_CHECKPOINT_ADDR + sizeof(LockCheckpoint);
+const uint16_t CARDS_MAGIC = 0x5CA0; // clear of the 0x5C0n run CONFIG_MAGIC is bumped through
+const byte CARD_SLOTS = 32;
+const uint32_t CARD_SLOT_EMPTY = 0xFFFFFFFF; // erased EEPROM
+const unsigned long CARD_POLL_MS = 30;        // worst case tap-to-detect
+const unsigned long CARD_REPEAT_MS = 1500;    // a card left on the reader counts once
+const unsigned long CARD_REPLY_TIMEOUT_MS = 5;
+const unsigned long ENROL_WINDOW_MS = 30000;
+
+const byte RFID_ADDR = 0x28;
+const byte RC_COMMAND = 0x01;
+const byte RC_COM_IRQ = 0x04;
+const byte RC_ERROR = 0x06;
+const byte RC_FIFO_DATA = 0x09;
+const byte RC_FIFO_LEVEL = 0x0A;
+const byte RC_BIT_FRAMING = 0x0D;
+const byte RC_MODE = 0x11;
+const byte RC_TX_CONTROL = 0x14;
+const byte RC_TX_ASK = 0x15;
+const byte RC_T_MODE = 0x2A;
+const byte RC_T_PRESCALER = 0x2B;
+const byte RC_T_RELOAD_H = 0x2C;
+const byte RC_T_RELOAD_L = 0x2D;
+const byte RC_VERSION = 0x37;
+const byte RC_CMD_IDLE = 0x00;
+const byte RC_CMD_TRANSCEIVE = 0x0C;
+const byte RC_CMD_SOFT_RESET = 0x0F;
+const byte PICC_REQA = 0x26;
+const byte PICC_ANTICOLL_CL1 = 0x93;
+
+enum CardEvent { CARD_GRANTED, CARD_DENIED, CARD_ENROLLED, CARD_TABLE_FULL, CARD_KNOWN };
+enum ReaderState { READER_IDLE, READER_WAIT_ATQA, READER_WAIT_UID };
+
+struct CardTableHeader {
+  uint16_t magic;
+  uint32_t salt;
+};
+
+uint32_t cardSalt = 0; // cached header salt; loadCardTable() sets it at boot
+ReaderState readerState = READER_IDLE;
+bool readerPresent = false;
+unsigned long readerStepMs = 0;
+unsigned long cardDetectMicros = 0;
+uint32_t lastCardHash = 0;
+unsigned long lastCardMs = 0;
+bool enrolling = false;
+
+#ifdef GATEWAY_MODE
+// --- RS-485 BUS ---
+// Built with -D GATEWAY_MODE (env:uno_gateway) this Uno is one door on a
+// half-duplex RS-485 bus run by the NodeMCU gateway. Frames are
+// "#NN:<payload>" lines; NN is our address, or 00 for a broadcast. We may
+// only talk when the gateway addresses us: events are buffered in the
+// outbox, sent as "#NN:@..." lines, and the turn ends with "#NN:.". The
+// status signal lines are not wired, so signals go out as @SIG events.
+// The address comes with the build, -D BUS_ADDRESS=<n> (one env per door),
+// since it also picks the door's key (see SIGNED COMMANDS).
+const int BUS_DE_PIN = TRIGGER_TAMPER_PIN; // MAX485 DE and /RE; the signal lines are unused on a bus
+const byte BUS_BROADCAST = 0;
+const byte BUS_MAX_ADDRESS = 16;
+const int BUS_OUTBOX_SIZE = 192;
+const int BUS_LINE_LENGTH = 48;
+const int BUS_FRAME_LENGTH = 64; // "#NN:" and the longest signed line
+#ifndef BUS_ADDRESS
+#define BUS_ADDRESS 1
+#endif
+
+const byte busAddress = BUS_ADDRESS;
+static_assert(BUS_ADDRESS >= 1 && BUS_ADDRESS <= BUS_MAX_ADDRESS, "BUS_ADDRESS is a door, 1 to 16");
+char busOutbox[BUS_OUTBOX_SIZE];
+int busOutboxLength = 0;
+char eventLine[BUS_LINE_LENGTH];
+int eventLength = 0;
+#endif
+
+// --- DOOR SENSOR ---
+// The reed switch on A3 (PC3) raises a pin-change interrupt on every edge.
+// Each edge restarts a countdown in the Timer2 ISR, and the level only counts
+// once it has held for REED_DEBOUNCE_MS, so the loop never waits on bounce.
+// The loop reports each settled change as @DOOR with how long it took from
+// the first edge, and, if lockConfig.closeLockMs is set, throws the bolt
+// that long after the door shuts. It is off by default: the NodeMCU's
+// built-in rule locks a door left unlocked and closed for 120 s, which a
+// short lock-on-close here would always beat.
+const byte REED_DEBOUNCE_MS = 20;
+const unsigned long DOOR_AJAR_MS = 60000;
+
+enum DoorEvent { DOOR_OPENED, DOOR_CLOSED, DOOR_AJAR };
+
+volatile byte reedSettleMs = 0;      // counts down after the latest edge
+volatile byte reedLevel = HIGH;      // debounced level
+volatile bool reedChanged = false;
+volatile unsigned long reedEdgeMicros = 0;   // first edge of the current burst
+volatile unsigned long reedChangeMicros = 0; // first edge of the settled change
+bool doorClosed = false;
+
+// --- POWER MODE ---
+// "PWR 1" from the NodeMCU means the battery is low: the backlight only
+// comes on for a while after a key or card.
+const unsigned long BACKLIGHT_TIMEOUT_MS = 15000;
+bool lowPower = false;
+bool backlightOn = true;
+
+// --- GUESTS & SCHEDULES ---
+// "GUEST <pin> <minutes>" from the NodeMCU adds a PIN that opens the door
+// until it expires; 0 minutes revokes it. Guest PINs are kept in RAM only,
+// so a reset revokes them as well. "SCHED <slot> <minute of day> <L|U>"
+// locks or unlocks every day at that time and "SCHED <slot> -" clears the
+// slot; office hours are a U slot and an L slot. Schedules live in EEPROM
+// after the card table and a reserved byte, and run off the time of day the
+// NodeMCU sends as "CLOCK <second of day>" once we have booted, then hourly.
+const byte GUEST_SLOTS = 4;
+const unsigned long GUEST_MAX_MINUTES = 2160; // 36 h, inside the timer wheel's reach
+const byte SCHEDULE_SLOTS = 8;
+const uint16_t SCHEDULE_EMPTY = 0xFFFF;       // erased EEPROM
+const uint16_t MINUTES_PER_DAY = 1440;
+const uint32_t SECONDS_PER_DAY = 86400;
+const uint16_t SCHEDULE_RERUN_GUARD_MIN = 720; // a due time this soon after a run is that run
+// The byte after the card table held the bus address before it became a
+// build flag; it is skipped so the schedules stay where they were
+const int EEPROM_RESERVED_ADDR = EEPROM_CARDS_ADDR + sizeof(CardTableHeader) + CARD_SLOTS * sizeof(uint32_t);
+const int EEPROM_SCHEDULE_ADDR = EEPROM_RESERVED_ADDR + 1;
+
+struct Schedule {
+  uint16_t minute; // of the day; SCHEDULE_EMPTY = unused
+  char action;     // 'L' or 'U'
+};
+
+char guestPins[GUEST_SLOTS][PIN_MAX_LENGTH + 1]; // "" = free
+Schedule schedules[SCHEDULE_SLOTS];
+uint16_t scheduleRanMinute[SCHEDULE_SLOTS]; // millis() / 60000 at the last run, wrapping
+byte schedulesRan = 0;                      // bit per slot: scheduleRanMinute is set
+bool clockKnown = false;
+uint32_t clockSecond = 0;      // second of the day at clockMillis
+unsigned long clockMillis = 0;
+
+// --- TIMER WHEEL ---
+// Deadlines (a half-typed PIN, the enrolment window, the low-power
+// backlight, the door ajar report, lock-on-close and auto-lock, a keypad
+// lockout, the two LCD row refreshes, an LCD message, a signal pulse,
+// guest PINs, schedules) sit on a hierarchical timer wheel rather than
+// each keeping a millis() stamp that loop() checks every pass. Every timer
+// owns a fixed entry, so arming and cancelling is a list link or unlink.
+// The wheel turns in 128 ms ticks; level 0 has a slot for each of the next
+// 16 ticks and every level above spans 16 times as much, so five levels
+// reach about 37 hours. When a level comes round to slot 0, the next slot of
+// the level above is moved down (cascaded). A tick therefore only touches
+// the timers due in it, plus one cascaded slot every 16 ticks. Ticks are
+// counted from millis() differences and tick numbers compared as
+// differences, so both wrap safely. tools/timer_wheel_bench.py runs the
+// same wheel with hundreds of timers against a scan of all of them.
+const unsigned long WHEEL_TICK_MS = 128;
+const byte WHEEL_SLOT_BITS = 4;
+const byte WHEEL_SLOTS = 1 << WHEEL_SLOT_BITS; // per level
+const byte WHEEL_LEVELS = 5;
+const uint32_t WHEEL_MAX_TICKS = (1UL << (WHEEL_SLOT_BITS * WHEEL_LEVELS)) - 1;
+const byte TIMER_NONE = 0xFF;
+
+enum TimerId : byte {
+  TIMER_PIN_TIMEOUT,
+  TIMER_ENROL_END,
+  TIMER_BACKLIGHT_OFF,
+  TIMER_DOOR_AJAR,
+  TIMER_CLOSE_LOCK,
+  TIMER_KEYPAD_UNLOCK,
+  TIMER_JITTER_END,
+  TIMER_AUTO_LOCK,
+  TIMER_WIFI_ROW,
+  TIMER_LOCK_ROW,
+  TIMER_MESSAGE,
+  TIMER_SIGNAL,
+  TIMER_TAMPER_QUIET,
+  TIMER_GUEST_FIRST,
+  TIMER_SCHEDULE_FIRST = TIMER_GUEST_FIRST + GUEST_SLOTS,
+  TIMER_COUNT = TIMER_SCHEDULE_FIRST + SCHEDULE_SLOTS
+};
+
+struct TimerEntry {
+  uint32_t due;  // tick number
+  byte next;
+  byte prev;
+  byte bucket;   // level * WHEEL_SLOTS + slot; TIMER_NONE when not armed
+};
+
+TimerEntry timers[TIMER_COUNT];
+byte wheel[WHEEL_LEVELS * WHEEL_SLOTS]; // first timer in each slot
+uint32_t wheelTick = 0;
+unsigned long wheelTickMillis = 0;
+unsigned long maxWheelMicros = 0;       // slowest advanceTimers() since the last report
+
+// --- SIGNED COMMANDS ---
+// Every command that moves the bolt or changes who can open the door (L,
+// U, CFG, CFG_COMMIT, KEYPAD_LOCK, GUEST, SCHED, CARDS_CLEAR) only
+// comes as "AUTH <counter> <tag> <command>", counter and tag in hex. The
+// tag is the first 8 bytes of HMAC-SHA256, keyed with this door's key,
+// over the door number (1, or the bus address), the counter (big endian)
+// and the command text, which must fit the one block hashed (50
+// characters). A counter must be higher than the last one accepted, which
+// is kept in EEPROM after the schedules, so a recorded line cannot be
+// played again. Status and test lines (WIFI_*, PWR, ALARM, JITTER_TEST,
+// TRACE, AUTH_SYNC) still come bare, and so does CLOCK, a broadcast on a
+// bus: it can only shift when a signed schedule runs. The key only lives in
+// flash: at boot its ipad and opad blocks are run through SHA-256 once and
+// just the two states are kept, so a check costs two compressions on the
+// stack (about 200 bytes with the 16-word message schedule), no heap.
+// @AUTH reports every result with the check time in us. "AUTH_SYNC" asks
+// for the current counter (result AUTH_COUNTER).
+const byte AUTH_TAG_BYTES = 8;
+const byte AUTH_HEADER_BYTES = 5; // door, counter
+const byte AUTH_COMMAND_MAX = 64 - 9 - AUTH_HEADER_BYTES; // room left for the 0x80 and the length
+const int EEPROM_AUTH_COUNTER_ADDR = EEPROM_SCHEDULE_ADDR + SCHEDULE_SLOTS * sizeof(Schedule);
+#define DOOR_KEY_FOR(n) DOOR_KEY_FOR_(n)
+#define DOOR_KEY_FOR_(n) DOOR_KEY_##n
+#ifdef GATEWAY_MODE
+const byte COMMAND_KEY[32] PROGMEM = DOOR_KEY_FOR(BUS_ADDRESS); // each door only carries its own
+#else
+const byte COMMAND_KEY[32] PROGMEM = DOOR_KEY_1;
+#endif
+
+enum AuthResult { AUTH_BAD_TAG, AUTH_OK, AUTH_REPLAY, AUTH_COUNTER };
+
+const uint32_t SHA256_INIT[8] PROGMEM = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+const uint32_t SHA256_K[64] PROGMEM = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+uint32_t hmacInner[8]; // SHA-256 state after key ^ ipad
+uint32_t hmacOuter[8]; // and after key ^ opad
+uint32_t authCounter = 0;
+
+// Loop timing, to keep an eye on how much feedback and I/O still block
+const unsigned long LOOP_REPORT_INTERVAL = 600000; // 10 minutes
+unsigned long lastLoopMicros = 0;
+unsigned long maxLoopMicros = 0;
+unsigned long lastLoopReportMillis = 0;
+
+// "JITTER_TEST <s>" keeps a pattern playing for that long and times every
+// loop pass meanwhile; it answers @JITTER,<passes>,<mean us>,<max us>.
+// That is how much the ISR-driven patterns still cost the loop, which the
+// 10-minute @LOOP max can't show.
+const unsigned long JITTER_TEST_MAX_S = 60;
+struct JitterTest {
+  bool running;
+  unsigned long passes;
+  unsigned long totalMicros;
+  unsigned long maxMicros;
+};
+JitterTest jitterTest = {false, 0, 0, 0};
+
 // --- KEYPAD SETUP ---
 const byte ROWS = 4;
 const byte COLS = 4;
@@ -38,16 +441,36 @@ byte rowPins[ROWS] = {3, 4, 5, 8};
 byte colPins[COLS] = {10, 11, 12, A2};
 Keypad customKeypad = Keypad(makeKeymap(keys), rowPins, colPins, ROWS, COLS);
 
+// "KEYPAD_LOCK <s>" from the NodeMCU's rules (too many wrong PINs, say)
+// ignores the keypad for that long; "KEYPAD_LOCK 0" lifts it early.
+const unsigned long KEYPAD_LOCK_MAX_S = 3600;
+
 // --- LCD & SERVO ---
 LiquidCrystal_I2C lcd(0x27, 16, 2);
 Servo myLockServo;
 
 // --- STATE VARIABLES ---
 String inputPassword = "";
-String masterPassword = "1234";
-String adminCode = "9999";
 bool isCurrentlyLocked = true;
-bool inEventDisplay = false;
+// LCD messages and the status pulses to the NodeMCU run off the timer
+// wheel, so the loop keeps reading the link, keypad and card reader under
+// them. A pulse holds a 3-bit code on pins 6, 7 and A1, then the lines go
+// low for SIGNAL_GAP_MS so the same code twice is still two edges; codes
+// raised meanwhile queue behind it.
+const unsigned long WRONG_PIN_MESSAGE_MS = 2000;
+const unsigned long REGISTRATION_MESSAGE_MS = 2000;
+const unsigned long TAMPER_MESSAGE_MS = 3000;
+const unsigned long TAMPER_QUIET_MS = 3000;
+#ifndef GATEWAY_MODE
+const unsigned long SIGNAL_PULSE_MS = 2000;
+const unsigned long SIGNAL_GAP_MS = 256;
+const byte SIGNAL_QUEUE_SIZE = 4;
+byte signalQueue[SIGNAL_QUEUE_SIZE];
+byte signalHead = 0;
+byte signalCount = 0;
+bool signalHigh = false; // a code is on the lines, not the gap after one
+#endif
+bool inEventDisplay = false; // a message is up; keys are ignored until it goes
 volatile bool tamperDetectedFlag = false;
 String lastWiFiStatus = "WiFi: Unknown    ";
 String incomingSerial = "";
@@ -55,16 +478,20 @@ String incomingSerial = "";
 bool isTyping = false;
 
 
-unsigned long previousWiFiMillis = 0;
-unsigned long previousLockMillis = 0;
-const unsigned long wifiInterval = 2000;
-const unsigned long lockInterval = 10000;
-
-
 void setup() {
   Serial.begin(115200);
-  myLockServo.attach(SERVO_PIN);
+  initializeTimers();
+  loadConfig();
+  loadSchedules();
+  loadCardTable(); // before the watchdog: a first-boot clear is ~0.4 s of EEPROM writes
+  initializeCommandAuth();
+  classifyReset();
+#ifdef GATEWAY_MODE
+  initializeBus();
+#endif
   lcd.init(); lcd.backlight();
+  Wire.setWireTimeout(I2C_TIMEOUT_US, true); // a wedged bus errors out instead of hanging
+  initializeCardReader();
 
   pinMode(LOCK_STATUS_PIN, OUTPUT);
   pinMode(RED_LED_PIN, OUTPUT);
@@ -79,61 +506,85 @@ void setup() {
 
   pinMode(VIBRATION_PIN, INPUT_PULLUP);
   attachInterrupt(digitalPinToInterrupt(VIBRATION_PIN), onVibration, FALLING);
- 
+
+  initializePatternTimer();
+  initializeDoorSensor();
   initializeLock();
+  if (!isLockTarget()) armAutoLock();
+  armTimer(TIMER_WIFI_ROW, lockConfig.wifiIntervalMs);
+  armTimer(TIMER_LOCK_ROW, lockConfig.lockIntervalMs);
+  reportConfigVersion(0);
+  startWatchdog();
+  reportBoot();
+  reportDoorEvent(doorClosed ? DOOR_CLOSED : DOOR_OPENED, false, 0);
 }
 
 void loop() {
+  wdt_reset();
+  trackLoopTime();
+  advanceTimers();
+  updateServoMotion();
   checkTamper();
   readSerialInput();
+  checkDoorSensor();
   checkKeypad();
+  checkCardReader();
   // isLedStatus();
+}
 
-  if (!inEventDisplay && !isTyping) { // <-- Add !isTyping here
-    unsigned long currentMillis = millis();
-    if (currentMillis - previousWiFiMillis >= wifiInterval) {
-      previousWiFiMillis = currentMillis;
-      lcd.setCursor(0, 1); lcd.print(lastWiFiStatus);
-    }
-    if (currentMillis - previousLockMillis >= lockInterval) {
-      previousLockMillis = currentMillis;
-      refreshLockDisplay();
+void initializeLock() {
+  LockCheckpoint checkpoint;
+  EEPROM.get(EEPROM_CHECKPOINT_ADDR, checkpoint);
+  bool haveCheckpoint = checkpoint.magic == CHECKPOINT_MAGIC &&
+                        checkpoint.checksum == checkpointChecksum(checkpoint);
+  bool wasMoving = recoveryValid() && recovery.moving;
+
+  if (!haveCheckpoint && !wasMoving) {
+    // Nothing to go on (first boot): infer it from the door as before
+    if (doorClosed) lockServo();
+    else unlockServo();
+    return;
+  }
+
+  stateRestored = true;
+  if (wasMoving) {
+    // Interrupted mid-move: it started from the other end, so finish the job
+    if (recovery.trace != 0) {
+      pendingTrace = recovery.trace;
+      pendingTraceMillis = millis();
+      claimTrace();
     }
+    motion.position = angleFor(!recovery.targetLocked);
+    if (recovery.targetLocked) lockServo();
+    else unlockServo();
+    return;
   }
-}
 
-void initializeLock() {
-  if (digitalRead(REED_PIN) == LOW) {
-    lockServo();
+  // The servo is detached and still where we left it: leave it there
+  motion.position = angleFor(checkpoint.locked);
+  isCurrentlyLocked = checkpoint.locked;
+  if (checkpoint.locked && !doorClosed) {
+    unlockServo(); // bolt out with the door open; same as a failed lock
   } else {
-    unlockServo();
-  }
-}
-
-// void checkReedSwitch() {
-//   static bool lastState = HIGH;
-//   bool currentState = digitalRead(REED_PIN);
-
-//   if (currentState != lastState) {
-//     delay(100); // debounce
-//     currentState = digitalRead(REED_PIN);
-//     if (currentState != lastState) {
-//       lastState = currentState;
-//       if (currentState == LOW) {
-//         // Magnet is near → unlocked
-//         unlockServo();
-//       } else {
-//         // Magnet is far → locked
-//         lockServo();
-//       }
-//     }
-//   }
-// }
+    refreshLockDisplay();
+  }
+}
 
 // === INPUT ===
 void checkKeypad() {
   char key = customKeypad.getKey();
-  if (!key) return;
+  if (!key || inEventDisplay) return;
+  armTimer(TIMER_PIN_TIMEOUT, lockConfig.pinTimeoutMs);
+  wakeDisplay();
+
+  if (keypadLocked()) {
+    lcd.clear();
+    lcd.print("Keypad locked");
+    lcd.setCursor(0, 1);
+    lcd.print(timerRemainingMs(TIMER_KEYPAD_UNLOCK) / 1000 + 1);
+    lcd.print(" s");
+    return;
+  }
 
   if (inputPassword.length() == 0) {
     lcd.clear();
@@ -157,61 +608,104 @@ void checkKeypad() {
 }
 
 void processPassword() {
-  if (inputPassword == masterPassword) {
+  if (inputPassword == lockConfig.masterPin) {
+    reportPinEvent(true);
     toggleLock();
-    delay(5000);
-  } else if (inputPassword == adminCode) {
+  } else if (inputPassword == lockConfig.adminPin) {
+    reportPinEvent(true);
     enableRegistrationMode();
+  } else if (isGuestPin(inputPassword)) {
+    reportPinEvent(true);
+    toggleLock();
   } else {
-    inEventDisplay = true;
-    lcd.clear();
-    lcd.print("Wrong PIN!");
-    beep(500);
-    delay(2000);
-    inEventDisplay = false;
+    reportPinEvent(false);
+    showMessage("Wrong PIN!", WRONG_PIN_MESSAGE_MS);
+    playPattern(PATTERN_ERROR);
+  }
+  inputPassword = "";
+}
+
+// @PIN,<ok>; the NodeMCU's rules count the wrong ones
+void reportPinEvent(bool ok) {
+  beginEvent("PIN");
+  eventField(ok);
+  endEvent();
+}
+
+bool keypadLocked() {
+  return timerArmed(TIMER_KEYPAD_UNLOCK);
+}
+
+void lockKeypad(unsigned long seconds) {
+  if (seconds == 0) cancelTimer(TIMER_KEYPAD_UNLOCK);
+  else armTimer(TIMER_KEYPAD_UNLOCK, min(seconds, KEYPAD_LOCK_MAX_S) * 1000);
+  inputPassword = "";
+  if (isTyping) {
+    isTyping = false;
     refreshLockDisplay();
   }
+}
+
+void onPinTimeout() {
+  if (!isTyping) return;
+  isTyping = false;
   inputPassword = "";
+  refreshLockDisplay();
 }
 
-void checkTamper() {
-  if (tamperDetectedFlag) {
-    inEventDisplay = true;
-    lcd.clear();
-    lcd.print("!!! TAMPER !!!");
-    Serial.println("Tamper detected!");
-    beep(100); delay(50); beep(100); delay(50); beep(100);
-    signalToNodeMCU(false, true, false); // 0 1 0
-    delay(1000);
-    tamperDetectedFlag = false;
-    inEventDisplay = false;
+// Counted from the end of each unlock
+void armAutoLock() {
+  autoLockDue = false;
+  if (lockConfig.autoLockMs == 0) cancelTimer(TIMER_AUTO_LOCK);
+  else armTimer(TIMER_AUTO_LOCK, lockConfig.autoLockMs);
+}
+
+void onAutoLockTimeout() {
+  if (isLockTarget()) return;
+  // Only throw the bolt into a closed door; an open one locks when it shuts
+  if (doorClosed) lockServo();
+  else autoLockDue = true;
+}
+
+// A row that comes due under a message or a half-typed PIN is tried again
+// on the next tick
+void onDisplayRowTimeout(byte id) {
+  if (inEventDisplay || isTyping) {
+    armTimer(id, WHEEL_TICK_MS);
+  } else if (id == TIMER_WIFI_ROW) {
+    lcd.setCursor(0, 1); lcd.print(lastWiFiStatus);
+    armTimer(id, lockConfig.wifiIntervalMs);
+  } else {
     refreshLockDisplay();
+    armTimer(id, lockConfig.lockIntervalMs);
   }
 }
 
+// One alert per knock: the vibration sensor chatters, so further interrupts
+// are ignored until TIMER_TAMPER_QUIET runs out
+void checkTamper() {
+  if (!tamperDetectedFlag) return;
+  tamperDetectedFlag = false;
+  if (timerArmed(TIMER_TAMPER_QUIET)) return;
+  armTimer(TIMER_TAMPER_QUIET, TAMPER_QUIET_MS);
+  showMessage("!!! TAMPER !!!", TAMPER_MESSAGE_MS);
+  debugPrint("Tamper detected!");
+  playPattern(PATTERN_TAMPER);
+  signalToNodeMCU(false, true, false); // 0 1 0
+}
+
 void onVibration() {
   tamperDetectedFlag = true;
 }
 
 // === SERIAL COMM ===
+#ifndef GATEWAY_MODE
 void readSerialInput() {
   while (Serial.available()) {
     char c = Serial.read();
 
-    // Check for single-character commands from NodeMCU
-    if (c == 'L') {
-      if (!isCurrentlyLocked) {
-        lockServo();
-      }
-      continue;
-    } else if (c == 'U') {
-      if (isCurrentlyLocked) {
-        unlockServo();
-      }
-      continue;
-    }
-
-    // Else, build a string (e.g., "WIFI_CONNECTED")
+    // Build a line (e.g., "WIFI_CONNECTED"); a bare L or U is no longer
+    // obeyed, lock and settings commands must be signed
     if (c == '\n' || c == '\r') {
       if (incomingSerial.length() > 0) {
         handleSerialCommand(incomingSerial);
@@ -223,95 +717,1306 @@ void readSerialInput() {
   }
 }
 
+void debugPrint(const String& text) {
+  Serial.println(text);
+}
+#endif
+
+void handleLockCommand(char command) {
+  claimTrace();
+  if (isLockTarget() != (command == 'L')) {
+    if (command == 'L') lockServo();
+    else unlockServo();
+  } else {
+    finishTrace(false);
+  }
+}
+
 
 void handleSerialCommand(String cmd) {
   if (cmd == "WIFI_CONNECTED") {
     lastWiFiStatus = "WiFi: Connected   ";
   } else if (cmd == "WIFI_DISCONNECTED") {
     lastWiFiStatus = "WiFi: Disconnected";
+  } else if (cmd.startsWith("PWR ")) {
+    setPowerMode(cmd.substring(4).toInt() != 0);
+  } else if (cmd == "ALARM") {
+    playPattern(PATTERN_TAMPER);
+  } else if (cmd.startsWith("JITTER_TEST ")) {
+    startJitterTest(cmd.substring(12).toInt());
+  } else if (cmd.startsWith("AUTH ")) {
+    handleSignedCommand(cmd.c_str() + 5);
+  } else if (cmd == "AUTH_SYNC") {
+    reportAuth(AUTH_COUNTER, 0);
+  } else if (cmd.startsWith("CLOCK ")) {
+    setClock(strtoul(cmd.c_str() + 6, nullptr, 10));
+#ifdef RFID_SIMULATED
+  } else if (cmd.startsWith("CARD ")) {
+    uint32_t uid = strtoul(cmd.c_str() + 5, nullptr, 16);
+    byte bytes[4] = {(byte)(uid >> 24), (byte)(uid >> 16), (byte)(uid >> 8), (byte)uid};
+    cardDetectMicros = micros();
+    onCardRead(bytes, sizeof(bytes));
+#endif
+  } else if (cmd.startsWith("TRACE ")) {
+    pendingTrace = cmd.substring(6).toInt();
+    pendingTraceMillis = millis();
+  } else {
+    debugPrint("Unknown command: " + cmd); // a bare L, U, CFG... lands here
+  }
+}
+
+// Only reached from an AUTH line whose tag checked out
+void handleSignedPayload(const String& cmd) {
+  if (cmd == "L" || cmd == "U") {
+    handleLockCommand(cmd[0]);
+  } else if (cmd.startsWith("CFG ")) {
+    if (applyConfigSetting(cmd.substring(4))) configKeysApplied++;
+  } else if (cmd.startsWith("CFG_COMMIT ")) {
+    commitConfig(cmd.substring(11).toInt());
+  } else if (cmd.startsWith("KEYPAD_LOCK ")) {
+    lockKeypad(cmd.substring(12).toInt());
+  } else if (cmd.startsWith("GUEST ")) {
+    setGuestPin(cmd.substring(6));
+  } else if (cmd.startsWith("SCHED ")) {
+    setSchedule(cmd.substring(6));
+  } else if (cmd == "CARDS_CLEAR") {
+    clearCardTable();
+  } else {
+    debugPrint("Unknown command: " + cmd);
+  }
+}
+// === REMOTE CONFIGURATION ===
+byte configChecksum(const LockConfig& cfg) {
+  const byte* bytes = (const byte*)&cfg;
+  byte sum = 0;
+  for (size_t i = 0; i < offsetof(LockConfig, checksum); i++) sum += bytes[i];
+  return sum;
+}
+
+void loadConfig() {
+  LockConfig stored;
+  EEPROM.get(EEPROM_CONFIG_ADDR, stored);
+  if (stored.magic == CONFIG_MAGIC && stored.checksum == configChecksum(stored)) {
+    lockConfig = stored;
+  }
+}
+
+bool isValidPin(const String& pin) {
+  if (pin.length() < PIN_MIN_LENGTH || pin.length() > PIN_MAX_LENGTH) return false;
+  for (unsigned int i = 0; i < pin.length(); i++) {
+    char k = pin[i];
+    if (!((k >= '0' && k <= '9') || (k >= 'A' && k <= 'D'))) return false; // '*' and '#' are control keys
+  }
+  return true;
+}
+
+bool applyConfigSetting(const String& setting) {
+  int eq = setting.indexOf('=');
+  if (eq <= 0) return false;
+  String key = setting.substring(0, eq);
+  String value = setting.substring(eq + 1);
+  unsigned long number = strtoul(value.c_str(), nullptr, 10);
+
+  if (key == "pin" && isValidPin(value)) {
+    value.toCharArray(lockConfig.masterPin, sizeof(lockConfig.masterPin));
+  } else if (key == "admin" && isValidPin(value)) {
+    value.toCharArray(lockConfig.adminPin, sizeof(lockConfig.adminPin));
+  } else if (key == "wifiMs" && number >= 500 && number <= 0xFFFF) {
+    lockConfig.wifiIntervalMs = number;
+  } else if (key == "lockMs" && number >= 500 && number <= 0xFFFF) {
+    lockConfig.lockIntervalMs = number;
+  } else if (key == "closeLockMs" && (number == 0 || number >= CLOSE_LOCK_MIN_MS)) {
+    lockConfig.closeLockMs = number;
+  } else if (key == "autoLockMs") {
+    lockConfig.autoLockMs = number;
+    if (!isLockTarget()) armAutoLock();
+  } else if (key == "pinTimeoutMs" && number >= 1000) {
+    lockConfig.pinTimeoutMs = number;
   } else {
-    Serial.print("Unknown command: "); Serial.println(cmd);
+    return false;
   }
+  return true;
 }
+
+void commitConfig(unsigned long version) {
+  lockConfig.version = version;
+  lockConfig.magic = CONFIG_MAGIC;
+  lockConfig.checksum = configChecksum(lockConfig);
+  EEPROM.put(EEPROM_CONFIG_ADDR, lockConfig); // put() only rewrites changed bytes
+  reportConfigVersion(configKeysApplied);
+  configKeysApplied = 0;
+}
+
+// @CFG,<version>,<keys applied>; also sent at boot so the NodeMCU knows
+// which version we hold
+void reportConfigVersion(byte keys) {
+  beginEvent("CFG");
+  eventField(lockConfig.version);
+  eventField(keys);
+  endEvent();
+}
+
 // === STATE CONTROL ===
 void toggleLock() {
-  if (isCurrentlyLocked) {unlockServo();
+  if (isLockTarget()) {unlockServo();
   // delay(5000);
   }
   else lockServo();
 }
 
+// While a move is in flight the state we are heading to is what counts
+bool isLockTarget() {
+  return motion.state == MOTION_IDLE ? isCurrentlyLocked : motion.targetLocked;
+}
+
 void lockServo() {
-  myLockServo.attach(SERVO_PIN);
-  myLockServo.write(LOCKED_ANGLE);
-  delay(200);
-  myLockServo.detach();
-  isCurrentlyLocked = true;
-  signalToNodeMCU(false, false, true); // 0 0 1
-  delay(500);
-  beep(200);
+  startServoMove(true, true);
+}
+
+void unlockServo() {
+  // The reed only sees the door, so an unlock cannot be confirmed by it
+  startServoMove(false, false);
+}
+
+void claimTrace() {
+  activeTrace = pendingTrace;
+  activeTraceMillis = pendingTraceMillis;
+  pendingTrace = 0;
+}
+
+// @TRACE,<n>,<received ms>,<done ms>,<moved>
+void finishTrace(bool moved) {
+  if (activeTrace == 0) return;
+  beginEvent("TRACE");
+  eventField(activeTrace);
+  eventField(activeTraceMillis);
+  eventField(millis());
+  eventField(moved);
+  endEvent();
+  activeTrace = 0;
+}
+
+void onServoMoveComplete(bool locked, bool ok) {
+  finishTrace(true);
+  clearRecovery();
+  beginEvent("MOVE");
+  eventField(locked);
+  eventField(ok);
+  eventField(millis() - motion.startMs);
+  endEvent();
+
+  if (!ok) {
+    // Bolt did not seat: pull it back rather than leave it out of an open door
+    failedMoves++;
+    startServoMove(false, false);
+    playPattern(PATTERN_ERROR);
+    return;
+  }
+
+  isCurrentlyLocked = locked;
+  saveCheckpoint(locked);
+  if (locked) {
+    cancelTimer(TIMER_AUTO_LOCK);
+    autoLockDue = false;
+  } else {
+    armAutoLock();
+  }
+  if (locked) {
+    signalToNodeMCU(false, false, true); // 0 0 1
+  } else {
+    signalToNodeMCU(false, true, true); // 0 1 1
+  }
+  playPattern(PATTERN_CONFIRM);
   refreshLockDisplay();
   // sendLockState(); 
 }
 
-void unlockServo() {
+// === SERVO MOTION ===
+void startServoMove(bool locked, bool confirm) {
+  if (motion.state == MOTION_IDLE) {
+    // A detached servo stays where it was last driven, so motion.position
+    // is still valid and the ramp starts from there
+    motion.velocity = 0;
+    motion.startMs = millis();
+  } else if (locked != motion.targetLocked) {
+    motion.velocity = 0; // reversing mid-move: start the new ramp from rest
+  }
+  motion.targetLocked = locked;
+  motion.confirm = confirm;
+  motion.target = angleFor(locked);
+  motion.stepMs = millis();
+  motion.state = MOTION_RAMPING;
+  saveRecovery(locked, activeTrace);
+  // Load the pulse first: attach() would otherwise start at the 1500 us default
+  writeServoPosition(motion.position);
   myLockServo.attach(SERVO_PIN);
-  myLockServo.write(UNLOCKED_ANGLE);
-  delay(200);
-  myLockServo.detach();
-  isCurrentlyLocked = false;
-  signalToNodeMCU(false, true, true); // 0 1 1
-  delay(500);
-  beep(200);
+}
 
-  refreshLockDisplay();
+long angleFor(bool locked) {
+  return (locked ? LOCKED_ANGLE : UNLOCKED_ANGLE) * 1000L;
+}
 
-  
-  // sendLockState(); 
+void writeServoPosition(long mdeg) {
+  long pulse = SERVO_MIN_PULSE_US + mdeg * (SERVO_MAX_PULSE_US - SERVO_MIN_PULSE_US) / 180000L;
+  myLockServo.writeMicroseconds(pulse);
+}
+
+// Called every loop; advances the profile once per servo frame so the main
+// loop never waits on the bolt.
+void updateServoMotion() {
+  if (motion.state == MOTION_IDLE) return;
+  unsigned long now = millis();
+
+  if (motion.state == MOTION_SETTLING) {
+    if (now - motion.stepMs < SERVO_SETTLE_MS) return;
+
+    // The reed sees the door, not the bolt: an open door fails the move
+    // once, as another run at the strike could not change the reading
+    bool ok = !motion.confirm || doorClosed;
+    myLockServo.detach();
+    motion.state = MOTION_IDLE;
+    onServoMoveComplete(motion.targetLocked, ok);
+    return;
+  }
+
+  if (now - motion.stepMs < SERVO_FRAME_MS) return;
+  long dtMs = now - motion.stepMs;
+  motion.stepMs = now;
+
+  long remaining = labs(motion.target - motion.position);
+  long stopping = (long)((float)motion.velocity * motion.velocity / (2.0f * SERVO_ACCEL));
+  if (stopping >= remaining) {
+    motion.velocity -= SERVO_ACCEL * dtMs / 1000;
+  } else {
+    motion.velocity += SERVO_ACCEL * dtMs / 1000;
+  }
+  motion.velocity = constrain(motion.velocity, SERVO_ACCEL * (long)SERVO_FRAME_MS / 1000, SERVO_MAX_SPEED);
+
+  long step = motion.velocity * dtMs / 1000;
+  if (step >= remaining) {
+    motion.position = motion.target;
+    motion.velocity = 0;
+    motion.state = MOTION_SETTLING;
+  } else {
+    motion.position += (motion.target > motion.position) ? step : -step;
+  }
+  writeServoPosition(motion.position);
 }
 
 void enableRegistrationMode() {
+  debugPrint("Enabling Registration Mode...");
+  showMessage("Reg. Mode ON", REGISTRATION_MESSAGE_MS);
+  playPattern(PATTERN_REGISTRATION);
+  enrolling = true;
+  armTimer(TIMER_ENROL_END, ENROL_WINDOW_MS);
+  signalToNodeMCU(true, false, false); // 1 0 0
+}
+
+// === DISPLAY & SIGNAL ===
+// Left on the LCD until TIMER_MESSAGE, with the keypad ignored meanwhile
+void showMessage(const char* text, unsigned long ms) {
   inEventDisplay = true;
-  Serial.println("Enabling Registration Mode...");
   lcd.clear();
-  lcd.print("Reg. Mode ON");
-  beep(100); delay(50); beep(100);
-  signalToNodeMCU(true, false, false); // 1 0 0
-  delay(2000);
+  lcd.print(text);
+  armTimer(TIMER_MESSAGE, ms);
+}
+
+void onMessageTimeout() {
   inEventDisplay = false;
   refreshLockDisplay();
 }
 
-// === DISPLAY & SIGNAL ===
 void refreshLockDisplay() {
   lcd.setCursor(0, 0);
   lcd.print("Status:         ");
   lcd.setCursor(0, 0);
   if (isCurrentlyLocked) {
     lcd.print("Status: LOCKED  ");
-    digitalWrite(RED_LED_PIN, HIGH); 
+    setLedRestLevel(HIGH);
     // digitalWrite(BLUE_LED_PIN, LOW);
   } else {
     lcd.print("Status: UNLOCKED");
-    digitalWrite(RED_LED_PIN, LOW);
+    setLedRestLevel(LOW);
     // digitalWrite(BLUE_LED_PIN, HIGH);
   }
 }
 
+// Lines starting with '@' carry structured events for the NodeMCU; anything
+// else it receives on this link is debug text and gets ignored.
+#ifndef GATEWAY_MODE
+void beginEvent(const char* name) {
+  Serial.print('@');
+  Serial.print(name);
+}
+
+void eventField(long value) {
+  Serial.print(',');
+  Serial.print(value);
+}
+
+void endEvent() {
+  Serial.println();
+}
+#endif
+
 void signalToNodeMCU(bool bit6, bool bit7, bool bitA1) {
-  digitalWrite(TRIGGER_REG_MODE_PIN, bit6);  //D2     // Pin 6 → Bit 2
-  digitalWrite(TRIGGER_TAMPER_PIN, bit7);   //D1      // Pin 7 → Bit 1
-  digitalWrite(LOCK_STATUS_PIN, bitA1);  // D5            // A1 → Bit 0
-  delay(2000);
-  // Clear all signals back to LOW
-  digitalWrite(LOCK_STATUS_PIN, LOW); 
-  digitalWrite(TRIGGER_TAMPER_PIN, LOW);
-  digitalWrite(TRIGGER_REG_MODE_PIN, LOW);
+  byte code = (bit6 << 2) | (bit7 << 1) | bitA1;
+#ifdef GATEWAY_MODE
+  beginEvent("SIG");
+  eventField(code);
+  endEvent();
+#else
+  if (signalCount == SIGNAL_QUEUE_SIZE) return; // the bridge is that far behind anyway
+  signalQueue[(signalHead + signalCount) % SIGNAL_QUEUE_SIZE] = code;
+  signalCount++;
+  if (!timerArmed(TIMER_SIGNAL)) startSignalPulse();
+#endif
+}
+
+#ifndef GATEWAY_MODE
+void startSignalPulse() {
+  writeSignalPins(signalQueue[signalHead]);
+  signalHigh = true;
+  armTimer(TIMER_SIGNAL, SIGNAL_PULSE_MS);
+}
+
+// The end of a pulse, then the end of the gap after it
+void onSignalTimeout() {
+  if (signalHigh) {
+    writeSignalPins(0);
+    signalHigh = false;
+    signalHead = (signalHead + 1) % SIGNAL_QUEUE_SIZE;
+    signalCount--;
+    if (signalCount > 0) armTimer(TIMER_SIGNAL, SIGNAL_GAP_MS);
+  } else if (signalCount > 0) {
+    startSignalPulse();
+  }
+}
+
+void writeSignalPins(byte code) {
+  digitalWrite(TRIGGER_REG_MODE_PIN, code & 0b100); // D2, bit 2
+  digitalWrite(TRIGGER_TAMPER_PIN, code & 0b010);   // D1, bit 1
+  digitalWrite(LOCK_STATUS_PIN, code & 0b001);      // D5, bit 0
+}
+#endif
+
+
+// === RECOVERY ===
+// Optiboot clears MCUSR before starting us, so this usually reads 0 and the
+// cause is worked out from what survived in .noinit instead
+void saveResetFlags() __attribute__((naked, used, section(".init3")));
+void saveResetFlags() {
+  resetFlags = MCUSR;
+  MCUSR = 0;
+  wdt_disable();
+}
+
+byte recoveryChecksum() {
+  const byte* bytes = (const byte*)&recovery;
+  byte sum = 0x5A;
+  for (size_t i = 0; i < offsetof(RecoveryState, checksum); i++) sum += bytes[i];
+  return sum;
+}
+
+bool recoveryValid() {
+  return recovery.magic == RECOVERY_MAGIC && recovery.checksum == recoveryChecksum();
+}
+
+void saveRecovery(bool targetLocked, unsigned int trace) {
+  recovery.magic = RECOVERY_MAGIC;
+  recovery.moving = true;
+  recovery.targetLocked = targetLocked;
+  recovery.watchdogFired = false;
+  recovery.trace = trace;
+  recovery.checksum = recoveryChecksum();
+}
+
+void clearRecovery() {
+  recovery.magic = RECOVERY_MAGIC;
+  recovery.moving = false;
+  recovery.watchdogFired = false;
+  recovery.trace = 0;
+  recovery.checksum = recoveryChecksum();
+}
+
+void classifyReset() {
+  if (resetFlags & _BV(WDRF)) resetCause = RESET_WATCHDOG;
+  else if (resetFlags & _BV(BORF)) resetCause = RESET_BROWN_OUT;
+  else if (resetFlags & _BV(EXTRF)) resetCause = RESET_EXTERNAL;
+  else if (resetFlags & _BV(PORF)) resetCause = RESET_POWER_ON;
+  else if (!recoveryValid()) resetCause = RESET_POWER_ON; // SRAM did not survive
+  else if (recovery.watchdogFired) resetCause = RESET_WATCHDOG;
+  else resetCause = RESET_EXTERNAL;
+
+  if (resetCause == RESET_POWER_ON || resetCause == RESET_BROWN_OUT) {
+    // SRAM contents cannot be trusted after the supply dipped
+    recovery.magic = 0;
+  } else if (recovery.watchdogFired) {
+    recovery.watchdogFired = false;
+    recovery.checksum = recoveryChecksum();
+  }
+}
+
+byte checkpointChecksum(const LockCheckpoint& cp) {
+  return (byte)(0xA5 + cp.magic + (cp.magic >> 8) + cp.locked);
+}
+
+// Only the lock state and checksum bytes change, so a lock/unlock cycle
+// costs two EEPROM writes
+void saveCheckpoint(bool locked) {
+  LockCheckpoint cp = {CHECKPOINT_MAGIC, locked, 0};
+  cp.checksum = checkpointChecksum(cp);
+  EEPROM.put(EEPROM_CHECKPOINT_ADDR, cp);
 }
 
+// Interrupt-then-reset mode: the timeout runs WDT_vect first so the next
+// boot can tell a watchdog reset from the reset button
+void startWatchdog() {
+  wdt_enable(WDTO_4S);
+  WDTCSR |= _BV(WDIE);
+}
+
+ISR(WDT_vect) {
+  if (!recoveryValid()) clearRecovery();
+  recovery.watchdogFired = true;
+  recovery.checksum = recoveryChecksum();
+  wdt_enable(WDTO_15MS);
+  while (true) {}
+}
+
+// @BOOT,<cause>,<ready ms>,<restored>
+void reportBoot() {
+  beginEvent("BOOT");
+  eventField(resetCause);
+  eventField(millis());
+  eventField(stateRestored);
+  endEvent();
+}
+
+#ifdef GATEWAY_MODE
+// === RS-485 BUS ===
+void initializeBus() {
+  pinMode(BUS_DE_PIN, OUTPUT);
+  digitalWrite(BUS_DE_PIN, LOW);
+}
+
+void readSerialInput() {
+  while (Serial.available()) {
+    char c = Serial.read();
+    if (c == '\n' || c == '\r') {
+      if (incomingSerial.length() > 0) handleBusFrame(incomingSerial);
+      incomingSerial = "";
+    } else if (incomingSerial.length() < BUS_FRAME_LENGTH) {
+      incomingSerial += c;
+    }
+  }
+}
+
+void handleBusFrame(const String& frame) {
+  if (frame.length() < 5 || frame[0] != '#' || frame[3] != ':') return;
+  byte address = (frame[1] - '0') * 10 + (frame[2] - '0');
+  if (address != busAddress && address != BUS_BROADCAST) return;
+
+  String payload = frame.substring(4);
+  if (payload != "?") {
+    handleSerialCommand(payload);
+  }
+
+  // If more frames are already waiting, we were too slow and the gateway has
+  // moved on: answering now would talk over another door
+  if (address == busAddress && Serial.available() == 0) {
+    sendBusTurn(busAddress);
+  }
+}
+
+void sendBusTurn(byte address) {
+  char prefix[6];
+  snprintf(prefix, sizeof(prefix), "#%02u:", address);
+  digitalWrite(BUS_DE_PIN, HIGH);
+  int start = 0;
+  for (int i = 0; i < busOutboxLength; i++) {
+    if (busOutbox[i] != '\n') continue;
+    Serial.print(prefix);
+    Serial.write((const uint8_t*)busOutbox + start, i - start + 1);
+    start = i + 1;
+  }
+  Serial.print(prefix);
+  Serial.println('.');
+  Serial.flush(); // returns once the last stop bit is out
+  digitalWrite(BUS_DE_PIN, LOW);
+  busOutboxLength = 0;
+}
+
+void beginEvent(const char* name) {
+  eventLength = snprintf(eventLine, sizeof(eventLine), "@%s", name);
+}
+
+void eventField(long value) {
+  if (eventLength >= (int)sizeof(eventLine)) return;
+  eventLength += snprintf(eventLine + eventLength, sizeof(eventLine) - eventLength, ",%ld", value);
+}
+
+// Events wait in the outbox for our turn; if it is full the newest is dropped
+void endEvent() {
+  if (eventLength >= (int)sizeof(eventLine) || busOutboxLength + eventLength + 1 > BUS_OUTBOX_SIZE) return;
+  memcpy(busOutbox + busOutboxLength, eventLine, eventLength);
+  busOutboxLength += eventLength;
+  busOutbox[busOutboxLength++] = '\n';
+}
+
+// Nothing may go on the bus outside our turn
+void debugPrint(const String& text) {
+}
+#endif
+
+// === DOOR SENSOR ===
+void initializeDoorSensor() {
+  reedLevel = digitalRead(REED_PIN);
+  doorClosed = reedLevel == REED_DOOR_CLOSED;
+  if (!doorClosed) armTimer(TIMER_DOOR_AJAR, DOOR_AJAR_MS);
+  noInterrupts();
+  PCMSK1 |= _BV(PCINT11); // A3 only; the keypad column on A2 shares the port
+  PCICR |= _BV(PCIE1);
+  interrupts();
+}
+
+ISR(PCINT1_vect) {
+  if (reedSettleMs == 0) reedEdgeMicros = micros();
+  reedSettleMs = REED_DEBOUNCE_MS;
+}
+
+void checkDoorSensor() {
+  if (reedChanged) {
+    noInterrupts();
+    reedChanged = false;
+    bool closed = reedLevel == REED_DOOR_CLOSED;
+    unsigned long edgeMicros = reedChangeMicros;
+    interrupts();
+    if (closed != doorClosed) onDoorChanged(closed, edgeMicros);
+  }
+}
+
+void onDoorChanged(bool closed, unsigned long edgeMicros) {
+  doorClosed = closed;
+  cancelTimer(TIMER_DOOR_AJAR);
+  cancelTimer(TIMER_CLOSE_LOCK);
+  if (!closed) armTimer(TIMER_DOOR_AJAR, DOOR_AJAR_MS);
+  else if (!isLockTarget() && autoLockDue) lockServo();
+  else if (!isLockTarget() && lockConfig.closeLockMs != 0) armTimer(TIMER_CLOSE_LOCK, lockConfig.closeLockMs);
+
+  // With the bolt thrown and still, the door can only open by force
+  bool forced = !closed && isCurrentlyLocked && motion.state == MOTION_IDLE;
+  if (forced) playPattern(PATTERN_TAMPER);
+  reportDoorEvent(closed ? DOOR_CLOSED : DOOR_OPENED, forced, micros() - edgeMicros);
+}
+
+// @DOOR,<event>,<forced>,<us from the first edge to this report>
+void reportDoorEvent(DoorEvent event, bool forced, unsigned long latencyMicros) {
+  beginEvent("DOOR");
+  eventField(event);
+  eventField(forced);
+  eventField(latencyMicros);
+  endEvent();
+}
+
+// === POWER MODE ===
+void setPowerMode(bool low) {
+  lowPower = low;
+  if (low) {
+    armTimer(TIMER_BACKLIGHT_OFF, BACKLIGHT_TIMEOUT_MS); // let the current backlight period run out
+  } else {
+    wakeDisplay();
+  }
+}
+
+void wakeDisplay() {
+  armTimer(TIMER_BACKLIGHT_OFF, BACKLIGHT_TIMEOUT_MS);
+  if (!backlightOn) {
+    lcd.backlight();
+    backlightOn = true;
+  }
+}
+
+void onBacklightTimeout() {
+  if (!lowPower || !backlightOn) return;
+  lcd.noBacklight();
+  backlightOn = false;
+}
+
+// === GUESTS & SCHEDULES ===
+// "<pin> <minutes>"; a PIN already given out gets the new expiry
+void setGuestPin(const String& args) {
+  int space = args.indexOf(' ');
+  if (space < 0) return;
+  String pin = args.substring(0, space);
+  long minutes = args.substring(space + 1).toInt();
+  if (!isValidPin(pin)) return;
+
+  int slot = -1;
+  for (byte i = 0; i < GUEST_SLOTS && slot < 0; i++) {
+    if (pin == guestPins[i]) slot = i;
+  }
+  if (minutes <= 0) {
+    if (slot >= 0) expireGuestPin(slot);
+    return;
+  }
+  for (byte i = 0; i < GUEST_SLOTS && slot < 0; i++) {
+    if (guestPins[i][0] == '\0') slot = i;
+  }
+  if (slot < 0) {
+    debugPrint("No free guest slot");
+    return;
+  }
+  pin.toCharArray(guestPins[slot], sizeof(guestPins[slot]));
+  armTimer(TIMER_GUEST_FIRST + slot, min((unsigned long)minutes, GUEST_MAX_MINUTES) * 60000UL);
+}
+
+bool isGuestPin(const String& pin) {
+  for (byte i = 0; i < GUEST_SLOTS; i++) {
+    if (guestPins[i][0] != '\0' && pin == guestPins[i]) return true;
+  }
+  return false;
+}
+
+void expireGuestPin(byte slot) {
+  guestPins[slot][0] = '\0';
+  cancelTimer(TIMER_GUEST_FIRST + slot);
+}
+
+void loadSchedules() {
+  EEPROM.get(EEPROM_SCHEDULE_ADDR, schedules);
+  for (byte i = 0; i < SCHEDULE_SLOTS; i++) {
+    bool valid = schedules[i].action == 'L' || schedules[i].action == 'U';
+    if (schedules[i].minute >= MINUTES_PER_DAY || !valid) schedules[i].minute = SCHEDULE_EMPTY;
+  }
+}
+
+// "<slot> <minute of day> <L|U>" or "<slot> -"
+void setSchedule(const String& args) {
+  int space = args.indexOf(' ');
+  long slot = args.toInt();
+  if (space < 0 || slot < 0 || slot >= SCHEDULE_SLOTS) return;
+  String rest = args.substring(space + 1);
+
+  Schedule schedule = {SCHEDULE_EMPTY, 0};
+  if (rest != "-") {
+    int actionAt = rest.indexOf(' ') + 1;
+    long minute = rest.toInt();
+    char action = actionAt > 0 ? rest[actionAt] : 0;
+    if (minute < 0 || minute >= MINUTES_PER_DAY || (action != 'L' && action != 'U')) return;
+    schedule.minute = minute;
+    schedule.action = action;
+  }
+  schedules[slot] = schedule;
+  schedulesRan &= ~(1 << slot);
+  EEPROM.put(EEPROM_SCHEDULE_ADDR + slot * sizeof(Schedule), schedule);
+  armSchedule(slot);
+}
+
+uint32_t secondOfDay() {
+  return (clockSecond + (millis() - clockMillis) / 1000) % SECONDS_PER_DAY;
+}
+
+// The NodeMCU resends the time hourly, which also takes up millis() drift
+void setClock(uint32_t second) {
+  clockSecond = second % SECONDS_PER_DAY;
+  clockMillis = millis();
+  clockKnown = true;
+  for (byte i = 0; i < SCHEDULE_SLOTS; i++) armSchedule(i);
+}
+
+void armSchedule(byte slot) {
+  byte id = TIMER_SCHEDULE_FIRST + slot;
+  if (!clockKnown || schedules[slot].minute == SCHEDULE_EMPTY) {
+    cancelTimer(id);
+    return;
+  }
+  uint32_t wait = (schedules[slot].minute * 60UL + SECONDS_PER_DAY - secondOfDay()) % SECONDS_PER_DAY;
+  if (wait == 0) wait = SECONDS_PER_DAY;
+  // A slot that ran a little early on a fast clock comes due again seconds
+  // later by the corrected one; that is today's run, so wait for tomorrow's
+  uint16_t dueMinute = millis() / 60000 + wait / 60;
+  if ((schedulesRan & (1 << slot)) &&
+      (uint16_t)(dueMinute - scheduleRanMinute[slot]) < SCHEDULE_RERUN_GUARD_MIN) {
+    wait += SECONDS_PER_DAY;
+  }
+  armTimer(id, wait * 1000);
+}
+
+void runSchedule(byte slot) {
+  bool lock = schedules[slot].action == 'L';
+  if (lock != isLockTarget()) {
+    if (!lock) unlockServo();
+    else if (doorClosed) lockServo(); // never throw the bolt into an open door
+  }
+  scheduleRanMinute[slot] = millis() / 60000;
+  schedulesRan |= 1 << slot;
+  // A whole day on; a CLOCK in between re-arms it through armSchedule()
+  armTimer(TIMER_SCHEDULE_FIRST + slot, SECONDS_PER_DAY * 1000);
+}
+
+// === SIGNED COMMANDS ===
+void initializeCommandAuth() {
+  byte block[64];
+  hashKeyBlock(block, 0x36, hmacInner);
+  hashKeyBlock(block, 0x5C, hmacOuter);
+  memset(block, 0, sizeof(block)); // leave no key bytes on the stack
+  EEPROM.get(EEPROM_AUTH_COUNTER_ADDR, authCounter);
+  if (authCounter == 0xFFFFFFFF) authCounter = 0; // erased EEPROM
+}
+
+void hashKeyBlock(byte* block, byte pad, uint32_t* state) {
+  for (byte i = 0; i < 64; i++) {
+    block[i] = (i < sizeof(COMMAND_KEY) ? pgm_read_byte(&COMMAND_KEY[i]) : 0) ^ pad;
+  }
+  memcpy_P(state, SHA256_INIT, sizeof(SHA256_INIT));
+  sha256Block(state, block);
+}
+
+// "<counter> <tag> <command>"; the cheap replay check goes first
+void handleSignedCommand(const char* args) {
+  char* end;
+  uint32_t counter = strtoul(args, &end, 16);
+  byte tag[AUTH_TAG_BYTES];
+  const char* command = end + 2 + 2 * AUTH_TAG_BYTES;
+  bool parsed = *end == ' ' && parseHex(end + 1, tag, sizeof(tag)) && command[-1] == ' ';
+  size_t length = parsed ? strlen(command) : 0;
+
+  unsigned long start = micros();
+  AuthResult result = AUTH_OK;
+  if (length == 0 || length > AUTH_COMMAND_MAX) result = AUTH_BAD_TAG;
+  else if (counter <= authCounter) result = AUTH_REPLAY;
+  else if (!verifyCommandTag(counter, command, length, tag)) result = AUTH_BAD_TAG;
+  unsigned long elapsed = micros() - start;
+
+  if (result != AUTH_OK) {
+    pendingTrace = 0; // the TRACE line was for this command
+    reportAuth(result, elapsed);
+    return;
+  }
+  // Stored before acting, so a reset cannot let the same line through twice.
+  // Only changed bytes are written (3.3 ms each); at 100k writes per cell
+  // that is decades of lock commands.
+  authCounter = counter;
+  EEPROM.put(EEPROM_AUTH_COUNTER_ADDR, authCounter);
+  reportAuth(AUTH_OK, elapsed);
+  handleSignedPayload(command);
+}
+
+bool parseHex(const char* text, byte* out, byte length) {
+  for (byte i = 0; i < length * 2; i++) {
+    char k = text[i];
+    byte nibble;
+    if (k >= '0' && k <= '9') nibble = k - '0';
+    else if (k >= 'a' && k <= 'f') nibble = k - 'a' + 10;
+    else if (k >= 'A' && k <= 'F') nibble = k - 'A' + 10;
+    else return false;
+    out[i / 2] = (i % 2) ? (out[i / 2] << 4 | nibble) : nibble;
+  }
+  return true;
+}
+
+byte commandDoor() {
+#ifdef GATEWAY_MODE
+  return busAddress;
+#else
+  return 1;
+#endif
+}
+
+// HMAC from the precomputed states: the message and the inner hash each fit
+// one block with their padding
+bool verifyCommandTag(uint32_t counter, const char* command, byte length, const byte* tag) {
+  byte block[64];
+  uint32_t state[8];
+
+  memset(block, 0, sizeof(block));
+  block[0] = commandDoor();
+  for (byte i = 0; i < 4; i++) block[1 + i] = counter >> (24 - 8 * i);
+  memcpy(block + AUTH_HEADER_BYTES, command, length);
+  uint16_t bits = (64 + AUTH_HEADER_BYTES + length) * 8; // with the key block
+  block[AUTH_HEADER_BYTES + length] = 0x80;
+  block[62] = bits >> 8;
+  block[63] = bits & 0xFF;
+  memcpy(state, hmacInner, sizeof(state));
+  sha256Block(state, block);
+
+  memset(block, 0, sizeof(block));
+  for (byte i = 0; i < 32; i++) block[i] = state[i / 4] >> (24 - 8 * (i % 4));
+  block[32] = 0x80;
+  block[62] = ((64 + 32) * 8) >> 8;
+  block[63] = ((64 + 32) * 8) & 0xFF;
+  memcpy(state, hmacOuter, sizeof(state));
+  sha256Block(state, block);
+
+  // No early exit, so the time taken says nothing about how much matched
+  byte diff = 0;
+  for (byte i = 0; i < AUTH_TAG_BYTES; i++) diff |= tag[i] ^ (byte)(state[i / 4] >> (24 - 8 * (i % 4)));
+  return diff == 0;
+}
 
-void beep(int duration) {
-  digitalWrite(BUZZER_PIN, HIGH);
-  delay(duration);
-  digitalWrite(BUZZER_PIN, LOW);
-}
\ No newline at end of file
+uint32_t rotr(uint32_t x, byte n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+// One SHA-256 compression, keeping only the last 16 schedule words
+void sha256Block(uint32_t* state, const byte* block) {
+  uint32_t w[16];
+  for (byte i = 0; i < 16; i++) {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (byte i = 0; i < 64; i++) {
+    if (i >= 16) {
+      uint32_t w15 = w[(i + 1) & 15];
+      uint32_t w2 = w[(i + 14) & 15];
+      w[i & 15] += (rotr(w15, 7) ^ rotr(w15, 18) ^ (w15 >> 3)) + w[(i + 9) & 15] +
+                   (rotr(w2, 17) ^ rotr(w2, 19) ^ (w2 >> 10));
+    }
+    uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                  pgm_read_dword(&SHA256_K[i]) + w[i & 15];
+    uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+  state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+  state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+// @AUTH,<result>,<counter now held>,<us spent checking>
+void reportAuth(AuthResult result, unsigned long elapsedMicros) {
+  beginEvent("AUTH");
+  eventField(result);
+  eventField(authCounter);
+  eventField(elapsedMicros);
+  endEvent();
+}
+
+// === TIMER WHEEL ===
+void initializeTimers() {
+  memset(wheel, TIMER_NONE, sizeof(wheel));
+  for (byte i = 0; i < TIMER_COUNT; i++) timers[i].bucket = TIMER_NONE;
+  wheelTickMillis = millis();
+}
+
+bool timerArmed(byte id) {
+  return timers[id].bucket != TIMER_NONE;
+}
+
+unsigned long timerRemainingMs(byte id) {
+  return timerArmed(id) ? (timers[id].due - wheelTick) * WHEEL_TICK_MS : 0;
+}
+
+// Re-arming moves the timer; the deadline is rounded up to whole ticks
+void armTimer(byte id, unsigned long ms) {
+  cancelTimer(id);
+  uint32_t ticks = (ms + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  if (ticks == 0) ticks = 1; // this tick's slot has already been run
+  if (ticks > WHEEL_MAX_TICKS) ticks = WHEEL_MAX_TICKS;
+  timers[id].due = wheelTick + ticks;
+  linkTimer(id);
+}
+
+void cancelTimer(byte id) {
+  TimerEntry& timer = timers[id];
+  if (timer.bucket == TIMER_NONE) return;
+  if (timer.prev != TIMER_NONE) timers[timer.prev].next = timer.next;
+  else wheel[timer.bucket] = timer.next;
+  if (timer.next != TIMER_NONE) timers[timer.next].prev = timer.prev;
+  timer.bucket = TIMER_NONE;
+}
+
+// Files the timer on the lowest level whose span reaches its tick
+void linkTimer(byte id) {
+  TimerEntry& timer = timers[id];
+  uint32_t ticks = timer.due - wheelTick;
+  byte level = 0;
+  while (level < WHEEL_LEVELS - 1 && ticks >> (WHEEL_SLOT_BITS * (level + 1))) level++;
+  byte bucket = level * WHEEL_SLOTS + ((timer.due >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1));
+  timer.bucket = bucket;
+  timer.prev = TIMER_NONE;
+  timer.next = wheel[bucket];
+  if (timer.next != TIMER_NONE) timers[timer.next].prev = id;
+  wheel[bucket] = id;
+}
+
+void cascadeTimers(byte bucket) {
+  byte id = wheel[bucket];
+  wheel[bucket] = TIMER_NONE;
+  while (id != TIMER_NONE) {
+    byte next = timers[id].next;
+    linkTimer(id);
+    id = next;
+  }
+}
+
+// Catches up tick by tick, so timers still fire in order after a pass
+// held up by one of the display delays
+void advanceTimers() {
+  unsigned long start = micros();
+  while (millis() - wheelTickMillis >= WHEEL_TICK_MS) {
+    wheelTickMillis += WHEEL_TICK_MS;
+    wheelTick++;
+    for (byte level = 1; level < WHEEL_LEVELS; level++) {
+      if ((wheelTick >> (WHEEL_SLOT_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) break;
+      cascadeTimers(level * WHEEL_SLOTS + ((wheelTick >> (WHEEL_SLOT_BITS * level)) & (WHEEL_SLOTS - 1)));
+    }
+    byte bucket = wheelTick & (WHEEL_SLOTS - 1);
+    while (wheel[bucket] != TIMER_NONE) {
+      byte id = wheel[bucket];
+      cancelTimer(id);
+      onTimer(id); // may arm timers, this one included
+    }
+  }
+  unsigned long elapsed = micros() - start;
+  if (elapsed > maxWheelMicros) maxWheelMicros = elapsed;
+}
+
+void onTimer(byte id) {
+  if (id >= TIMER_SCHEDULE_FIRST) {
+    runSchedule(id - TIMER_SCHEDULE_FIRST);
+    return;
+  }
+  if (id >= TIMER_GUEST_FIRST) {
+    expireGuestPin(id - TIMER_GUEST_FIRST);
+    return;
+  }
+  switch (id) {
+    case TIMER_PIN_TIMEOUT:
+      onPinTimeout();
+      break;
+    case TIMER_ENROL_END:
+      enrolling = false;
+      break;
+    case TIMER_BACKLIGHT_OFF:
+      onBacklightTimeout();
+      break;
+    case TIMER_DOOR_AJAR:
+      if (!doorClosed) reportDoorEvent(DOOR_AJAR, false, 0);
+      break;
+    case TIMER_CLOSE_LOCK:
+      if (doorClosed && !isLockTarget()) lockServo();
+      break;
+    case TIMER_KEYPAD_UNLOCK:
+      break; // keypadLocked() only asks whether it is still armed
+    case TIMER_JITTER_END:
+      finishJitterTest();
+      break;
+    case TIMER_AUTO_LOCK:
+      onAutoLockTimeout();
+      break;
+    case TIMER_WIFI_ROW:
+    case TIMER_LOCK_ROW:
+      onDisplayRowTimeout(id);
+      break;
+    case TIMER_MESSAGE:
+      onMessageTimeout();
+      break;
+    case TIMER_SIGNAL:
+#ifndef GATEWAY_MODE
+      onSignalTimeout();
+#endif
+      break;
+    case TIMER_TAMPER_QUIET:
+      break; // checkTamper() only asks whether it is still armed
+  }
+}
+
+byte armedTimers() {
+  byte count = 0;
+  for (byte i = 0; i < TIMER_COUNT; i++) {
+    if (timerArmed(i)) count++;
+  }
+  return count;
+}
+
+// === CARD READER ===
+void rfidWrite(byte reg, byte value) {
+  Wire.beginTransmission(RFID_ADDR);
+  Wire.write(reg);
+  Wire.write(value);
+  Wire.endTransmission();
+}
+
+byte rfidRead(byte reg) {
+  Wire.beginTransmission(RFID_ADDR);
+  Wire.write(reg);
+  if (Wire.endTransmission() != 0) return 0;
+  if (Wire.requestFrom(RFID_ADDR, (byte)1) != 1) return 0;
+  return Wire.read();
+}
+
+void initializeCardReader() {
+#ifndef RFID_SIMULATED
+  rfidWrite(RC_COMMAND, RC_CMD_SOFT_RESET);
+  delay(50);
+  byte version = rfidRead(RC_VERSION);
+  readerPresent = version == 0x91 || version == 0x92 || version == 0x88; // v1, v2, FM17522 clone
+  if (!readerPresent) return;
+  // Timer: 40 kHz ticks, 2 ms reply window (a card answers within ~0.1 ms)
+  rfidWrite(RC_T_MODE, 0x80);
+  rfidWrite(RC_T_PRESCALER, 0xA9);
+  rfidWrite(RC_T_RELOAD_H, 0x00);
+  rfidWrite(RC_T_RELOAD_L, 80);
+  rfidWrite(RC_TX_ASK, 0x40); // 100% ASK
+  rfidWrite(RC_MODE, 0x3D);   // CRC preset 0x6363
+  rfidWrite(RC_TX_CONTROL, rfidRead(RC_TX_CONTROL) | 0x03); // antenna on
+#endif
+}
+
+void startTransceive(const byte* data, byte len, byte lastBits) {
+  rfidWrite(RC_COMMAND, RC_CMD_IDLE);
+  rfidWrite(RC_COM_IRQ, 0x7F);     // clear interrupt flags
+  rfidWrite(RC_FIFO_LEVEL, 0x80);  // flush FIFO
+  for (byte i = 0; i < len; i++) rfidWrite(RC_FIFO_DATA, data[i]);
+  rfidWrite(RC_BIT_FRAMING, lastBits);
+  rfidWrite(RC_COMMAND, RC_CMD_TRANSCEIVE);
+  rfidWrite(RC_BIT_FRAMING, 0x80 | lastBits); // StartSend
+  readerStepMs = millis();
+}
+
+// Returns the reply length, 0 while still waiting, -1 on timeout or error
+int pollTransceive(byte* out, byte maxLen) {
+  byte irq = rfidRead(RC_COM_IRQ);
+  if (irq & 0x30) { // RxIRq or IdleIRq
+    if (rfidRead(RC_ERROR) & 0x1B) return -1; // collision, parity, protocol, overflow
+    byte n = min(rfidRead(RC_FIFO_LEVEL), maxLen);
+    for (byte i = 0; i < n; i++) out[i] = rfidRead(RC_FIFO_DATA);
+    return n;
+  }
+  if ((irq & 0x01) || millis() - readerStepMs > CARD_REPLY_TIMEOUT_MS) return -1; // TimerIRq
+  return 0;
+}
+
+// REQA every CARD_POLL_MS, then anticollision for the cascade level 1 UID.
+// 7-byte UIDs are identified by their first level (cascade tag + 3 bytes).
+void checkCardReader() {
+  if (!readerPresent) return;
+
+  byte reply[5];
+  int n;
+  switch (readerState) {
+    case READER_IDLE:
+      if (millis() - readerStepMs < CARD_POLL_MS) return;
+      reply[0] = PICC_REQA;
+      startTransceive(reply, 1, 0x07);
+      readerState = READER_WAIT_ATQA;
+      break;
+
+    case READER_WAIT_ATQA:
+      n = pollTransceive(reply, sizeof(reply));
+      if (n == 0) return;
+      if (n != 2) { readerState = READER_IDLE; return; }
+      cardDetectMicros = micros();
+      reply[0] = PICC_ANTICOLL_CL1;
+      reply[1] = 0x20;
+      startTransceive(reply, 2, 0x00);
+      readerState = READER_WAIT_UID;
+      break;
+
+    case READER_WAIT_UID:
+      n = pollTransceive(reply, sizeof(reply));
+      if (n == 0) return;
+      readerState = READER_IDLE;
+      if (n == 5 && (reply[0] ^ reply[1] ^ reply[2] ^ reply[3]) == reply[4]) {
+        onCardRead(reply, 4);
+      }
+      break;
+  }
+}
+
+uint32_t hashCardUid(const byte* uid, byte len, uint32_t salt) {
+  uint32_t hash = 2166136261UL;
+  for (byte i = 0; i < 4; i++) hash = (hash ^ (byte)(salt >> (8 * i))) * 16777619UL;
+  for (byte i = 0; i < len; i++) hash = (hash ^ uid[i]) * 16777619UL;
+  return hash == CARD_SLOT_EMPTY ? hash - 1 : hash;
+}
+
+int cardSlotAddr(byte slot) {
+  return EEPROM_CARDS_ADDR + sizeof(CardTableHeader) + slot * sizeof(uint32_t);
+}
+
+// Returns the slot holding `hash`, or -1; `freeSlot` gets the first empty one
+int findCard(uint32_t hash, int& freeSlot) {
+  freeSlot = -1;
+  for (byte slot = 0; slot < CARD_SLOTS; slot++) {
+    uint32_t stored;
+    EEPROM.get(cardSlotAddr(slot), stored);
+    if (stored == hash) return slot;
+    if (stored == CARD_SLOT_EMPTY && freeSlot < 0) freeSlot = slot;
+  }
+  return -1;
+}
+
+// An unformatted table is cleared here at boot rather than on the first tap
+void loadCardTable() {
+  CardTableHeader header;
+  EEPROM.get(EEPROM_CARDS_ADDR, header);
+  if (header.magic != CARDS_MAGIC) clearCardTable();
+  else cardSalt = header.salt;
+}
+
+// A fresh salt also orphans any hash that was copied off the device
+void clearCardTable() {
+  CardTableHeader header = {CARDS_MAGIC, (uint32_t)(micros() ^ (millis() << 16))};
+  EEPROM.put(EEPROM_CARDS_ADDR, header);
+  cardSalt = header.salt;
+  for (byte slot = 0; slot < CARD_SLOTS; slot++) EEPROM.put(cardSlotAddr(slot), CARD_SLOT_EMPTY);
+}
+
+void onCardRead(const byte* uid, byte len) {
+  uint32_t hash = hashCardUid(uid, len, cardSalt);
+  if (hash == lastCardHash && millis() - lastCardMs < CARD_REPEAT_MS) {
+    lastCardMs = millis();
+    return;
+  }
+  lastCardHash = hash;
+  lastCardMs = millis();
+  wakeDisplay();
+
+  int freeSlot;
+  int slot = findCard(hash, freeSlot);
+  CardEvent event;
+  if (enrolling) {
+    if (slot >= 0) {
+      event = CARD_KNOWN;
+    } else if (freeSlot < 0) {
+      event = CARD_TABLE_FULL;
+    } else {
+      EEPROM.put(cardSlotAddr(freeSlot), hash);
+      slot = freeSlot;
+      event = CARD_ENROLLED;
+    }
+  } else if (slot >= 0) {
+    event = CARD_GRANTED;
+    toggleLock();
+  } else {
+    event = CARD_DENIED;
+  }
+  reportCardEvent(event, slot, micros() - cardDetectMicros);
+}
+
+// Non-blocking: the message sits on the WiFi row for a full refresh period
+void reportCardEvent(CardEvent event, int slot, unsigned long authMicros) {
+  static const char* const MESSAGES[] = {
+    "Card accepted   ", "Card denied     ", "Card enrolled   ", "Card list full  ", "Card known      "
+  };
+  lcd.setCursor(0, 1);
+  lcd.print(MESSAGES[event]);
+  armTimer(TIMER_WIFI_ROW, lockConfig.wifiIntervalMs);
+  if (event != CARD_GRANTED) {
+    playPattern(event == CARD_ENROLLED ? PATTERN_CONFIRM : PATTERN_ERROR);
+  }
+
+  // @CARD,<event>,<slot>,<us from detection to decision>
+  beginEvent("CARD");
+  eventField(event);
+  eventField(slot);
+  eventField(authMicros);
+  endEvent();
+}
+
+// === FEEDBACK PATTERNS ===
+void initializePatternTimer() {
+  // Timer2, CTC mode, /64 prescaler: 16 MHz / 64 / 250 = 1 kHz
+  noInterrupts();
+  TCCR2A = _BV(WGM21);
+  TCCR2B = _BV(CS22);
+  OCR2A = 249;
+  TCNT2 = 0;
+  TIMSK2 = _BV(OCIE2A);
+  interrupts();
+}
+
+void applyPatternOutputs(byte outputs) {
+  digitalWrite(BUZZER_PIN, (outputs & OUT_BUZZER) ? HIGH : LOW);
+  digitalWrite(RED_LED_PIN, (outputs & OUT_LED) ? HIGH : ledRestLevel);
+}
+
+// Starts a pattern, cutting off whatever was playing
+void playPattern(const PatternStep* pattern) {
+  noInterrupts();
+  patternStep = pattern;
+  patternRemainingMs = pgm_read_word(&pattern->ms);
+  applyPatternOutputs(pgm_read_byte(&pattern->outputs));
+  interrupts();
+}
+
+void setLedRestLevel(byte level) {
+  ledRestLevel = level;
+  if (patternStep == nullptr) {
+    digitalWrite(RED_LED_PIN, level);
+  }
+}
+
+ISR(TIMER2_COMPA_vect) {
+  if (reedSettleMs > 0 && --reedSettleMs == 0) {
+    byte level = (PINC & _BV(PINC3)) ? HIGH : LOW;
+    if (level != reedLevel) {
+      reedLevel = level;
+      reedChangeMicros = reedEdgeMicros;
+      reedChanged = true;
+    }
+  }
+
+  if (patternStep == nullptr || --patternRemainingMs > 0) return;
+
+  const PatternStep* next = patternStep + 1;
+  uint16_t ms = pgm_read_word(&next->ms);
+  if (ms == 0) {
+    patternStep = nullptr;
+    applyPatternOutputs(0);
+    return;
+  }
+  patternStep = next;
+  patternRemainingMs = ms;
+  applyPatternOutputs(pgm_read_byte(&next->outputs));
+}
+
+void trackLoopTime() {
+  unsigned long now = micros();
+  unsigned long elapsed = now - lastLoopMicros;
+  lastLoopMicros = now;
+  if (elapsed > maxLoopMicros) maxLoopMicros = elapsed;
+  if (jitterTest.running) {
+    if (patternStep != nullptr) {
+      jitterTest.passes++;
+      jitterTest.totalMicros += elapsed;
+      if (elapsed > jitterTest.maxMicros) jitterTest.maxMicros = elapsed;
+    }
+    if (patternStep == nullptr) playPattern(PATTERN_TAMPER);
+  }
+
+  if (millis() - lastLoopReportMillis >= LOOP_REPORT_INTERVAL) {
+    lastLoopReportMillis = millis();
+    beginEvent("LOOP");
+    eventField(maxLoopMicros);
+    endEvent();
+    maxLoopMicros = 0;
+    // @WHEEL,<armed timers>,<slowest tick catch-up in us>
+    beginEvent("WHEEL");
+    eventField(armedTimers());
+    eventField(maxWheelMicros);
+    endEvent();
+    maxWheelMicros = 0;
+  }
+}
+
+void startJitterTest(unsigned long seconds) {
+  if (seconds == 0) return;
+  jitterTest = {true, 0, 0, 0};
+  playPattern(PATTERN_TAMPER);
+  armTimer(TIMER_JITTER_END, min(seconds, JITTER_TEST_MAX_S) * 1000);
+}
+
+// @JITTER,<passes>,<mean us>,<max us>
+void finishJitterTest() {
+  jitterTest.running = false;
+  beginEvent("JITTER");
+  eventField(jitterTest.passes);
+  eventField(jitterTest.passes ? jitterTest.totalMicros / jitterTest.passes : 0);
+  eventField(jitterTest.maxMicros);
+  endEvent();
+}
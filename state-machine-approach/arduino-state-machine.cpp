@@ -2,6 +2,9 @@
   PROJECT: Solar-Powered Smart Lock - Refactored with State Machine
   DESCRIPTION: This version uses a formal state machine to manage the lock's
   behavior, making it non-blocking, responsive, and easier to maintain.
+  NOTE: commands are still a bare 'L' or 'U' from the NodeMCU, unsigned, so
+  anyone on the RX pin can work the lock; src/src_uno only obeys signed AUTH
+  lines and is the one to deploy.
 */
 
 #include <Keypad.h>
@@ -202,11 +205,16 @@ void handleState_ShowingMessage() {
 }
 
 void handleState_Alarm() {
-  // Action: Beep periodically
-  output_beep(100, 100);
+  // Action: Beep periodically, toggling the buzzer every 100 ms without
+  // blocking so the disarm command is still read promptly
+  if (millis() - g_stateTimer >= 100) {
+    g_stateTimer = millis();
+    digitalWrite(BUZZER_PIN, !digitalRead(BUZZER_PIN));
+  }
 
   // Trigger: Disarm via serial command
   if (input_readSerial() == "DISARM") {
+    digitalWrite(BUZZER_PIN, LOW);
     enterState_Locked();
   }
 }
@@ -259,6 +267,7 @@ void enterState_ShowingMessage(String msg, int duration, State prevState) {
 
 void enterState_Alarm() {
   currentState = STATE_ALARM;
+  g_stateTimer = millis(); // Start the buzzer toggle timer
   output_updateLCD("!!! TAMPER !!!", "");
   output_signalToNodeMCU(false, true, false); // 0 1 0
 }
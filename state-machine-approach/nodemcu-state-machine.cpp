@@ -2,6 +2,9 @@
   PROJECT: Solar-Powered Smart Lock - NodeMCU Firebase Bridge (FSM Version)
   DESCRIPTION: This version uses a formal state machine to manage WiFi/Firebase
   connections and communication with the Arduino, making it non-blocking and resilient.
+  NOTE: this pair still speaks the original protocol, a bare 'L' or 'U' on
+  the serial line. It does not work with src/src_uno, which only obeys
+  signed AUTH lines, and its Arduino obeys anyone on its RX pin.
 */
 
 #include <ESP8266WiFi.h>
@@ -11,8 +14,14 @@
 #include <FirebaseESP8266.h>
 
 // --- FIREBASE CONFIG ---
-#define FIREBASE_HOST "https://smart-lock-app-4123a-default-rtdb.firebaseio.com/"
-#define FIREBASE_AUTH "HJY2VyeaNsORzCL5HFqUoiUwSGDErXsnxH0WCs5m"
+#if __has_include("../include/secrets.h")
+#include "../include/secrets.h" // FIREBASE_HOST, FIREBASE_AUTH
+#elif defined(SECRETS_EXAMPLE_OK) // CI only: a build that is never flashed
+#warning "include/secrets.h not found: building with the placeholders of secrets.example.h"
+#include "../include/secrets.example.h"
+#else
+#error "include/secrets.h not found: copy include/secrets.example.h and fill it in"
+#endif
 String lockPath = "/smart_lock";
 
 // --- PIN DEFINITIONS (from Arduino) ---
@@ -41,10 +50,18 @@ FirebaseAuth auth;
 unsigned long g_reconnectTimer = 0;
 unsigned long g_regModeTimer = 0;
 unsigned long g_tamperAlertTimer = 0;
+unsigned long g_heartbeatTimer = 0;
+unsigned long g_heartbeatAdvertised = 0; // interval behind the last staleAfterMs, 0 = none yet
+unsigned long g_lastActivity = 0;
 
 bool g_inRegMode = false;
 bool g_inTamperAlert = false;
 
+// Last isLocked value written to Firebase (-1 = not yet written). The Arduino
+// holds its signal for longer than one loop, so repeats are dropped here.
+int g_reportedLocked = -1;
+unsigned long g_suppressedWrites = 0;
+
 // =================================================================
 // --- SETUP & MAIN LOOP ---
 // =================================================================
@@ -112,6 +129,7 @@ void handleState_Operational() {
   // Handle non-blocking timers for temporary modes
   util_checkRegModeTimeout();
   util_checkTamperAlertTimeout();
+  util_checkHeartbeat();
 }
 
 void handleState_Disconnected() {
@@ -145,16 +163,19 @@ void enterState_FirebaseConnect() {
 
 void enterState_Operational() {
   currentState = STATE_OPERATIONAL;
+  g_reportedLocked = -1; // Firebase may have missed changes while we were offline
   util_logFirebaseSuccess("System Online and Operational.");
-  output_updateFirebaseBool("status/isOnline", true);
-  output_updateFirebaseInt("status/lastSeen", time(nullptr));
+  g_lastActivity = millis();
+  util_sendHeartbeat();
 }
 
 void enterState_Disconnected() {
   currentState = STATE_DISCONNECTED;
   g_reconnectTimer = millis(); // Start the retry timer
   Serial.println("WIFI_DISCONNECTED"); // Inform Arduino we are disconnected
-  output_updateFirebaseBool("status/isOnline", false);
+  // No point writing isOnline=false here: we only get here once the
+  // connection is gone. The app sees us as offline once lastSeen is older
+  // than the staleAfterMs we published with the last heartbeat.
 }
 
 // =================================================================
@@ -199,6 +220,7 @@ void util_handleFirebaseCommands() {
   if (Firebase.getString(fbdo, lockPath + "/command")) {
     String command = fbdo.stringData();
     if (command.length() > 0 && command != "null") {
+      g_lastActivity = millis();
       if (command == "lock") {
         output_sendToArduino('L');
         util_logFirebaseSuccess("Sent 'L' to Arduino");
@@ -215,10 +237,11 @@ void util_handleFirebaseCommands() {
 void util_handleArduinoSignal() {
   int signal = input_readArduinoSignal();
   if (signal == 0) return; // Ignore idle state
+  g_lastActivity = millis();
 
   switch (signal) {
     case 0b001: // Locked
-      output_updateFirebaseBool("status/isLocked", true);
+      util_reportLocked(true);
       break;
     case 0b010: // Tamper
       if (!g_inTamperAlert) {
@@ -228,7 +251,7 @@ void util_handleArduinoSignal() {
       }
       break;
     case 0b011: // Unlocked
-      output_updateFirebaseBool("status/isLocked", false);
+      util_reportLocked(false);
       break;
     case 0b100: // Registration Mode
       if (!g_inRegMode) {
@@ -247,6 +270,50 @@ void util_handleArduinoSignal() {
   }
 }
 
+void util_reportLocked(bool locked) {
+  if (g_reportedLocked == (int)locked) {
+    g_suppressedWrites++;
+    return;
+  }
+  g_reportedLocked = locked;
+  output_updateFirebaseBool("status/isLocked", locked);
+  output_updateFirebaseInt("status/suppressedWrites", g_suppressedWrites);
+}
+
+// Heartbeat every 15 s for two minutes after activity, every minute after
+// that, and every 5 minutes once the door has been quiet for 15 minutes
+unsigned long util_heartbeatInterval() {
+  unsigned long quiet = millis() - g_lastActivity;
+  if (quiet < 120000) return 15000;
+  if (quiet < 900000) return 60000;
+  return 300000;
+}
+
+// The next beat is due after the shorter of the interval we last advertised
+// and the current one, so a door going quiet never overruns staleAfterMs
+void util_checkHeartbeat() {
+  unsigned long interval = g_heartbeatAdvertised == 0
+      ? util_heartbeatInterval()
+      : min(util_heartbeatInterval(), g_heartbeatAdvertised);
+  if (millis() - g_heartbeatTimer > interval) {
+    util_sendHeartbeat();
+  }
+}
+
+void util_sendHeartbeat() {
+  unsigned long interval = util_heartbeatInterval();
+  g_heartbeatTimer = millis();
+  FirebaseJson json;
+  json.set("isOnline", true);
+  json.set("lastSeen/.sv", "timestamp");
+  json.set("staleAfterMs", (int)(interval * 5 / 2));
+  if (!Firebase.updateNodeSilent(fbdo, lockPath + "/status", json)) {
+    util_logFirebaseError("heartbeat");
+    return;
+  }
+  g_heartbeatAdvertised = interval;
+}
+
 void util_checkRegModeTimeout() {
   if (g_inRegMode && (millis() - g_regModeTimer > 60000)) {
     g_inRegMode = false;
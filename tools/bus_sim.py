@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Simulate the RS-485 gateway bus to see how it scales with door count.
+
+Models the NodeMCU gateway's turn schedule (GATEWAY_MODE in
+src/src_nodemcu/main.cpp) against a number of Unos generating events, and
+reports event latency (raised on the Uno -> line received by the gateway),
+command latency (queued on the gateway -> delivered to the door), the time
+for one round of the bus, and delivered events per second.
+
+    python3 tools/bus_sim.py --doors 1 2 4 8 16 --rate 0.2
+
+What is modelled:
+  - 115200 baud, 10 bits a byte, frames as the firmware sends them
+  - the gateway only services the bus every --tick-ms while idling, and not
+    at all while a Firebase request is in flight (--fb-block-ms of every
+    --fb-period-ms)
+  - each Uno answers after one loop pass (0.5-5 ms, sometimes an LCD
+    refresh of ~20 ms), and now and then sits in a blocking display delay
+    and misses its turn (50 ms timeout)
+  - doors with a queued command are served before the round robin
+"""
+import argparse
+import random
+
+BYTE_MS = 10 * 1000.0 / 115200
+POLL_FRAME = len("#03:?\n")
+END_FRAME = len("#03:.\r\n")
+EVENT_FRAME = len("#03:@MOVE,1,1,812\n")
+TURN_TIMEOUT_MS = 50
+OUTBOX_EVENTS = 192 // (EVENT_FRAME - 4)
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def uno_reply_delay(rng):
+    if rng.random() < 0.1:
+        return 20.0  # LCD refresh in that loop pass
+    return rng.uniform(0.5, 5.0)
+
+
+def simulate(doors, args, rng):
+    outbox = {d: [] for d in range(1, doors + 1)}   # event raise times
+    next_event = {d: rng.expovariate(args.rate) * 1000 for d in outbox}
+    commands = []                                    # (queued at, door)
+    next_command = rng.expovariate(args.command_rate) * 1000 if args.command_rate else None
+    blocked_until = {d: 0.0 for d in outbox}
+
+    event_latency, command_latency, rounds = [], [], []
+    delivered = dropped = 0
+    t = 0.0
+    rr = 1
+    round_start = 0.0
+    end = args.seconds * 1000.0
+
+    while t < end:
+        # Firebase requests hold up the whole loop
+        phase = t % args.fb_period_ms
+        if phase < args.fb_block_ms:
+            t += args.fb_block_ms - phase
+
+        for d in outbox:
+            while next_event[d] <= t:
+                if len(outbox[d]) < OUTBOX_EVENTS:
+                    outbox[d].append(next_event[d])
+                else:
+                    dropped += 1
+                next_event[d] += rng.expovariate(args.rate) * 1000
+            if rng.random() < args.block_chance:
+                blocked_until[d] = max(blocked_until[d], t + 2000)
+        while next_command is not None and next_command <= t:
+            commands.append((next_command, rng.randint(1, doors)))
+            next_command += rng.expovariate(args.command_rate) * 1000
+
+        if commands:
+            queued_at, door = commands[0]
+        else:
+            queued_at, door = None, rr
+            rr = rr % doors + 1
+            if rr == 1:
+                rounds.append(t - round_start)
+                round_start = t
+
+        t += POLL_FRAME * BYTE_MS
+        if t < blocked_until[door]:
+            t += TURN_TIMEOUT_MS
+        else:
+            t += uno_reply_delay(rng)
+            if queued_at is not None:
+                command_latency.append(t - queued_at)
+                commands.pop(0)
+            sent = [raised for raised in outbox[door] if raised <= t]
+            outbox[door] = [raised for raised in outbox[door] if raised > t]
+            for raised in sent:
+                t += EVENT_FRAME * BYTE_MS
+                event_latency.append(t - raised)
+                delivered += 1
+            t += END_FRAME * BYTE_MS
+        # The next turn starts on the gateway's next pass over the bus
+        t = (int(t / args.tick_ms) + 1) * args.tick_ms
+
+    return {
+        "events": delivered,
+        "dropped": dropped,
+        "per_s": delivered / args.seconds,
+        "ev50": percentile(event_latency, 50),
+        "ev99": percentile(event_latency, 99),
+        "cmd50": percentile(command_latency, 50),
+        "cmd99": percentile(command_latency, 99),
+        "round": sum(rounds) / len(rounds) if rounds else 0.0,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--doors", type=int, nargs="+", default=[1, 2, 4, 8, 16])
+    parser.add_argument("--rate", type=float, default=0.2, help="events per second per door")
+    parser.add_argument("--command-rate", type=float, default=0.1, help="commands per second, all doors")
+    parser.add_argument("--seconds", type=int, default=600)
+    parser.add_argument("--tick-ms", type=float, default=2.0, help="gateway bus service interval")
+    parser.add_argument("--fb-period-ms", type=float, default=1000.0)
+    parser.add_argument("--fb-block-ms", type=float, default=150.0)
+    parser.add_argument("--block-chance", type=float, default=0.0005, help="per turn, door busy for 2 s")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("doors  events/s  dropped  round ms  event p50/p99 ms  command p50/p99 ms")
+    for doors in args.doors:
+        r = simulate(doors, args, random.Random(args.seed))
+        print("%5d  %8.2f  %7d  %8.1f  %7.0f / %-7.0f  %8.0f / %-7.0f" % (
+            doors, r["per_s"], r["dropped"], r["round"], r["ev50"], r["ev99"], r["cmd50"], r["cmd99"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Push bursts of commands through the bridge's queue drain and measure it.
+
+Models handleFirebaseCommand() and acknowledgeCommands() in
+src/src_nodemcu/main.cpp against /commands and reports, per batch size:
+commands run per second while a burst drains, push-to-run and push-to-ack
+latency, commands run twice, and commands still queued at the end.
+
+    python3 tools/command_queue_sim.py --burst 20 --batch 1 2 4 8 --ack-fail 0.1
+
+What is modelled:
+  - the app pushes --burst commands --burst-gap-ms apart, every --period-s
+  - a poll is one GET of the first <batch> keys, --rtt-ms + --server-ms
+  - each returned command is run (a UART line, ~1 ms), then one PATCH acks
+    the batch; it fails with probability --ack-fail
+  - with a full batch the bridge polls again at once, else after --poll-ms
+  - --reset-rate warm resets per hour lose the pending ack but keep
+    lastDrainedKey (it is checkpointed)
+  - "before" is the drain without ack retries or stale deletes: a failed
+    ack leaves records that every later poll skips but that fill its window
+"""
+import argparse
+import random
+
+RUN_MS = 1.0
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def simulate(batch, fixed, args, rng):
+    def request_ms():
+        return args.rtt_ms + args.server_ms * rng.uniform(0.5, 1.5)
+
+    end = args.seconds * 1000.0
+    pushes = []  # (push time, key)
+    t = 0.0
+    key = 0
+    while t < end:
+        for i in range(args.burst):
+            pushes.append((t + i * args.burst_gap_ms, key))
+            key += 1
+        t += args.period_s * 1000.0
+
+    queue = {}          # key -> push time
+    ran = {}            # key -> run time
+    acked = {}          # key -> ack time
+    twice = 0
+    last_drained = -1
+    pending = []        # batch whose ack failed
+    next_reset = rng.expovariate(args.reset_rate / 3600000.0) if args.reset_rate else None
+    burst_spans = []
+    t = 0.0
+    i = 0
+
+    def ack(keys, now):
+        if rng.random() < args.ack_fail:
+            return False
+        for k in keys:
+            queue.pop(k, None)
+            acked.setdefault(k, now)
+        return True
+
+    while t < end:
+        while i < len(pushes) and pushes[i][0] <= t:
+            queue[pushes[i][1]] = pushes[i][0]
+            i += 1
+        if next_reset is not None and t >= next_reset:
+            pending = []  # RAM is gone; lastDrainedKey survives in RTC memory
+            next_reset += rng.expovariate(args.reset_rate / 3600000.0)
+
+        backlog = False
+        if fixed and pending:
+            t += request_ms()
+            if not ack(pending, t):
+                t += args.poll_ms
+                continue
+            pending = []
+
+        t += request_ms()
+        window = sorted(queue)[:batch]
+        fresh = [k for k in window if k > last_drained]
+        stale = [k for k in window if k <= last_drained] if fixed else []
+        for k in fresh:
+            t += RUN_MS
+            if k in ran:
+                twice += 1
+            ran.setdefault(k, t)
+        if fresh:
+            last_drained = fresh[-1]
+        if fresh or stale:
+            t += request_ms()
+            if not ack(fresh + stale, t) and fixed:
+                pending = fresh
+            backlog = len(window) == batch
+        if not backlog:
+            t += args.poll_ms
+
+    latency_run = [ran[k] - p for p, k in pushes if k in ran]
+    latency_ack = [acked[k] - p for p, k in pushes if k in acked]
+    # Drain rate: each burst from its first push to its last command run
+    for b in range(0, len(pushes), args.burst):
+        keys = [k for _, k in pushes[b:b + args.burst]]
+        if all(k in ran for k in keys):
+            burst_spans.append(max(ran[k] for k in keys) - pushes[b][0])
+    per_s = args.burst * 1000.0 / (sum(burst_spans) / len(burst_spans)) if burst_spans else 0.0
+    return {
+        "per_s": per_s,
+        "run50": percentile(latency_run, 50),
+        "run99": percentile(latency_run, 99),
+        "ack99": percentile(latency_ack, 99),
+        "twice": twice,
+        "left": len(queue),
+        "unrun": len(pushes) - len(ran),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--batch", type=int, nargs="+", default=[1, 2, 4, 8])
+    parser.add_argument("--burst", type=int, default=20, help="commands per burst")
+    parser.add_argument("--burst-gap-ms", type=float, default=50.0)
+    parser.add_argument("--period-s", type=float, default=60.0)
+    parser.add_argument("--rtt-ms", type=float, default=250.0)
+    parser.add_argument("--server-ms", type=float, default=150.0)
+    parser.add_argument("--poll-ms", type=float, default=1000.0)
+    parser.add_argument("--ack-fail", type=float, default=0.05, help="chance an ack write fails")
+    parser.add_argument("--reset-rate", type=float, default=0.5, help="warm resets per hour")
+    parser.add_argument("--seconds", type=int, default=3600)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("bursts of %d every %d s, ack failure %.0f%%, %.1f resets/h" % (
+        args.burst, args.period_s, args.ack_fail * 100, args.reset_rate))
+    print("drain   batch  commands/s  run p50/p99 ms    ack p99 ms  run twice  never run  left queued")
+    for fixed in (True, False):
+        for batch in args.batch:
+            r = simulate(batch, fixed, args, random.Random(args.seed))
+            print("%-6s  %5d  %10.2f  %6.0f / %-7.0f  %10.0f  %9d  %9d  %11d" % (
+                "fixed" if fixed else "before", batch, r["per_s"], r["run50"], r["run99"],
+                r["ack99"], r["twice"], r["unrun"], r["left"]))
+
+
+if __name__ == "__main__":
+    main()
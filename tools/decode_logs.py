@@ -0,0 +1,112 @@
+#!/usr/bin/env python3
+"""Decode diagnostic log batches uploaded by the NodeMCU bridge.
+
+Batches are pushed under /smart_lock/logs as {"b": "<base64>"}. Pass either
+base64 strings or a JSON export of that node (a file path or "-" for stdin):
+
+    python3 tools/decode_logs.py logs.json
+    python3 tools/decode_logs.py AQCA...
+"""
+import base64
+import datetime
+import json
+import sys
+
+LEVELS = ["INFO", "WARN", "ERROR", "?"]
+
+# Must match enum LogCode in src/src_nodemcu/main.cpp
+CODES = [
+    "BOOT",
+    "SETUP_NOT_READY",
+    "SET_ONLINE_FAILED",
+    "SET_LAST_SEEN_FAILED",
+    "COMMAND_REJECTED",
+    "COMMAND_ACK_FAILED",
+    "SIGNAL_LOCKED",
+    "SIGNAL_UNLOCKED",
+    "SIGNAL_TAMPER",
+    "SIGNAL_REGISTRATION",
+    "SIGNAL_UNKNOWN",
+    "SERVO_MOVE_FAILED",
+    "SHADOW_SYNC_FAILED",
+    "SET_BOOL_FAILED",
+    "UPLOAD_FAILED",
+    "RESET",
+    "CARD_DENIED",
+    "DOOR_FORCED",
+    "RULE_FIRED",
+    "AUTH_REJECTED",
+    "LINE_DROPPED",
+]
+
+
+def read_varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7F) << shift
+        if byte < 0x80:
+            return value, pos
+        shift += 7
+
+
+def decode_batch(text):
+    data = base64.b64decode(text)
+    if data[0] != 1:
+        raise ValueError("unsupported log format version %d" % data[0])
+    boot_epoch, pos = read_varint(data, 1)
+    dropped, pos = read_varint(data, pos)
+    count, pos = read_varint(data, pos)
+
+    records = []
+    ms = 0
+    for _ in range(count):
+        head = data[pos]
+        delta, pos = read_varint(data, pos + 1)
+        repeats, pos = read_varint(data, pos)
+        zigzag, pos = read_varint(data, pos)
+        ms += delta
+        records.append({
+            "ms": ms,
+            "level": LEVELS[head >> 6],
+            "code": CODES[head & 0x3F] if (head & 0x3F) < len(CODES) else "CODE_%d" % (head & 0x3F),
+            "repeats": repeats,
+            "arg": (zigzag >> 1) ^ -(zigzag & 1),
+        })
+    return boot_epoch, dropped, records
+
+
+def format_time(boot_epoch, ms):
+    if boot_epoch == 0:
+        return "+%10.3fs" % (ms / 1000.0)
+    stamp = datetime.datetime.fromtimestamp(boot_epoch + ms / 1000.0, datetime.timezone.utc)
+    return stamp.strftime("%Y-%m-%d %H:%M:%S.%f")[:-3] + "Z"
+
+
+def batches_from_args(args):
+    for arg in args:
+        if arg == "-" or arg.endswith(".json"):
+            with (sys.stdin if arg == "-" else open(arg)) as f:
+                node = json.load(f)
+            for key in sorted(node):
+                yield key, node[key]["b"]
+        else:
+            yield "arg", arg
+
+
+def main(argv):
+    if len(argv) < 2:
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    for key, text in batches_from_args(argv[1:]):
+        boot_epoch, dropped, records = decode_batch(text)
+        print("# batch %s: %d records, %d dropped before upload" % (key, len(records), dropped))
+        for r in records:
+            repeats = " (x%d)" % (r["repeats"] + 1) if r["repeats"] else ""
+            print("%s %-5s %-22s arg=%d%s" % (format_time(boot_epoch, r["ms"]), r["level"], r["code"], r["arg"], repeats))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
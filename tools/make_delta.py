@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""Build a firmware delta for the NodeMCU bridge's over-the-air update.
+
+The delta turns the image the bridge is running (base) into a new one
+(target). Upload it next to the full image and point /smart_lock/ota at both:
+
+    python3 tools/make_delta.py old.bin new.bin new.delta
+    # bridge: {"version": "...", "deltaUrl": ".../new.delta",
+    #          "baseMd5": "<md5 of old.bin>", "fullUrl": ".../new.bin.gz"}
+
+Format (must match applyDelta() in src/src_nodemcu/main.cpp):
+    "SLD1", u32 base size, u32 target size (little endian), then opcodes
+    0x00 end
+    0x01 copy from base: varint offset, varint length
+    0x02 copy from output: varint distance (<= 2048), varint length
+    0x03 literal: varint length, bytes
+"""
+import hashlib
+import struct
+import sys
+
+END, COPY_BASE, COPY_BACK, LITERAL = 0, 1, 2, 3
+WINDOW = 2048
+BLOCK = 8
+MIN_MATCH = 12
+
+
+def varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7F) | 0x80)
+        value >>= 7
+    out.append(value)
+    return bytes(out)
+
+
+def index_blocks(data, step):
+    table = {}
+    for pos in range(0, len(data) - BLOCK + 1, step):
+        table.setdefault(data[pos:pos + BLOCK], pos)
+    return table
+
+
+def match_length(a, a_pos, b, b_pos, limit):
+    n = 0
+    while n < limit and a_pos + n < len(a) and b_pos + n < len(b) and a[a_pos + n] == b[b_pos + n]:
+        n += 1
+    return n
+
+
+def make_delta(base, target):
+    base_index = index_blocks(base, 1)
+    out = bytearray(b"SLD1" + struct.pack("<II", len(base), len(target)))
+    literal = bytearray()
+
+    def flush_literal():
+        if literal:
+            out.extend(bytes([LITERAL]) + varint(len(literal)) + literal)
+            literal.clear()
+
+    pos = 0
+    recent = {}
+    while pos < len(target):
+        key = target[pos:pos + BLOCK]
+        best_op, best_arg, best_len = None, 0, 0
+
+        if key in base_index:
+            start = base_index[key]
+            n = match_length(base, start, target, pos, len(target))
+            best_op, best_arg, best_len = COPY_BASE, start, n
+
+        back = recent.get(key)
+        if back is not None and pos - back <= WINDOW:
+            # Overlapping copies are fine: the bridge copies byte by byte
+            n = match_length(target, back, target, pos, len(target))
+            if n > best_len:
+                best_op, best_arg, best_len = COPY_BACK, pos - back, n
+
+        if best_len >= MIN_MATCH:
+            flush_literal()
+            out.extend(bytes([best_op]) + varint(best_arg) + varint(best_len))
+            for p in range(pos, min(pos + best_len, len(target) - BLOCK + 1)):
+                recent[target[p:p + BLOCK]] = p
+            pos += best_len
+        else:
+            if len(key) == BLOCK:
+                recent[key] = pos
+            literal.append(target[pos])
+            pos += 1
+
+    flush_literal()
+    out.append(END)
+    return bytes(out)
+
+
+def apply_delta(base, delta):
+    """Reference decoder, used to check every delta before it is written."""
+    magic, base_size, target_size = delta[:4], *struct.unpack("<II", delta[4:12])
+    assert magic == b"SLD1" and base_size == len(base)
+    out = bytearray()
+    pos = 12
+
+    def read_varint():
+        nonlocal pos
+        value = shift = 0
+        while True:
+            byte = delta[pos]
+            pos += 1
+            value |= (byte & 0x7F) << shift
+            if byte < 0x80:
+                return value
+            shift += 7
+
+    while True:
+        op = delta[pos]
+        pos += 1
+        if op == END:
+            break
+        if op == COPY_BASE:
+            offset, length = read_varint(), read_varint()
+            out.extend(base[offset:offset + length])
+        elif op == COPY_BACK:
+            distance, length = read_varint(), read_varint()
+            for _ in range(length):
+                out.append(out[-distance])
+        elif op == LITERAL:
+            length = read_varint()
+            out.extend(delta[pos:pos + length])
+            pos += length
+        else:
+            raise ValueError("bad opcode %d" % op)
+    assert len(out) == target_size
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 4:
+        print(__doc__)
+        sys.exit(1)
+    with open(sys.argv[1], "rb") as f:
+        base = f.read()
+    with open(sys.argv[2], "rb") as f:
+        target = f.read()
+
+    delta = make_delta(base, target)
+    if apply_delta(base, delta) != target:
+        sys.exit("delta does not reproduce the target image")
+    with open(sys.argv[3], "wb") as f:
+        f.write(delta)
+
+    print("base md5   %s" % hashlib.md5(base).hexdigest())
+    print("target     %d bytes" % len(target))
+    print("delta      %d bytes (%.1f%%)" % (len(delta), 100.0 * len(delta) / max(len(target), 1)))
+
+
+if __name__ == "__main__":
+    main()
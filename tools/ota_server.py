@@ -0,0 +1,260 @@
+#!/usr/bin/env python3
+"""Serve an OTA release locally, and test the bridge's update checks against it.
+
+    python3 tools/ota_server.py serve --base old.bin --bridge new.bin --uno uno.bin
+    python3 tools/ota_server.py test --kbps 400
+
+serve: builds the delta with tools/make_delta.py, hashes everything, serves
+the files over plain HTTP (the bridge downloads with a WiFiClient) and
+prints the /smart_lock/ota document to paste into Firebase, with the
+md5/fullMd5/size/sha256 fields runRequestedUpdate() now requires. Every
+download is logged with its size and time.
+
+test: runs the same server in a thread (on synthetic images unless given
+real ones) and a client that takes each decision runRequestedUpdate() and
+its helpers take:
+  - no hash in /ota: the update is refused before anything is fetched
+  - delta: applied to the base, the result must match md5 (Update.setMD5)
+  - full image: the file must match fullMd5
+  - Uno: staged in full, then size and sha256 checked before programUno()
+and the same again with a corrupted file, which must be refused. It ends
+with the delta-vs-full report: bytes over the air, time at --kbps (the
+ESP8266's plain-HTTP rate, not the host's), and bytes written to flash.
+"""
+import argparse
+import gzip
+import hashlib
+import http.server
+import json
+import os
+import random
+import sys
+import tempfile
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from make_delta import apply_delta, make_delta  # noqa: E402
+
+UNO_APP_MAX_BYTES = 32256
+
+
+def release(root, base, bridge, uno, version, url):
+    """Writes the release files to root and returns the /ota document."""
+    delta = make_delta(base, bridge)
+    full = gzip.compress(bridge, 9)
+    files = {"bridge.delta": delta, "bridge.bin.gz": full, "uno.bin": uno}
+    for name, data in files.items():
+        with open(os.path.join(root, name), "wb") as f:
+            f.write(data)
+    ota = {
+        "bridge": {
+            "version": version,
+            "deltaUrl": url + "bridge.delta",
+            "baseMd5": hashlib.md5(base).hexdigest(),
+            "md5": hashlib.md5(bridge).hexdigest(),
+            "fullUrl": url + "bridge.bin.gz",
+            "fullMd5": hashlib.md5(full).hexdigest(),
+        },
+        "uno": {
+            "version": version,
+            "url": url + "uno.bin",
+            "size": len(uno),
+            "sha256": hashlib.sha256(uno).hexdigest(),
+        },
+    }
+    return ota
+
+
+def start_server(root, port, kbps, log):
+    class Handler(http.server.SimpleHTTPRequestHandler):
+        def __init__(self, *args, **kwargs):
+            super().__init__(*args, directory=root, **kwargs)
+
+        def copyfile(self, source, output):
+            # Paced to the link rate, so the timings mean something
+            start = time.perf_counter()
+            sent = 0
+            while True:
+                chunk = source.read(1460)
+                if not chunk:
+                    break
+                output.write(chunk)
+                sent += len(chunk)
+                if kbps:
+                    ahead = sent * 8 / (kbps * 1000.0) - (time.perf_counter() - start)
+                    if ahead > 0:
+                        time.sleep(ahead)
+            log.append((self.path, sent, (time.perf_counter() - start) * 1000))
+
+        def log_message(self, *args):
+            pass
+
+    server = http.server.ThreadingHTTPServer(("0.0.0.0", port), Handler)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    return server
+
+
+def fetch(url):
+    from urllib.request import urlopen
+    with urlopen(url) as response:
+        return response.read()
+
+
+def update_bridge(ota, running):
+    """runRequestedUpdate()'s bridge half; returns (mode, image or None, error)."""
+    b = ota["bridge"]
+    if ("deltaUrl" in b and len(b.get("md5", "")) != 32) or ("fullUrl" in b and len(b.get("fullMd5", "")) != 32):
+        return "delta", None, "no hash"
+    if "deltaUrl" in b and b["baseMd5"] == hashlib.md5(running).hexdigest():
+        try:
+            image = apply_delta(running, fetch(b["deltaUrl"]))
+            if hashlib.md5(image).hexdigest() == b["md5"]:
+                return "delta", image, None
+        except (AssertionError, ValueError, IndexError):
+            pass
+    if "fullUrl" in b:
+        data = fetch(b["fullUrl"])
+        if hashlib.md5(data).hexdigest() == b["fullMd5"]:
+            return "full", gzip.decompress(data), None  # eboot inflates it
+        return "full", None, "md5 mismatch"
+    return "delta", None, "md5 mismatch"
+
+
+def update_uno(ota):
+    """flashUno(): stage, then check size and sha256 before programming."""
+    u = ota["uno"]
+    if len(u.get("sha256", "")) != 64 or not u.get("size"):
+        return None, "no hash"
+    if u["size"] > UNO_APP_MAX_BYTES:
+        return None, "too large"
+    data = fetch(u["url"])
+    if len(data) != u["size"]:
+        return None, "size mismatch"
+    if hashlib.sha256(data).hexdigest() != u["sha256"]:
+        return None, "hash mismatch"
+    return data, None
+
+
+def synthetic_images(seed):
+    rng = random.Random(seed)
+    # Code-like: repeated instruction patterns with varying operands
+    words = [rng.getrandbits(32).to_bytes(4, "little") for _ in range(512)]
+    base = b"".join(rng.choice(words) for _ in range(100000))
+    bridge = bytearray(base)
+    for _ in range(40):  # a handful of edits, some of which move code
+        pos = rng.randrange(len(bridge))
+        if rng.random() < 0.5:
+            bridge[pos:pos] = bytes(rng.getrandbits(8) for _ in range(rng.randrange(16, 400)))
+        else:
+            bridge[pos:pos + 64] = bytes(rng.getrandbits(8) for _ in range(64))
+    uno = bytes(rng.getrandbits(8) for _ in range(28000))
+    return base, bytes(bridge), uno
+
+
+def corrupt(root, name):
+    path = os.path.join(root, name)
+    with open(path, "r+b") as f:
+        f.seek(os.path.getsize(path) // 2)
+        byte = f.read(1)
+        f.seek(-1, os.SEEK_CUR)
+        f.write(bytes([byte[0] ^ 0x40]))
+
+
+def test(args):
+    if args.base:
+        base, bridge, uno = (open(p, "rb").read() for p in (args.base, args.bridge, args.uno))
+    else:
+        base, bridge, uno = synthetic_images(args.seed)
+    log = []
+    root = tempfile.mkdtemp(prefix="smart_lock_ota_")
+    server = start_server(root, 0, args.kbps, log)
+    ota = release(root, base, bridge, uno, "test", "http://127.0.0.1:%d/" % server.server_address[1])
+
+    failures = 0
+
+    def check(name, ok):
+        nonlocal failures
+        failures += 0 if ok else 1
+        print("%-44s %s" % (name, "ok" if ok else "FAILED"))
+
+    stripped = json.loads(json.dumps(ota))
+    del stripped["bridge"]["md5"]
+    del stripped["uno"]["sha256"]
+    check("bridge refused without md5", update_bridge(stripped, base)[2] == "no hash")
+    check("uno refused without sha256", update_uno(stripped)[1] == "no hash")
+
+    mode, image, error = update_bridge(ota, base)
+    check("bridge takes the delta and it matches md5", mode == "delta" and image == bridge)
+    mode, image, error = update_bridge(ota, base + b"\0")
+    check("other base: falls back to the full image", mode == "full" and image == bridge)
+    image, error = update_uno(ota)
+    check("uno image staged and verified", image == uno)
+
+    corrupt(root, "bridge.delta")
+    mode, image, error = update_bridge(ota, base)
+    check("corrupt delta: rejected, full image used", mode == "full" and image == bridge)
+    corrupt(root, "bridge.bin.gz")
+    check("corrupt full image: rejected", update_bridge(ota, base + b"\0")[1] is None)
+    corrupt(root, "uno.bin")
+    check("corrupt uno image: never programmed", update_uno(ota) == (None, "hash mismatch"))
+    server.shutdown()
+
+    # Transfer time is the first, intact download of each file as served
+    first = {}
+    for path, size, ms in log:
+        first.setdefault(path.lstrip("/"), (size, ms))
+    print()
+    print("bridge image %d bytes, %s" % (len(bridge), "%d kbit/s" % args.kbps if args.kbps else "unpaced"))
+    print("mode   over the air  % of image  transfer s  flash written")
+    for mode, name in (("delta", "bridge.delta"), ("full", "bridge.bin.gz")):
+        size, ms = first[name]
+        # Full: the gzip goes to the staging area, then eboot writes the image
+        flash = len(bridge) + (size if mode == "full" else 0)
+        print("%-5s  %12d  %9.1f%%  %10.2f  %13d" % (mode, size, 100.0 * size / len(bridge), ms / 1000.0, flash))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="command", required=True)
+    for name in ("serve", "test"):
+        p = sub.add_parser(name)
+        p.add_argument("--base", help="the bridge image now running")
+        p.add_argument("--bridge", help="the new bridge image")
+        p.add_argument("--uno", help="the new Uno image (avr-objcopy -O binary)")
+        p.add_argument("--kbps", type=int, default=400 if name == "test" else 0,
+                       help="pace downloads to this link rate, 0 = unpaced")
+    sub.choices["serve"].add_argument("--port", type=int, default=8266)
+    sub.choices["serve"].add_argument("--host", default="127.0.0.1", help="address the bridge reaches us on")
+    sub.choices["serve"].add_argument("--version", default="dev")
+    sub.choices["test"].add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    if args.command == "test":
+        if args.base and not (args.bridge and args.uno):
+            parser.error("--base needs --bridge and --uno")
+        sys.exit(1 if test(args) else 0)
+
+    if not (args.base and args.bridge and args.uno):
+        parser.error("serve needs --base, --bridge and --uno")
+    base, bridge, uno = (open(p, "rb").read() for p in (args.base, args.bridge, args.uno))
+    root = tempfile.mkdtemp(prefix="smart_lock_ota_")
+    ota = release(root, base, bridge, uno, args.version, "http://%s:%d/" % (args.host, args.port))
+    log = []
+    start_server(root, args.port, args.kbps, log)
+    print(json.dumps(ota, indent=2))
+    print("serving %s on port %d (Ctrl-C to stop)" % (root, args.port))
+    try:
+        seen = 0
+        while True:
+            time.sleep(0.5)
+            for path, size, ms in log[seen:]:
+                print("GET %s: %d bytes in %.0f ms" % (path, size, ms))
+            seen = len(log)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""Compare blocking Firebase writes with the bridge's pipelined async path.
+
+Models the NodeMCU loop (src/src_nodemcu/main.cpp) against a slow backend
+and reports, for blocking writes and for the async ring at several pipeline
+depths: status writes per second, write latency (raised -> answered), how
+long the UART went unread between idle ticks, and how many 2 s signal-line
+pulses from the Uno were missed because loop() did not come round in time.
+
+    python3 tools/pipeline_sim.py --rtt-ms 250 --server-ms 150 --rate 2
+
+What is modelled:
+  - a command poll every --poll-ms that blocks in every mode (it stays on
+    fbdo), --rtt-ms + --server-ms each
+  - status writes raised at --rate per second; blocking mode runs each one
+    in the loop, async mode queues it in a ring of --ring slots (a full ring
+    falls back to a blocking write, as fbUpdateNodeAsync() does)
+  - on the async connection the server answers requests in order, one at a
+    time, each --server-ms (+-50% jitter) after it arrives; up to --depth of
+    them are in flight
+  - loop() polls, samples the signal lines, then idles for --poll-ms in
+    10 ms ticks that read the UART (and write or queue what it raised) and
+    service the ring
+"""
+import argparse
+import random
+
+TICK_MS = 10.0
+PULSE_MS = 2000.0  # the Uno holds the signal lines this long
+WRITE_MS = 2.0     # writing one request into the TLS socket
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def simulate(depth, args, rng):
+    """depth 0 = blocking writes."""
+    def server_ms():
+        return args.server_ms * rng.uniform(0.5, 1.5)
+
+    end = args.seconds * 1000.0
+    raised = []
+    t = rng.expovariate(args.rate) * 1000
+    while t < end:
+        raised.append(t)
+        t += rng.expovariate(args.rate) * 1000
+    pulses = []
+    t = rng.expovariate(args.pulse_rate) * 1000
+    while t < end:
+        pulses.append(t)
+        t += max(PULSE_MS * 2, rng.expovariate(args.pulse_rate) * 1000)
+
+    ticks = []       # idle ticks: the UART and the ring are serviced
+    samples = []     # loop passes: the signal lines are sampled
+    latency = []
+    ring = []        # raise times not yet sent
+    in_flight = []   # (raise time, answer time)
+    server_free = 0.0
+    done = 0
+    t = 0.0
+    i = 0
+
+    while t < end:
+        # loop(): the command poll, then the signal lines, then idleFor()
+        t += args.rtt_ms + server_ms()
+        samples.append(t)
+        idle_end = t + args.poll_ms
+        while t < idle_end:
+            ticks.append(t)
+            now = t
+            while i < len(raised) and raised[i] <= now:
+                if depth == 0 or len(ring) + len(in_flight) >= args.ring:
+                    t += args.rtt_ms + server_ms()  # blocking write
+                    latency.append(t - raised[i])
+                    done += 1
+                else:
+                    ring.append(raised[i])
+                i += 1
+            if depth:
+                # Answers that have arrived, then top the pipeline back up
+                while in_flight and in_flight[0][1] <= t:
+                    latency.append(t - in_flight[0][0])
+                    in_flight.pop(0)
+                    done += 1
+                while ring and len(in_flight) < depth:
+                    t += WRITE_MS
+                    start = max(t + args.rtt_ms / 2, server_free)
+                    server_free = start + server_ms()
+                    in_flight.append((ring.pop(0), server_free + args.rtt_ms / 2))
+            t += TICK_MS
+
+    gaps = [b - a for a, b in zip(ticks, ticks[1:])]
+    missed = 0
+    j = 0
+    for start in pulses:
+        while j < len(samples) and samples[j] < start:
+            j += 1
+        if j == len(samples) or samples[j] >= start + PULSE_MS:
+            missed += 1
+    return {
+        "per_s": done / args.seconds,
+        "lat50": percentile(latency, 50),
+        "lat99": percentile(latency, 99),
+        "gap99": percentile(gaps, 99),
+        "gapmax": max(gaps) if gaps else 0.0,
+        "missed": missed,
+        "pulses": len(pulses),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--depth", type=int, nargs="+", default=[1, 2, 4], help="async pipeline depths")
+    parser.add_argument("--rate", type=float, default=2.0, help="status writes per second")
+    parser.add_argument("--rtt-ms", type=float, default=250.0)
+    parser.add_argument("--server-ms", type=float, default=150.0)
+    parser.add_argument("--poll-ms", type=float, default=1000.0)
+    parser.add_argument("--ring", type=int, default=6)
+    parser.add_argument("--pulse-rate", type=float, default=0.05, help="signal-line pulses per second")
+    parser.add_argument("--seconds", type=int, default=600)
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("rtt %d ms, server %d ms, %.1f writes/s offered" % (args.rtt_ms, args.server_ms, args.rate))
+    print("mode      writes/s  latency p50/p99 ms  UART gap p99/max ms  missed pulses")
+    for depth in [0] + args.depth:
+        r = simulate(depth, args, random.Random(args.seed))
+        name = "blocking" if depth == 0 else "async x%d" % depth
+        print("%-9s %8.2f  %7.0f / %-7.0f   %7.0f / %-7.0f   %5d / %d" % (
+            name, r["per_s"], r["lat50"], r["lat99"], r["gap99"], r["gapmax"], r["missed"], r["pulses"]))
+
+
+if __name__ == "__main__":
+    main()
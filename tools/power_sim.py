@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""Simulate days of solar charge/discharge with and without low-power mode.
+
+Steps a battery through a run of sunny and overcast days in 1-minute steps
+and compares uptime for the lock running flat out against the lock switching
+to low-power mode below 20% charge (and back above 35%), as the bridge's
+applyPowerPolicy() does.
+
+    python3 tools/power_sim.py --days 14 --capacity 2000 --panel-ma 500
+
+The load figures are estimates for an Uno + LCD + NodeMCU; replace them with
+measurements from the fitted hardware (status/power and /telemetry give the
+battery side of that).
+"""
+import argparse
+import math
+import random
+
+LOW_SOC_ENTER = 20
+LOW_SOC_EXIT = 35
+RESTART_SOC = 5  # brown-out: the lock stays down until the battery is back here
+
+# Average draw in mA at the battery
+UNO_MA = 45
+BACKLIGHT_MA = 20
+BACKLIGHT_LOW_POWER_DUTY = 0.05  # on for 15 s after each key or card
+BRIDGE_MA = 75                   # modem sleep, polling Firebase every second
+BRIDGE_LOW_POWER_MA = 35         # polling every 5 s, 15 min heartbeats
+
+
+def load_ma(low_power):
+    if low_power:
+        return UNO_MA + BACKLIGHT_MA * BACKLIGHT_LOW_POWER_DUTY + BRIDGE_LOW_POWER_MA
+    return UNO_MA + BACKLIGHT_MA + BRIDGE_MA
+
+
+def sun(minute_of_day, clearness):
+    """Fraction of peak panel output: half a sine between 06:00 and 18:00."""
+    hour = minute_of_day / 60.0
+    if hour < 6 or hour > 18:
+        return 0.0
+    return math.sin(math.pi * (hour - 6) / 12) * clearness
+
+
+def simulate(days, capacity_mah, panel_ma, policy, weather):
+    charge = capacity_mah * 0.5
+    up = True
+    low_power = False
+    up_minutes = 0
+    for day in range(days):
+        for minute in range(24 * 60):
+            soc = 100.0 * charge / capacity_mah
+            if policy:
+                low_power = soc < (LOW_SOC_EXIT if low_power else LOW_SOC_ENTER)
+            if not up and soc >= RESTART_SOC:
+                up = True
+
+            draw = load_ma(low_power) if up else 0
+            charge += (panel_ma * sun(minute, weather[day]) - draw) / 60.0
+            charge = min(charge, capacity_mah)
+            if charge <= 0:
+                charge = 0
+                up = False
+            if up:
+                up_minutes += 1
+    return up_minutes
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--days", type=int, default=14)
+    parser.add_argument("--capacity", type=float, default=2000, help="battery mAh")
+    parser.add_argument("--panel-ma", type=float, default=500, help="peak charge current")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    rng = random.Random(args.seed)
+    # Clearness per day: mostly fair, with overcast spells
+    weather = [rng.choice([1.0, 0.9, 0.7, 0.4, 0.2, 0.1]) for _ in range(args.days)]
+
+    total = args.days * 24 * 60
+    baseline = simulate(args.days, args.capacity, args.panel_ma, False, weather)
+    managed = simulate(args.days, args.capacity, args.panel_ma, True, weather)
+
+    print("days %d, battery %d mAh, panel %d mA peak" % (args.days, args.capacity, args.panel_ma))
+    print("weather  %s" % " ".join("%.1f" % w for w in weather))
+    print("always on   uptime %6.2f%%" % (100.0 * baseline / total))
+    print("low power   uptime %6.2f%%" % (100.0 * managed / total))
+    print("gained      %.1f hours" % ((managed - baseline) / 60.0))
+
+
+if __name__ == "__main__":
+    main()
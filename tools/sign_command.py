@@ -0,0 +1,53 @@
+#!/usr/bin/env python3
+"""Sign a command for the Uno, the way the bridge's sendSignedLine() does.
+
+The Uno no longer obeys a bare L or U, nor any other command that changes
+the lock or its settings (CFG, CFG_COMMIT, KEYPAD_LOCK, GUEST, SCHED,
+CARDS_CLEAR); on the bench, paste the printed line into a serial monitor
+(115200, newline) instead. The key is the door's 32-byte key from
+include/secrets.h (DOOR_KEY_<door>), written as hex.
+
+    python3 tools/sign_command.py --key 545dd805...702f U
+    python3 tools/sign_command.py --key ... --door 3 --counter 68f2a1c1 "SCHED 0 420 U"
+
+Format (must match verifyCommandTag() in src/src_uno/main.cpp):
+    AUTH <counter, 8 hex> <tag, 16 hex> <command>
+    tag = HMAC-SHA256(key, door byte || counter u32 big endian || command)[:8]
+The counter must be higher than the last one the door accepted; the bridge
+uses the epoch second, so the default is the current time.
+"""
+import argparse
+import hashlib
+import hmac
+import struct
+import time
+
+TAG_BYTES = 8
+COMMAND_MAX = 27  # the bridge's AUTH_COMMAND_LENGTH, less the terminator
+
+
+def sign(key, door, counter, command):
+    message = bytes([door]) + struct.pack(">I", counter) + command.encode()
+    tag = hmac.new(key, message, hashlib.sha256).digest()[:TAG_BYTES]
+    return "AUTH %08x %s %s" % (counter, tag.hex(), command)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("command", help='L, U, or a line such as "CFG autoLockMs=30000"')
+    parser.add_argument("--key", required=True, help="64 hex digits")
+    parser.add_argument("--door", type=int, default=1, help="1, or the bus address in gateway mode")
+    parser.add_argument("--counter", type=lambda v: int(v, 16), default=None, help="hex; default: epoch seconds")
+    args = parser.parse_args()
+
+    key = bytes.fromhex(args.key.replace("0x", "").replace(",", "").replace(" ", ""))
+    if len(key) != 32:
+        parser.error("the key must be 32 bytes")
+    if not 0 < len(args.command) <= COMMAND_MAX:
+        parser.error("the command must be 1 to %d characters" % COMMAND_MAX)
+    counter = args.counter if args.counter is not None else int(time.time())
+    print(sign(key, args.door, counter, args.command))
+
+
+if __name__ == "__main__":
+    main()
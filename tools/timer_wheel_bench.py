@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Benchmark the Uno's timer wheel against scanning every timer each tick.
+
+Runs the hierarchical wheel from src/src_uno/main.cpp (128 ms ticks, five
+levels of 16 slots) with hundreds of timers that keep re-arming, next to the
+obvious alternative: a list of deadlines that loop() scans every tick. It
+reports, per tick, how many timers each one has to touch (the cost that
+matters on an AVR) and the host time per tick, and checks that every timer
+fires on exactly the tick it was due, with the tick counter starting just
+short of 2^32 so the run crosses the wraparound.
+
+    python3 tools/timer_wheel_bench.py --timers 50 200 800 --ticks 200000
+
+What is modelled:
+  - deadlines drawn log-uniformly from one tick to --max-hours, like the
+    firmware's mix of seconds-long PIN timeouts and day-long schedules
+  - each timer re-arms with a new deadline when it fires, and --rearm of
+    them are moved early each tick (a key press pushing the PIN timeout on)
+"""
+import argparse
+import math
+import random
+import time
+
+TICK_MS = 128
+SLOT_BITS = 4
+SLOTS = 1 << SLOT_BITS
+LEVELS = 5
+MAX_TICKS = (1 << (SLOT_BITS * LEVELS)) - 1
+MASK = 0xFFFFFFFF
+
+
+class Wheel:
+    """Mirrors armTimer(), cancelTimer(), linkTimer() and advanceTimers()."""
+
+    def __init__(self, count, start_tick):
+        self.tick = start_tick
+        self.due = [0] * count
+        self.bucket = [None] * count
+        self.slots = [set() for _ in range(LEVELS * SLOTS)]
+        self.touched = 0
+
+    def arm(self, timer, ticks):
+        self.cancel(timer)
+        ticks = min(max(ticks, 1), MAX_TICKS)
+        self.due[timer] = (self.tick + ticks) & MASK
+        self.link(timer)
+
+    def cancel(self, timer):
+        if self.bucket[timer] is not None:
+            self.slots[self.bucket[timer]].discard(timer)
+            self.bucket[timer] = None
+
+    def link(self, timer):
+        ticks = (self.due[timer] - self.tick) & MASK
+        level = 0
+        while level < LEVELS - 1 and ticks >> (SLOT_BITS * (level + 1)):
+            level += 1
+        bucket = level * SLOTS + ((self.due[timer] >> (SLOT_BITS * level)) & (SLOTS - 1))
+        self.bucket[timer] = bucket
+        self.slots[bucket].add(timer)
+
+    def advance(self):
+        self.tick = (self.tick + 1) & MASK
+        for level in range(1, LEVELS):
+            if (self.tick >> (SLOT_BITS * (level - 1))) & (SLOTS - 1):
+                break
+            bucket = level * SLOTS + ((self.tick >> (SLOT_BITS * level)) & (SLOTS - 1))
+            moving = self.slots[bucket]
+            self.slots[bucket] = set()
+            for timer in moving:
+                self.touched += 1
+                self.link(timer)
+        fired = self.slots[self.tick & (SLOTS - 1)]
+        self.slots[self.tick & (SLOTS - 1)] = set()
+        for timer in fired:
+            self.touched += 1
+            self.bucket[timer] = None
+        return sorted(fired)
+
+
+class Scan:
+    """A deadline per timer, every one compared each tick."""
+
+    def __init__(self, count, start_tick):
+        self.tick = start_tick
+        self.due = [None] * count
+        self.touched = 0
+
+    def arm(self, timer, ticks):
+        self.due[timer] = (self.tick + min(max(ticks, 1), MAX_TICKS)) & MASK
+
+    def advance(self):
+        self.tick = (self.tick + 1) & MASK
+        fired = []
+        for timer, due in enumerate(self.due):
+            self.touched += 1
+            if due is not None and ((self.tick - due) & MASK) < 0x80000000:
+                self.due[timer] = None
+                fired.append(timer)
+        return fired
+
+
+def run(kind, count, args):
+    rng = random.Random(args.seed)
+    max_ticks = min(MAX_TICKS, int(args.max_hours * 3600000 / TICK_MS))
+
+    def deadline():
+        return int(math.exp(rng.uniform(0, math.log(max_ticks))))
+
+    timers = kind(count, (MASK + 1 - args.ticks // 2) & MASK)
+    due = {}
+    for timer in range(count):
+        ticks = deadline()
+        timers.arm(timer, ticks)
+        due[timer] = (timers.tick + max(ticks, 1)) & MASK
+
+    fired = late = worst = 0
+    start = time.perf_counter()
+    for _ in range(args.ticks):
+        before = timers.touched
+        for timer in timers.advance():
+            fired += 1
+            if due[timer] != timers.tick:
+                late += 1
+            ticks = deadline()
+            timers.arm(timer, ticks)
+            due[timer] = (timers.tick + max(ticks, 1)) & MASK
+        worst = max(worst, timers.touched - before)
+        for _ in range(args.rearm):
+            timer = rng.randrange(count)
+            ticks = deadline()
+            timers.arm(timer, ticks)
+            due[timer] = (timers.tick + max(ticks, 1)) & MASK
+    elapsed = time.perf_counter() - start
+    return {
+        "touched": timers.touched / args.ticks,
+        "worst": worst,
+        "us": elapsed * 1e6 / args.ticks,
+        "fired": fired,
+        "late": late,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--timers", type=int, nargs="+", default=[50, 200, 800])
+    parser.add_argument("--ticks", type=int, default=200000, help="ticks to run (200000 is about 7 h)")
+    parser.add_argument("--max-hours", type=float, default=36.0, help="longest deadline")
+    parser.add_argument("--rearm", type=int, default=1, help="timers moved early each tick")
+    parser.add_argument("--seed", type=int, default=1)
+    args = parser.parse_args()
+
+    print("%d ticks of %d ms, starting %d ticks before the 2^32 wrap" % (args.ticks, TICK_MS, args.ticks // 2))
+    print("timers  method  touched/tick avg  worst  host us/tick  fired  off-tick")
+    for count in args.timers:
+        for name, kind in (("wheel", Wheel), ("scan", Scan)):
+            r = run(kind, count, args)
+            print("%6d  %-6s  %16.2f  %5d  %12.2f  %5d  %8d" % (
+                count, name, r["touched"], r["worst"], r["us"], r["fired"], r["late"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,255 @@
+#!/usr/bin/env python3
+"""A local TLS stand-in for the Firebase REST API, and a bench against it.
+
+    python3 tools/tls_standin.py serve --port 8443
+    python3 tools/tls_standin.py bench --requests 60 --gap-ms 1000
+
+serve: answers GET/PUT/PATCH/POST/DELETE on <path>.json from an in-memory
+tree over HTTPS with HTTP/1.1 keep-alive, so the bridge can be pointed at it
+(FIREBASE_HOST "https://<host>:8443/" and FIREBASE_HOSTNAME in secrets.h;
+the client does not check the certificate). Every connection is logged with
+its handshake time and whether the TLS session was resumed, and every
+request with the connection it came on, which shows directly whether the
+bridge's keepalive kept the socket warm between polls.
+
+bench: runs the server in a thread and a client that polls it the way the
+bridge does (one small GET, then --gap-ms idle), three ways:
+  cold     a new connection and a full handshake for every request
+  resumed  a new connection that resumes the previous TLS session
+  warm     one kept-alive connection for all requests
+and reports handshake and transfer times for each. Absolute times are the
+host's, not the ESP8266's (a full BearSSL handshake there takes seconds);
+the ratio between the three, and the handshake count, are what to compare.
+
+TLS is capped at 1.2 because BearSSL on the ESP8266 stops there. A
+self-signed certificate is made with the openssl command on first use.
+"""
+import argparse
+import json
+import os
+import socket
+import ssl
+import subprocess
+import tempfile
+import threading
+import time
+
+CERT_DIR = os.path.join(tempfile.gettempdir(), "smart_lock_standin")
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def certificate():
+    cert = os.path.join(CERT_DIR, "cert.pem")
+    key = os.path.join(CERT_DIR, "key.pem")
+    if not os.path.exists(cert):
+        os.makedirs(CERT_DIR, exist_ok=True)
+        subprocess.run(["openssl", "req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "365",
+                        "-subj", "/CN=localhost", "-keyout", key, "-out", cert],
+                       check=True, capture_output=True)
+    return cert, key
+
+
+class Tree:
+    """Just enough of the Realtime Database: paths, set, update, push, delete."""
+
+    def __init__(self):
+        self.root = {}
+        self.lock = threading.Lock()
+        self.pushes = 0
+
+    def _walk(self, parts, create):
+        node = self.root
+        for part in parts:
+            if not isinstance(node, dict) or (part not in node and not create):
+                return None
+            node = node.setdefault(part, {}) if create else node[part]
+        return node
+
+    def handle(self, method, path, body):
+        parts = [p for p in path.split("?")[0][:-len(".json")].split("/") if p]
+        with self.lock:
+            if method == "GET":
+                return self._walk(parts, False)
+            value = json.loads(body) if body else None
+            parent = self._walk(parts[:-1], True) if parts else None
+            if method == "PUT":
+                if parts:
+                    parent[parts[-1]] = value
+                else:
+                    self.root = value or {}
+            elif method == "PATCH":
+                node = self._walk(parts, True)
+                for key, item in (value or {}).items():
+                    if item is None:
+                        node.pop(key, None)
+                    else:
+                        node[key] = item
+            elif method == "POST":
+                self.pushes += 1
+                name = "-N%019d" % self.pushes
+                self._walk(parts, True)[name] = value
+                return {"name": name}
+            elif method == "DELETE" and parts:
+                parent.pop(parts[-1], None)
+            return value
+
+
+def read_request(stream):
+    line = stream.readline()
+    if not line:
+        return None
+    method, path, _ = line.decode().split(" ", 2)
+    headers = {}
+    while True:
+        header = stream.readline().decode().strip()
+        if not header:
+            break
+        name, _, value = header.partition(":")
+        headers[name.strip().lower()] = value.strip()
+    body = stream.read(int(headers.get("content-length", 0)))
+    return method, path, headers, body
+
+
+def serve_connection(raw, context, tree, log, verbose):
+    raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    start = time.perf_counter()
+    try:
+        conn = context.wrap_socket(raw, server_side=True)
+    except (ssl.SSLError, OSError):
+        raw.close()
+        return
+    entry = {"handshake_ms": (time.perf_counter() - start) * 1000,
+             "resumed": conn.session_reused, "requests": 0}
+    log.append(entry)
+    if verbose:
+        print("connection %d: handshake %.1f ms, %s" % (
+            len(log), entry["handshake_ms"], "resumed" if entry["resumed"] else "full"))
+    stream = conn.makefile("rb")
+    try:
+        while True:
+            request = read_request(stream)
+            if request is None:
+                break
+            method, path, headers, body = request
+            entry["requests"] += 1
+            answer = tree.handle(method, path, body)
+            silent = "print=silent" in path
+            payload = b"" if silent else json.dumps(answer).encode()
+            status = "204 No Content" if silent else "200 OK"
+            conn.sendall(("HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %d\r\n"
+                          "Connection: keep-alive\r\n\r\n" % (status, len(payload))).encode() + payload)
+            if verbose:
+                print("  %s %s on connection %d" % (method, path, len(log)))
+    except (ssl.SSLError, OSError, ValueError):
+        pass
+    finally:
+        conn.close()
+
+
+def server_context():
+    cert, key = certificate()
+    context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+    context.maximum_version = ssl.TLSVersion.TLSv1_2
+    context.load_cert_chain(cert, key)
+    return context
+
+
+def start_server(port, verbose):
+    context = server_context()
+    tree = Tree()
+    log = []
+    listener = socket.create_server(("0.0.0.0", port))
+
+    def accept():
+        while True:
+            raw, _ = listener.accept()
+            threading.Thread(target=serve_connection, args=(raw, context, tree, log, verbose), daemon=True).start()
+
+    threading.Thread(target=accept, daemon=True).start()
+    return listener.getsockname()[1], log
+
+
+def get(conn, path):
+    conn.sendall(("GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: keep-alive\r\n\r\n" % path).encode())
+    stream = conn.makefile("rb")
+    status = stream.readline()
+    length = 0
+    while True:
+        header = stream.readline().decode().strip()
+        if not header:
+            break
+        if header.lower().startswith("content-length:"):
+            length = int(header.split(":")[1])
+    stream.read(length)
+    return status
+
+
+def bench(args):
+    port, log = start_server(0, False)
+    client = ssl.SSLContext(ssl.PROTOCOL_TLS_CLIENT)
+    client.check_hostname = False
+    client.verify_mode = ssl.CERT_NONE
+    client.maximum_version = ssl.TLSVersion.TLSv1_2
+    path = "/smart_lock/commands.json?orderBy=%22$key%22&limitToFirst=4"
+
+    print("%d requests, %d ms apart, against 127.0.0.1:%d" % (args.requests, args.gap_ms, port))
+    print("mode      handshakes  handshake p50 ms  transfer p50/p99 ms  total/request ms")
+    for mode in ("cold", "resumed", "warm"):
+        before = len(log)
+        handshake, transfer, total = [], [], []
+        session = None
+        conn = None
+        for _ in range(args.requests):
+            start = time.perf_counter()
+            if conn is None or mode != "warm":
+                if conn is not None:
+                    conn.close()
+                raw = socket.create_connection(("127.0.0.1", port))
+                raw.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)  # as the ESP8266 client does
+                conn = client.wrap_socket(raw, session=session if mode == "resumed" else None)
+                handshake.append((time.perf_counter() - start) * 1000)
+            sent = time.perf_counter()
+            get(conn, path)
+            transfer.append((time.perf_counter() - sent) * 1000)
+            total.append((time.perf_counter() - start) * 1000)
+            session = conn.session
+            time.sleep(args.gap_ms / 1000.0)
+        conn.close()
+        time.sleep(0.05)
+        served = log[before:]
+        resumed = sum(1 for entry in served if entry["resumed"])
+        print("%-8s  %4d (%d resumed)  %16.2f  %8.2f / %-8.2f  %16.2f" % (
+            mode, len(served), resumed, percentile(handshake, 50),
+            percentile(transfer, 50), percentile(transfer, 99), sum(total) / len(total)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest="command", required=True)
+    serve = sub.add_parser("serve")
+    serve.add_argument("--port", type=int, default=8443)
+    run = sub.add_parser("bench")
+    run.add_argument("--requests", type=int, default=30)
+    run.add_argument("--gap-ms", type=int, default=200, help="idle time between requests, as between polls")
+    args = parser.parse_args()
+
+    if args.command == "serve":
+        port, _ = start_server(args.port, True)
+        print("serving https://0.0.0.0:%d/ (Ctrl-C to stop)" % port)
+        try:
+            while True:
+                time.sleep(3600)
+        except KeyboardInterrupt:
+            pass
+    else:
+        bench(args)
+
+
+if __name__ == "__main__":
+    main()